@@ -0,0 +1,629 @@
+/**
+ * _smmasset.c, Python bindings for libsmm-asset
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <smm-asset.h>
+
+/*
+ * Every call that may touch the network drops the GIL for its duration,
+ * the library serialises access to each connection internally.
+ */
+
+typedef struct
+{
+	PyObject_HEAD
+	smm_connection conn;
+} ConnectionObject;
+
+/* Owns the array returned by smm_asset_get_assets, shared by each Asset */
+typedef struct
+{
+	PyObject_HEAD
+	PyObject *connection;
+	smm_assets assets;
+	size_t assets_count;
+} AssetListObject;
+
+typedef struct
+{
+	PyObject_HEAD
+	PyObject *owner;
+	smm_asset asset;
+} AssetObject;
+
+typedef struct
+{
+	PyObject_HEAD
+	PyObject *asset;
+	smm_search search;
+} SearchObject;
+
+typedef struct
+{
+	PyObject_HEAD
+	struct smm_waypoint_s *waypoints;
+	size_t waypoints_count;
+	Py_ssize_t shape[2];
+	Py_ssize_t strides[2];
+} WaypointsObject;
+
+static PyTypeObject ConnectionType;
+static PyTypeObject AssetListType;
+static PyTypeObject AssetType;
+static PyTypeObject SearchType;
+static PyTypeObject WaypointsType;
+
+/* Connection */
+
+static int
+Connection_init (ConnectionObject * self, PyObject * args, PyObject * kwds)
+{
+	static char *kwlist[] = { "host", "user", "password", NULL };
+	const char *host = NULL;
+	const char *user = NULL;
+	const char *pass = NULL;
+
+	if (!PyArg_ParseTupleAndKeywords (args, kwds, "sss", kwlist, &host, &user, &pass))
+	{
+		return -1;
+	}
+	if (self->conn != NULL)
+	{
+		PyErr_SetString (PyExc_RuntimeError, "Connection already initialised");
+		return -1;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	self->conn = smm_asset_connect (host, user, pass);
+	Py_END_ALLOW_THREADS
+	if (self->conn == NULL)
+	{
+		PyErr_NoMemory ();
+		return -1;
+	}
+	return 0;
+}
+
+static void
+Connection_dealloc (ConnectionObject * self)
+{
+	smm_connection_close (self->conn);
+	Py_TYPE (self)->tp_free ((PyObject *) self);
+}
+
+static PyObject *
+Connection_state (ConnectionObject * self, PyObject * Py_UNUSED (ignored))
+{
+	return PyLong_FromLong (smm_asset_connection_get_state (self->conn));
+}
+
+static PyObject *
+Connection_get_assets (ConnectionObject * self, PyObject * Py_UNUSED (ignored))
+{
+	smm_assets assets = NULL;
+	size_t assets_count = 0;
+	bool ok;
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = smm_asset_get_assets (self->conn, &assets, &assets_count);
+	Py_END_ALLOW_THREADS
+	if (!ok)
+	{
+		PyErr_SetString (PyExc_ConnectionError, "Unable to retrieve assets");
+		return NULL;
+	}
+
+	AssetListObject *owner = PyObject_New (AssetListObject, &AssetListType);
+	if (owner == NULL)
+	{
+		smm_asset_free_assets (assets, assets_count);
+		return NULL;
+	}
+	Py_INCREF (self);
+	owner->connection = (PyObject *) self;
+	owner->assets = assets;
+	owner->assets_count = assets_count;
+
+	PyObject *list = PyList_New ((Py_ssize_t) assets_count);
+	if (list == NULL)
+	{
+		Py_DECREF (owner);
+		return NULL;
+	}
+	for (size_t i = 0; i < assets_count; i++)
+	{
+		AssetObject *asset = PyObject_New (AssetObject, &AssetType);
+		if (asset == NULL)
+		{
+			Py_DECREF (list);
+			Py_DECREF (owner);
+			return NULL;
+		}
+		Py_INCREF (owner);
+		asset->owner = (PyObject *) owner;
+		asset->asset = assets[i];
+		PyList_SET_ITEM (list, (Py_ssize_t) i, (PyObject *) asset);
+	}
+	Py_DECREF (owner);
+	return list;
+}
+
+static PyMethodDef Connection_methods[] = {
+	{"state", (PyCFunction) Connection_state, METH_NOARGS, "Current smm_connection_status of the connection"},
+	{"get_assets", (PyCFunction) Connection_get_assets, METH_NOARGS, "List the assets this account has access to"},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject ConnectionType = {
+	PyVarObject_HEAD_INIT (NULL, 0)
+	.tp_name = "_smmasset.Connection",
+	.tp_doc = "A connection to a Search Management Map server",
+	.tp_basicsize = sizeof (ConnectionObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc) Connection_init,
+	.tp_dealloc = (destructor) Connection_dealloc,
+	.tp_methods = Connection_methods,
+};
+
+/* AssetList */
+
+static void
+AssetList_dealloc (AssetListObject * self)
+{
+	smm_asset_free_assets (self->assets, self->assets_count);
+	Py_XDECREF (self->connection);
+	Py_TYPE (self)->tp_free ((PyObject *) self);
+}
+
+static PyTypeObject AssetListType = {
+	PyVarObject_HEAD_INIT (NULL, 0)
+	.tp_name = "_smmasset._AssetList",
+	.tp_basicsize = sizeof (AssetListObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc = (destructor) AssetList_dealloc,
+};
+
+/* Asset */
+
+static void
+Asset_dealloc (AssetObject * self)
+{
+	Py_XDECREF (self->owner);
+	Py_TYPE (self)->tp_free ((PyObject *) self);
+}
+
+static PyObject *
+string_or_none (const char *str)
+{
+	if (str == NULL)
+	{
+		Py_RETURN_NONE;
+	}
+	return PyUnicode_FromString (str);
+}
+
+static PyObject *
+Asset_get_name (AssetObject * self, void *Py_UNUSED (closure))
+{
+	return string_or_none (smm_asset_name (self->asset));
+}
+
+static PyObject *
+Asset_get_type (AssetObject * self, void *Py_UNUSED (closure))
+{
+	return string_or_none (smm_asset_type (self->asset));
+}
+
+static PyObject *
+Asset_report_position (AssetObject * self, PyObject * args, PyObject * kwds)
+{
+	static char *kwlist[] = { "latitude", "longitude", "altitude", "bearing", "fix", NULL };
+	double latitude = 0.0;
+	double longitude = 0.0;
+	unsigned int altitude = 0;
+	unsigned short bearing = 0;
+	unsigned char fix = 0;
+	bool ok;
+
+	if (!PyArg_ParseTupleAndKeywords (args, kwds, "dd|IHb", kwlist, &latitude, &longitude, &altitude, &bearing, &fix))
+	{
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = smm_asset_report_position (self->asset, latitude, longitude, altitude, bearing, fix);
+	Py_END_ALLOW_THREADS
+	return PyBool_FromLong (ok);
+}
+
+static PyObject *
+Asset_last_command (AssetObject * self, PyObject * Py_UNUSED (ignored))
+{
+	return PyLong_FromLong (smm_asset_last_command (self->asset));
+}
+
+static PyObject *
+Asset_last_goto_pos (AssetObject * self, PyObject * Py_UNUSED (ignored))
+{
+	double lat = 0.0;
+	double lon = 0.0;
+	if (!smm_asset_last_goto_pos (self->asset, &lat, &lon))
+	{
+		Py_RETURN_NONE;
+	}
+	return Py_BuildValue ("(dd)", lat, lon);
+}
+
+static PyObject *
+Asset_get_search (AssetObject * self, PyObject * args)
+{
+	double latitude = 0.0;
+	double longitude = 0.0;
+	smm_search search = NULL;
+
+	if (!PyArg_ParseTuple (args, "dd", &latitude, &longitude))
+	{
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	search = smm_asset_get_search (self->asset, latitude, longitude);
+	Py_END_ALLOW_THREADS
+	if (search == NULL)
+	{
+		Py_RETURN_NONE;
+	}
+
+	SearchObject *obj = PyObject_New (SearchObject, &SearchType);
+	if (obj == NULL)
+	{
+		smm_search_destroy (search);
+		return NULL;
+	}
+	Py_INCREF (self);
+	obj->asset = (PyObject *) self;
+	obj->search = search;
+	return (PyObject *) obj;
+}
+
+static PyGetSetDef Asset_getset[] = {
+	{"name", (getter) Asset_get_name, NULL, "Name of the asset", NULL},
+	{"type", (getter) Asset_get_type, NULL, "Type of the asset", NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyMethodDef Asset_methods[] = {
+	{"report_position", (PyCFunction) (void (*)(void)) Asset_report_position, METH_VARARGS | METH_KEYWORDS,
+	 "Report the current position of the asset"},
+	{"last_command", (PyCFunction) Asset_last_command, METH_NOARGS, "The last smm_asset_command seen from the server"},
+	{"last_goto_pos", (PyCFunction) Asset_last_goto_pos, METH_NOARGS, "(lat, lon) of the current goto command, or None"},
+	{"get_search", (PyCFunction) Asset_get_search, METH_VARARGS, "Get a search to perform, or None"},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject AssetType = {
+	PyVarObject_HEAD_INIT (NULL, 0)
+	.tp_name = "_smmasset.Asset",
+	.tp_doc = "An asset on a Search Management Map server",
+	.tp_basicsize = sizeof (AssetObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc = (destructor) Asset_dealloc,
+	.tp_methods = Asset_methods,
+	.tp_getset = Asset_getset,
+};
+
+/* Search */
+
+static void
+Search_dealloc (SearchObject * self)
+{
+	smm_search_destroy (self->search);
+	Py_XDECREF (self->asset);
+	Py_TYPE (self)->tp_free ((PyObject *) self);
+}
+
+static PyObject *
+Search_get_distance (SearchObject * self, void *Py_UNUSED (closure))
+{
+	return PyLong_FromUnsignedLongLong (smm_search_distance (self->search));
+}
+
+static PyObject *
+Search_get_length (SearchObject * self, void *Py_UNUSED (closure))
+{
+	return PyLong_FromUnsignedLongLong (smm_search_length (self->search));
+}
+
+static PyObject *
+Search_get_sweep_width (SearchObject * self, void *Py_UNUSED (closure))
+{
+	return PyLong_FromUnsignedLongLong (smm_search_sweep_width (self->search));
+}
+
+static PyObject *
+Search_get_waypoints (SearchObject * self, PyObject * Py_UNUSED (ignored))
+{
+	struct smm_waypoint_s *waypoints = NULL;
+	size_t waypoints_count = 0;
+	bool ok;
+
+	Py_BEGIN_ALLOW_THREADS
+	ok = smm_search_get_waypoint_array (self->search, &waypoints, &waypoints_count);
+	Py_END_ALLOW_THREADS
+	if (!ok)
+	{
+		PyErr_SetString (PyExc_ConnectionError, "Unable to retrieve waypoints");
+		return NULL;
+	}
+
+	WaypointsObject *obj = PyObject_New (WaypointsObject, &WaypointsType);
+	if (obj == NULL)
+	{
+		smm_waypoint_array_free (waypoints);
+		return NULL;
+	}
+	obj->waypoints = waypoints;
+	obj->waypoints_count = waypoints_count;
+	obj->shape[0] = (Py_ssize_t) waypoints_count;
+	obj->shape[1] = 2;
+	obj->strides[0] = sizeof (struct smm_waypoint_s);
+	obj->strides[1] = sizeof (double);
+	return (PyObject *) obj;
+}
+
+static PyObject *
+Search_update (SearchObject * self, PyObject * Py_UNUSED (ignored))
+{
+	bool ok;
+	Py_BEGIN_ALLOW_THREADS
+	ok = smm_search_update (self->search);
+	Py_END_ALLOW_THREADS
+	return PyBool_FromLong (ok);
+}
+
+static PyObject *
+Search_accept (SearchObject * self, PyObject * Py_UNUSED (ignored))
+{
+	bool ok;
+	Py_BEGIN_ALLOW_THREADS
+	ok = smm_search_accept (self->search);
+	Py_END_ALLOW_THREADS
+	return PyBool_FromLong (ok);
+}
+
+static PyObject *
+Search_complete (SearchObject * self, PyObject * Py_UNUSED (ignored))
+{
+	bool ok;
+	Py_BEGIN_ALLOW_THREADS
+	ok = smm_search_complete (self->search);
+	Py_END_ALLOW_THREADS
+	return PyBool_FromLong (ok);
+}
+
+static PyGetSetDef Search_getset[] = {
+	{"distance", (getter) Search_get_distance, NULL, "Distance in meters to the start of the search", NULL},
+	{"length", (getter) Search_get_length, NULL, "Total length of the search in meters", NULL},
+	{"sweep_width", (getter) Search_get_sweep_width, NULL, "Sweep width of the search in meters", NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyMethodDef Search_methods[] = {
+	{"get_waypoints", (PyCFunction) Search_get_waypoints, METH_NOARGS,
+	 "Get the waypoints as a Waypoints buffer, downloaded on first use then kept until update()"},
+	{"update", (PyCFunction) Search_update, METH_NOARGS, "Pick up changes made to the waypoints on the server"},
+	{"accept", (PyCFunction) Search_accept, METH_NOARGS, "Accept the search"},
+	{"complete", (PyCFunction) Search_complete, METH_NOARGS, "Mark the search as completed"},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject SearchType = {
+	PyVarObject_HEAD_INIT (NULL, 0)
+	.tp_name = "_smmasset.Search",
+	.tp_doc = "A search offered to an asset",
+	.tp_basicsize = sizeof (SearchObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc = (destructor) Search_dealloc,
+	.tp_methods = Search_methods,
+	.tp_getset = Search_getset,
+};
+
+/* Waypoints, exported as a read-only N x 2 buffer of doubles (lat, lon) */
+
+static void
+Waypoints_dealloc (WaypointsObject * self)
+{
+	smm_waypoint_array_free (self->waypoints);
+	Py_TYPE (self)->tp_free ((PyObject *) self);
+}
+
+static int
+Waypoints_getbuffer (WaypointsObject * self, Py_buffer * view, int flags)
+{
+	if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE)
+	{
+		PyErr_SetString (PyExc_BufferError, "Waypoints are read-only");
+		view->obj = NULL;
+		return -1;
+	}
+
+	/* An N x 2 array is never Fortran contiguous, unless it has at most one row */
+	if ((flags & PyBUF_F_CONTIGUOUS) == PyBUF_F_CONTIGUOUS && self->waypoints_count > 1)
+	{
+		PyErr_SetString (PyExc_BufferError, "Waypoints are not Fortran contiguous");
+		view->obj = NULL;
+		return -1;
+	}
+
+	view->buf = self->waypoints;
+	view->obj = (PyObject *) self;
+	view->len = (Py_ssize_t) (self->waypoints_count * sizeof (struct smm_waypoint_s));
+	view->readonly = 1;
+	if ((flags & PyBUF_ND) == PyBUF_ND)
+	{
+		view->itemsize = sizeof (double);
+		view->format = (flags & PyBUF_FORMAT) ? (char *) "d" : NULL;
+		view->ndim = 2;
+		view->shape = self->shape;
+		view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+	}
+	else
+	{
+		/* Without a shape the consumer can only see the bytes */
+		view->itemsize = 1;
+		view->format = (flags & PyBUF_FORMAT) ? (char *) "B" : NULL;
+		view->ndim = 1;
+		view->shape = NULL;
+		view->strides = NULL;
+	}
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	Py_INCREF (self);
+	return 0;
+}
+
+static Py_ssize_t
+Waypoints_length (WaypointsObject * self)
+{
+	return (Py_ssize_t) self->waypoints_count;
+}
+
+static PyObject *
+Waypoints_item (WaypointsObject * self, Py_ssize_t i)
+{
+	if (i < 0 || (size_t) i >= self->waypoints_count)
+	{
+		PyErr_SetString (PyExc_IndexError, "waypoint index out of range");
+		return NULL;
+	}
+	return Py_BuildValue ("(dd)", self->waypoints[i].lat, self->waypoints[i].lon);
+}
+
+static PyBufferProcs Waypoints_as_buffer = {
+	(getbufferproc) Waypoints_getbuffer,
+	NULL,
+};
+
+static PySequenceMethods Waypoints_as_sequence = {
+	.sq_length = (lenfunc) Waypoints_length,
+	.sq_item = (ssizeargfunc) Waypoints_item,
+};
+
+static PyTypeObject WaypointsType = {
+	PyVarObject_HEAD_INIT (NULL, 0)
+	.tp_name = "_smmasset.Waypoints",
+	.tp_doc = "Search waypoints, supports the buffer protocol as an N x 2 array of (lat, lon) doubles",
+	.tp_basicsize = sizeof (WaypointsObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc = (destructor) Waypoints_dealloc,
+	.tp_as_buffer = &Waypoints_as_buffer,
+	.tp_as_sequence = &Waypoints_as_sequence,
+};
+
+/* Module */
+
+static PyObject *
+module_debugging_set (PyObject * Py_UNUSED (module), PyObject * arg)
+{
+	int debug = PyObject_IsTrue (arg);
+	if (debug < 0)
+	{
+		return NULL;
+	}
+	smm_asset_debugging_set (debug);
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef module_methods[] = {
+	{"debugging_set", (PyCFunction) module_debugging_set, METH_O, "Enable/disable library debugging"},
+	{NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef smmasset_module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "_smmasset",
+	.m_doc = "Bindings for the Search Management Map asset library",
+	.m_size = -1,
+	.m_methods = module_methods,
+};
+
+static int
+add_type (PyObject * module, PyTypeObject * type, const char *name)
+{
+	if (PyType_Ready (type) < 0)
+	{
+		return -1;
+	}
+	if (name == NULL)
+	{
+		return 0;
+	}
+	Py_INCREF (type);
+	if (PyModule_AddObject (module, name, (PyObject *) type) < 0)
+	{
+		Py_DECREF (type);
+		return -1;
+	}
+	return 0;
+}
+
+PyMODINIT_FUNC PyInit__smmasset (void);
+
+PyMODINIT_FUNC
+PyInit__smmasset (void)
+{
+	PyObject *module = PyModule_Create (&smmasset_module);
+	if (module == NULL)
+	{
+		return NULL;
+	}
+
+	if (add_type (module, &ConnectionType, "Connection") < 0 ||
+	    add_type (module, &AssetListType, NULL) < 0 ||
+	    add_type (module, &AssetType, "Asset") < 0 ||
+	    add_type (module, &SearchType, "Search") < 0 ||
+	    add_type (module, &WaypointsType, "Waypoints") < 0)
+	{
+		Py_DECREF (module);
+		return NULL;
+	}
+
+	PyModule_AddIntConstant (module, "CONNECTION_UNKNOWN", SMM_CONNECTION_UNKNOWN);
+	PyModule_AddIntConstant (module, "CONNECTION_CONNECTED", SMM_CONNECTION_CONNECTED);
+	PyModule_AddIntConstant (module, "CONNECTION_HOST_INVALID", SMM_CONNECTION_HOST_INVALID);
+	PyModule_AddIntConstant (module, "CONNECTION_NO_HOST_CONNECTION", SMM_CONNECTION_NO_HOST_CONNECTION);
+	PyModule_AddIntConstant (module, "CONNECTION_AUTHENTICATION_FAILURE", SMM_CONNECTION_AUTHENTICATION_FAILURE);
+	PyModule_AddIntConstant (module, "CONNECTION_FAILURE", SMM_CONNECTION_FAILURE);
+
+	PyModule_AddIntConstant (module, "COMMAND_NONE", SMM_COMMAND_NONE);
+	PyModule_AddIntConstant (module, "COMMAND_CIRCLE", SMM_COMMAND_CIRCLE);
+	PyModule_AddIntConstant (module, "COMMAND_RTL", SMM_COMMAND_RTL);
+	PyModule_AddIntConstant (module, "COMMAND_GOTO", SMM_COMMAND_GOTO);
+	PyModule_AddIntConstant (module, "COMMAND_CONTINUE", SMM_COMMAND_CONTINUE);
+	PyModule_AddIntConstant (module, "COMMAND_ABANDON_SEARCH", SMM_COMMAND_ABANDON_SEARCH);
+	PyModule_AddIntConstant (module, "COMMAND_MISSION_COMPLETE", SMM_COMMAND_MISSION_COMPLETE);
+	PyModule_AddIntConstant (module, "COMMAND_UNKNOWN", SMM_COMMAND_UNKNOWN);
+
+	return module;
+}
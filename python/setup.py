@@ -0,0 +1,30 @@
+# setup.py, build the Python bindings for libsmm-asset
+#
+# libsmm-asset must be installed first so pkg-config can find smm-asset.pc
+
+import subprocess
+
+from setuptools import Extension, setup
+
+
+def pkgconfig(flag):
+    out = subprocess.check_output(["pkg-config", flag, "smm-asset"], text=True)
+    return [arg[2:] for arg in out.split()]
+
+
+setup(
+    name="smmasset",
+    version="0.3.1",
+    description="Python bindings for the Search Management Map asset library",
+    license="LGPL-2.1-or-later",
+    packages=["smmasset"],
+    ext_modules=[
+        Extension(
+            "smmasset._smmasset",
+            sources=["_smmasset.c"],
+            include_dirs=pkgconfig("--cflags-only-I"),
+            library_dirs=pkgconfig("--libs-only-L"),
+            libraries=pkgconfig("--libs-only-l"),
+        )
+    ],
+)
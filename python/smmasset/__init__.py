@@ -0,0 +1,75 @@
+# smmasset, Python bindings for libsmm-asset
+#
+# Blocking calls release the GIL, so the asyncio helpers below simply run them
+# on a thread pool.  Size the pool with set_executor() when driving many assets.
+
+import asyncio
+import concurrent.futures
+import functools
+
+from ._smmasset import *  # noqa: F401,F403
+from ._smmasset import Asset, Connection, Search
+
+_executor = None
+
+
+def set_executor(executor):
+    """Use executor for the async helpers, e.g. a ThreadPoolExecutor(max_workers=256)"""
+    global _executor
+    _executor = executor
+
+
+def _get_executor():
+    global _executor
+    if _executor is None:
+        _executor = concurrent.futures.ThreadPoolExecutor(thread_name_prefix="smmasset")
+    return _executor
+
+
+async def _run(func, *args, **kwargs):
+    loop = asyncio.get_running_loop()
+    return await loop.run_in_executor(_get_executor(), functools.partial(func, *args, **kwargs))
+
+
+async def connect(host, user, password):
+    """Connect to an SMM server without blocking the event loop"""
+    return await _run(Connection, host, user, password)
+
+
+async def get_assets(connection):
+    return await _run(connection.get_assets)
+
+
+async def report_position(asset, latitude, longitude, altitude=0, bearing=0, fix=0):
+    return await _run(asset.report_position, latitude, longitude, altitude, bearing, fix)
+
+
+async def get_search(asset, latitude, longitude):
+    return await _run(asset.get_search, latitude, longitude)
+
+
+async def get_waypoints(search):
+    return await _run(search.get_waypoints)
+
+
+async def accept(search):
+    return await _run(search.accept)
+
+
+async def complete(search):
+    return await _run(search.complete)
+
+
+__all__ = [
+    "Asset",
+    "Connection",
+    "Search",
+    "accept",
+    "complete",
+    "connect",
+    "get_assets",
+    "get_search",
+    "get_waypoints",
+    "report_position",
+    "set_executor",
+]
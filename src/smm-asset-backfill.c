@@ -0,0 +1,317 @@
+/**
+ * smm-asset-backfill.c, Simplify and upload portions of an asset's recorded track
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct smm_backfill_s
+{
+	smm_asset asset;
+	smm_fix *fixes;
+	size_t fixes_count;
+	size_t sent;
+	/* Fix i is sent with seq first_seq + i, so the server keeps one copy of a chunk sent twice */
+	uint64_t first_seq;
+};
+
+struct simplify_point
+{
+	double x;
+	double y;
+};
+
+static double
+segment_distance_sq (const struct simplify_point *p, const struct simplify_point *a, const struct simplify_point *b)
+{
+	double dx = b->x - a->x;
+	double dy = b->y - a->y;
+	double len_sq = dx * dx + dy * dy;
+	double t = 0.0;
+	if (len_sq > 0.0)
+	{
+		t = ((p->x - a->x) * dx + (p->y - a->y) * dy) / len_sq;
+		t = t < 0.0 ? 0.0 : (t > 1.0 ? 1.0 : t);
+	}
+	double ex = a->x + t * dx - p->x;
+	double ey = a->y + t * dy - p->y;
+	return ex * ex + ey * ey;
+}
+
+size_t
+smm_fixes_simplify (smm_fix * fixes, size_t fixes_count, double tolerance_m, double turn_degrees)
+{
+	if (fixes == NULL || fixes_count < 3)
+	{
+		return fixes_count;
+	}
+
+	struct simplify_point *points = malloc (fixes_count * sizeof (struct simplify_point));
+	uint8_t *keep = calloc (fixes_count, sizeof (uint8_t));
+	/* Pending segments never overlap, so there can't be more than fixes_count of them */
+	size_t *stack = malloc (fixes_count * 2 * sizeof (size_t));
+	if (points == NULL || keep == NULL || stack == NULL)
+	{
+		free (points);
+		free (keep);
+		free (stack);
+		return fixes_count;
+	}
+
+	/* Project onto a local plane, good enough over the length of a track */
+	double lat0 = fixes[0].lat;
+	double lon0 = fixes[0].lon;
+	double x_scale = cos (lat0 * M_PI / 180.0) * SMM_METERS_PER_DEGREE;
+	for (size_t i = 0; i < fixes_count; i++)
+	{
+		points[i].x = (fixes[i].lon - lon0) * x_scale;
+		points[i].y = (fixes[i].lat - lat0) * SMM_METERS_PER_DEGREE;
+	}
+
+	keep[0] = 1;
+	keep[fixes_count - 1] = 1;
+	if (turn_degrees > 0.0)
+	{
+		for (size_t i = 1; i < fixes_count; i++)
+		{
+			int diff = abs ((int) fixes[i].bearing - (int) fixes[i - 1].bearing) % 360;
+			if (diff > 180)
+			{
+				diff = 360 - diff;
+			}
+			if (diff >= turn_degrees)
+			{
+				keep[i - 1] = 1;
+				keep[i] = 1;
+			}
+		}
+	}
+
+	size_t top = 0;
+	size_t first = 0;
+	for (size_t i = 1; i < fixes_count; i++)
+	{
+		if (keep[i])
+		{
+			stack[top++] = first;
+			stack[top++] = i;
+			first = i;
+		}
+	}
+
+	double tolerance_sq = tolerance_m * tolerance_m;
+	while (top > 0)
+	{
+		size_t last = stack[--top];
+		first = stack[--top];
+		double max_sq = 0.0;
+		size_t max_index = first;
+		for (size_t i = first + 1; i < last; i++)
+		{
+			double d = segment_distance_sq (&points[i], &points[first], &points[last]);
+			if (d > max_sq)
+			{
+				max_sq = d;
+				max_index = i;
+			}
+		}
+		if (max_sq > tolerance_sq)
+		{
+			keep[max_index] = 1;
+			stack[top++] = first;
+			stack[top++] = max_index;
+			stack[top++] = max_index;
+			stack[top++] = last;
+		}
+	}
+
+	size_t count = 0;
+	for (size_t i = 0; i < fixes_count; i++)
+	{
+		if (keep[i])
+		{
+			fixes[count++] = fixes[i];
+		}
+	}
+
+	free (points);
+	free (keep);
+	free (stack);
+
+	return count;
+}
+
+smm_backfill
+smm_asset_backfill_create (smm_asset asset, uint64_t from_ms, uint64_t to_ms, double tolerance_m, double turn_degrees)
+{
+	if (asset == NULL || asset->track == NULL)
+	{
+		return NULL;
+	}
+
+	smm_backfill backfill = calloc (1, sizeof (struct smm_backfill_s));
+	if (backfill == NULL)
+	{
+		return NULL;
+	}
+	backfill->asset = asset;
+
+	if (!smm_track_get (asset->track, from_ms, to_ms, NULL, &backfill->fixes, &backfill->fixes_count))
+	{
+		free (backfill);
+		return NULL;
+	}
+
+	size_t before = backfill->fixes_count;
+	backfill->fixes_count = smm_fixes_simplify (backfill->fixes, backfill->fixes_count, tolerance_m, turn_degrees);
+	DEBUG ("Simplified %zu fixes to %zu\n", before, backfill->fixes_count);
+	if (backfill->fixes_count > 0 && backfill->fixes_count < before)
+	{
+		smm_fix *tmp = realloc (backfill->fixes, backfill->fixes_count * sizeof (smm_fix));
+		if (tmp)
+		{
+			backfill->fixes = tmp;
+		}
+	}
+	backfill->first_seq = smm_report_seq_reserve (asset, backfill->fixes_count);
+
+	return backfill;
+}
+
+enum smm_backfill_result
+{
+	SMM_BACKFILL_SENT,
+	SMM_BACKFILL_DEFERRED,
+	SMM_BACKFILL_FAILED,
+};
+
+/* Send the next count fixes in one request */
+static enum smm_backfill_result
+smm_backfill_send_chunk (smm_backfill backfill, size_t count)
+{
+	struct buffer_s buf = { NULL, 0 };
+	char *post_data = NULL;
+	size_t post_len = 0;
+	char *page = NULL;
+	smm_connection conn = backfill->asset->conn;
+
+	/* time,lat,lon,alt,bearing,fix,seq;... */
+	FILE *post = open_memstream (&post_data, &post_len);
+	if (post == NULL)
+	{
+		return SMM_BACKFILL_FAILED;
+	}
+	fprintf (post, "positions=");
+	for (size_t i = backfill->sent; i < backfill->sent + count; i++)
+	{
+		const smm_fix *fix = &backfill->fixes[i];
+		uint64_t time_ms = smm_connection_server_time (conn, fix->time_ms);
+		fprintf (post, "%s%llu,%.6f,%.6f,%u,%u,%u,%llu", i == backfill->sent ? "" : ";", (unsigned long long) time_ms, fix->lat, fix->lon,
+			 fix->altitude, fix->bearing, fix->fix, (unsigned long long) (backfill->first_seq + i));
+	}
+	if (fclose (post) != 0)
+	{
+		free (post_data);
+		return SMM_BACKFILL_FAILED;
+	}
+
+	if (asprintf (&page, "/data/assets/%lld/position/add/bulk/", backfill->asset->asset_id) < 0)
+	{
+		free (post_data);
+		return SMM_BACKFILL_FAILED;
+	}
+
+	enum smm_backfill_result result = SMM_BACKFILL_FAILED;
+	struct smm_curl_res_s *res = smm_connection_curl_request (conn, page, post_data, to_buffer, &buf, SMM_REQUEST_BULK | SMM_REQUEST_CSRF);
+	if (res && res->deferred)
+	{
+		result = SMM_BACKFILL_DEFERRED;
+	}
+	else if (res && res->success && res->httpcode == HTTP_SUCCESS)
+	{
+		backfill->sent += count;
+		result = SMM_BACKFILL_SENT;
+	}
+	smm_curl_res_free (res);
+	free (buf.data);
+	free (page);
+	free (post_data);
+
+	return result;
+}
+
+bool
+smm_backfill_send (smm_backfill backfill, size_t max_fixes)
+{
+	if (backfill == NULL)
+	{
+		return false;
+	}
+
+	size_t remaining = backfill->fixes_count - backfill->sent;
+	size_t end = backfill->sent + ((max_fixes == 0 || max_fixes > remaining) ? remaining : max_fixes);
+
+	/* Small requests, so a live report never waits behind more than one of them */
+	while (backfill->sent < end)
+	{
+		size_t count = end - backfill->sent;
+		if (count > SMM_BACKFILL_CHUNK)
+		{
+			count = SMM_BACKFILL_CHUNK;
+		}
+		switch (smm_backfill_send_chunk (backfill, count))
+		{
+			case SMM_BACKFILL_SENT:
+				break;
+			case SMM_BACKFILL_DEFERRED:
+				DEBUG ("Live report waiting, deferring backfill\n");
+				return true;
+			case SMM_BACKFILL_FAILED:
+				return false;
+		}
+	}
+
+	return true;
+}
+
+size_t
+smm_backfill_remaining (smm_backfill backfill)
+{
+	if (backfill == NULL)
+	{
+		return 0;
+	}
+	return backfill->fixes_count - backfill->sent;
+}
+
+void
+smm_backfill_destroy (smm_backfill backfill)
+{
+	if (backfill)
+	{
+		smm_fixes_free (backfill->fixes);
+		free (backfill);
+	}
+}
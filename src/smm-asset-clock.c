@@ -0,0 +1,136 @@
+/**
+ * smm-asset-clock.c, Estimate the offset between our clock and the server clock
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+
+#include <strings.h>
+#include <string.h>
+
+/*
+ * Each response with a Date header bounds the offset: the server stamped
+ * the response somewhere inside the second named by the header, and we
+ * were waiting for it between sending the request and getting the reply.
+ * The estimate is the intersection of the recent bounds. Samples that
+ * contradict newer ones (after a clock step) are dropped, so a single
+ * short round trip outweighs any number of slow ones.
+ */
+
+size_t
+smm_clock_header (char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct smm_transfer *transfer = (struct smm_transfer *) userdata;
+	size_t bytes = size * nmemb;
+	static const char date[] = "Date:";
+
+	if (bytes > sizeof (date) - 1 && strncasecmp (ptr, date, sizeof (date) - 1) == 0)
+	{
+		char value[64];
+		size_t len = bytes - (sizeof (date) - 1);
+		if (len >= sizeof (value))
+		{
+			len = sizeof (value) - 1;
+		}
+		memcpy (value, ptr + sizeof (date) - 1, len);
+		value[len] = '\0';
+		transfer->response_date = curl_getdate (value, NULL);
+	}
+
+	return bytes;
+}
+
+void
+smm_clock_sample (smm_connection conn, uint64_t sent_ms, uint64_t received_ms, time_t date)
+{
+	struct smm_clock_s *clock = &conn->clock;
+	int64_t server_ms = (int64_t) date * 1000;
+
+	pthread_mutex_lock (&clock->lock);
+	struct smm_clock_sample *sample = &clock->samples[clock->next];
+	sample->low = server_ms - (int64_t) received_ms;
+	sample->high = server_ms + 999 - (int64_t) sent_ms;
+	clock->next = (clock->next + 1) % SMM_CLOCK_SAMPLES;
+	if (clock->count < SMM_CLOCK_SAMPLES)
+	{
+		clock->count++;
+	}
+
+	/* Intersect from the newest sample back */
+	int64_t low = sample->low;
+	int64_t high = sample->high;
+	size_t used = 1;
+	for (; used < clock->count; used++)
+	{
+		const struct smm_clock_sample *older = &clock->samples[(clock->next + SMM_CLOCK_SAMPLES - 1 - used) % SMM_CLOCK_SAMPLES];
+		int64_t l = older->low > low ? older->low : low;
+		int64_t h = older->high < high ? older->high : high;
+		if (l > h)
+		{
+			break;
+		}
+		low = l;
+		high = h;
+	}
+	/* Forget what disagrees with the newer samples */
+	clock->count = used;
+
+	int64_t offset_ms = low + (high - low) / 2;
+	uint64_t uncertainty_ms = (uint64_t) (high - low + 1) / 2;
+	clock->offset_ms = offset_ms;
+	clock->uncertainty_ms = uncertainty_ms;
+	clock->valid = true;
+	pthread_mutex_unlock (&clock->lock);
+
+	DEBUG ("offset %lld +/- %llu ms from %zu samples\n", (long long) offset_ms, (unsigned long long) uncertainty_ms, used);
+}
+
+bool
+smm_connection_clock_offset (smm_connection connection, int64_t *offset_ms, uint64_t *uncertainty_ms)
+{
+	if (connection == NULL)
+	{
+		return false;
+	}
+	struct smm_clock_s *clock = &connection->clock;
+	pthread_mutex_lock (&clock->lock);
+	bool valid = clock->valid;
+	if (offset_ms)
+	{
+		*offset_ms = clock->offset_ms;
+	}
+	if (uncertainty_ms)
+	{
+		*uncertainty_ms = clock->uncertainty_ms;
+	}
+	pthread_mutex_unlock (&clock->lock);
+	return valid;
+}
+
+uint64_t
+smm_connection_server_time (smm_connection conn, uint64_t local_ms)
+{
+	int64_t offset_ms = 0;
+	if (!smm_connection_clock_offset (conn, &offset_ms, NULL))
+	{
+		return local_ms;
+	}
+	return (uint64_t) ((int64_t) local_ms + offset_ms);
+}
@@ -38,13 +38,6 @@
 #error No tidy header(s)
 #endif
 
-enum http_return_codes {
-	HTTP_SUCCESS = 200,
-	HTTP_MOVED_PERMANENTLY = 301,
-	HTTP_FOUND = 302,
-	HTTP_SEE_OTHER = 303,
-};
-
 void
 smm_curl_res_free (struct smm_curl_res_s *res)
 {
@@ -81,116 +74,703 @@ to_buffer (char *ptr, size_t size, size_t nmemb, void *userdata)
 	return new_bytes;
 }
 
-static struct smm_curl_res_s *
-smm_connection_curl_retrieve_url_r (smm_connection conn, const char *path, const char *post_data,
-				   size_t (*write_func) (char *ptr, size_t size, size_t nmemb, void *userdata), void *write_data)
+/* Wrap a filled buffer without copying it, buf is left empty */
+smm_buffer
+smm_buffer_take (struct buffer_s *buf)
 {
-	struct smm_curl_res_s *res = NULL;
+	smm_buffer buffer = calloc (1, sizeof (struct smm_buffer_s));
+	if (buffer == NULL)
+	{
+		return NULL;
+	}
+	if (buf->data == NULL)
+	{
+		/* Always provide the terminating NUL */
+		buf->data = calloc (1, 1);
+		if (buf->data == NULL)
+		{
+			free (buffer);
+			return NULL;
+		}
+	}
+	buffer->refcount = 1;
+	buffer->data = buf->data;
+	buffer->bytes = buf->bytes;
+	buf->data = NULL;
+	buf->bytes = 0;
+	return buffer;
+}
 
-	DEBUG ("(%p, %s, %s, %p)\n", (void *) conn, path, post_data, write_data);
+smm_buffer
+smm_buffer_ref (smm_buffer buffer)
+{
+	if (buffer)
+	{
+		__atomic_add_fetch (&buffer->refcount, 1, __ATOMIC_RELAXED);
+	}
+	return buffer;
+}
 
-	if (conn == NULL || path == NULL)
+void
+smm_buffer_unref (smm_buffer buffer)
+{
+	if (buffer && __atomic_sub_fetch (&buffer->refcount, 1, __ATOMIC_ACQ_REL) == 0)
 	{
-		DEBUG ("conn or path is NULL\n");
-		return NULL;
+		free (buffer->data);
+		free (buffer);
 	}
+}
 
-	pthread_mutex_lock (&conn->lock);
-	CURL *curl = conn->curl;
-	if (curl == NULL)
+const char *
+smm_buffer_data (smm_buffer buffer)
+{
+	if (buffer)
 	{
-		DEBUG ("creating curl object\n");
-		curl = curl_easy_init ();
-		conn->curl = curl;
+		return buffer->data;
 	}
+	return NULL;
+}
 
-	res = (struct smm_curl_res_s *) calloc (1, sizeof (struct smm_curl_res_s));
+size_t
+smm_buffer_length (smm_buffer buffer)
+{
+	if (buffer)
+	{
+		return buffer->bytes;
+	}
+	return 0;
+}
 
-	if (asprintf (&res->full_uri, "%s%s", conn->host, path) < 0)
+/* Give up on a transfer when the network path it was using may have gone */
+static int
+smm_transfer_progress (void *clientp, curl_off_t dltotal __attribute__ ((unused)), curl_off_t dlnow __attribute__ ((unused)),
+		       curl_off_t ultotal __attribute__ ((unused)), curl_off_t ulnow __attribute__ ((unused)))
+{
+	struct smm_transfer *transfer = (struct smm_transfer *) clientp;
+	return __atomic_load_n (&transfer->conn->network_generation, __ATOMIC_ACQUIRE) != transfer->generation;
+}
+
+static void
+smm_share_lock (CURL *handle __attribute__ ((unused)), curl_lock_data data, curl_lock_access access __attribute__ ((unused)),
+		void *userptr)
+{
+	struct smm_share *share = (struct smm_share *) userptr;
+	pthread_mutex_lock (&share->locks[data]);
+}
+
+static void
+smm_share_unlock (CURL *handle __attribute__ ((unused)), curl_lock_data data, void *userptr)
+{
+	struct smm_share *share = (struct smm_share *) userptr;
+	pthread_mutex_unlock (&share->locks[data]);
+}
+
+/* Called with conn->lock held */
+static void
+smm_share_unref (struct smm_share *share)
+{
+	if (share && --share->refcount == 0)
 	{
-		free (res);
-		DEBUG ("failed to allocate full_uri");
-		pthread_mutex_unlock (&conn->lock);
+		curl_easy_cleanup (share->jar);
+		curl_share_cleanup (share->share);
+		for (size_t i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		{
+			pthread_mutex_destroy (&share->locks[i]);
+		}
+		free (share);
+	}
+}
+
+/*
+ * Handles used by different threads at once, so curl has to lock the share.
+ * Connections aren't shared, curl doesn't support that between threads.
+ * Called with conn->lock held.
+ */
+static struct smm_share *
+smm_connection_share (smm_connection conn)
+{
+	if (conn->share)
+	{
+		return conn->share;
+	}
+
+	struct smm_share *share = calloc (1, sizeof (struct smm_share));
+	if (share == NULL)
+	{
+		return NULL;
+	}
+	share->share = curl_share_init ();
+	share->jar = curl_easy_init ();
+	if (share->share == NULL || share->jar == NULL)
+	{
+		curl_easy_cleanup (share->jar);
+		curl_share_cleanup (share->share);
+		free (share);
 		return NULL;
 	}
+	for (size_t i = 0; i < CURL_LOCK_DATA_LAST; i++)
+	{
+		pthread_mutex_init (&share->locks[i], NULL);
+	}
+	curl_share_setopt (share->share, CURLSHOPT_LOCKFUNC, smm_share_lock);
+	curl_share_setopt (share->share, CURLSHOPT_UNLOCKFUNC, smm_share_unlock);
+	curl_share_setopt (share->share, CURLSHOPT_USERDATA, share);
+	curl_share_setopt (share->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+	curl_share_setopt (share->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt (share->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_easy_setopt (share->jar, CURLOPT_SHARE, share->share);
+	curl_easy_setopt (share->jar, CURLOPT_COOKIEFILE, "");
+	share->refcount = 1;
+	conn->share = share;
+	return share;
+}
+
+/*
+ * Each class of request gets handles with the options that never change
+ * set once, so a request only sets its URL and callback data. Called with
+ * conn->lock held.
+ */
+static struct smm_transfer *
+smm_transfer_create (smm_connection conn, enum smm_transfer_class class)
+{
+	struct smm_transfer *transfer = calloc (1, sizeof (struct smm_transfer));
+	if (transfer == NULL)
+	{
+		return NULL;
+	}
+	transfer->conn = conn;
+	transfer->class = class;
+	transfer->generation = conn->transfers_generation;
+	transfer->session = __atomic_load_n (&conn->session, __ATOMIC_ACQUIRE) - 1;
+	transfer->keep_warm = conn->keep_warm_version - 1;
+
+	DEBUG ("creating curl object\n");
+	transfer->curl = curl_easy_init ();
+	if (transfer->curl == NULL)
+	{
+		free (transfer);
+		return NULL;
+	}
+	CURL *curl = transfer->curl;
+
+	if (class == SMM_TRANSFER_COMPACT)
+	{
+		/*
+		 * Only what a position report needs goes on the wire: no Accept
+		 * header and only the session cookie, so this handle has no
+		 * cookie engine and doesn't join the share.
+		 */
+		if (conn->compact_headers == NULL)
+		{
+			conn->compact_headers = curl_slist_append (NULL, "Accept:");
+		}
+		if (conn->compact_headers == NULL)
+		{
+			curl_easy_cleanup (curl);
+			free (transfer);
+			return NULL;
+		}
+		curl_easy_setopt (curl, CURLOPT_HTTPHEADER, conn->compact_headers);
+	}
+	else
+	{
+		transfer->share = smm_connection_share (conn);
+		if (transfer->share == NULL)
+		{
+			curl_easy_cleanup (curl);
+			free (transfer);
+			return NULL;
+		}
+		transfer->share->refcount++;
+		curl_easy_setopt (curl, CURLOPT_SHARE, transfer->share->share);
+		curl_easy_setopt (curl, CURLOPT_COOKIEFILE, "");
+	}
 
 	curl_easy_setopt (curl, CURLOPT_FAILONERROR, true);
 	curl_easy_setopt (curl, CURLOPT_SSL_VERIFYPEER, 0L);
 	curl_easy_setopt (curl, CURLOPT_SSL_VERIFYHOST, 0L);
-	curl_easy_setopt (curl, CURLOPT_COOKIEFILE, "");
 	curl_easy_setopt (curl, CURLOPT_FOLLOWLOCATION, 0L);
-	curl_easy_setopt (curl, CURLOPT_URL, res->full_uri);
+	curl_easy_setopt (curl, CURLOPT_HEADERFUNCTION, smm_clock_header);
+	curl_easy_setopt (curl, CURLOPT_HEADERDATA, transfer);
+	curl_easy_setopt (curl, CURLOPT_NOPROGRESS, 0L);
+	curl_easy_setopt (curl, CURLOPT_XFERINFOFUNCTION, smm_transfer_progress);
+	curl_easy_setopt (curl, CURLOPT_XFERINFODATA, transfer);
+	curl_easy_setopt (curl, CURLOPT_PRIVATE, (void *) transfer);
+	if (class == SMM_TRANSFER_POST)
+	{
+		curl_easy_setopt (curl, CURLOPT_POST, 1L);
+	}
+	else
+	{
+		curl_easy_setopt (curl, CURLOPT_HTTPGET, 1L);
+	}
 
-	if (post_data)
+	return transfer;
+}
+
+/* Called with conn->lock held */
+static void
+smm_transfer_destroy (struct smm_transfer *transfer)
+{
+	curl_easy_cleanup (transfer->curl);
+	smm_share_unref (transfer->share);
+	free (transfer);
+}
+
+/* Copy the session cookie from the shared jar onto the compact handle, called with conn->lock held */
+static void
+smm_connection_compact_session (smm_connection conn, CURL *compact)
+{
+	struct curl_slist *cookies = NULL;
+	if (conn->share)
 	{
-		curl_easy_setopt (curl, CURLOPT_REFERER, res->full_uri);
-		curl_easy_setopt (curl, CURLOPT_POSTFIELDS, post_data);
-		curl_easy_setopt (curl, CURLOPT_POST, 1);
+		curl_easy_getinfo (conn->share->jar, CURLINFO_COOKIELIST, &cookies);
+	}
+
+	char *session = NULL;
+	for (struct curl_slist * cookie = cookies; cookie && session == NULL; cookie = cookie->next)
+	{
+		/* domain, subdomains, path, secure, expiry, name, value */
+		const char *field = cookie->data;
+		for (int i = 0; i < 5 && field; i++)
+		{
+			field = strchr (field, '\t');
+			field = field ? field + 1 : NULL;
+		}
+		if (field && strncmp (field, "sessionid\t", 10) == 0)
+		{
+			if (asprintf (&session, "sessionid=%s", field + 10) < 0)
+			{
+				session = NULL;
+			}
+		}
+	}
+	curl_slist_free_all (cookies);
+
+	curl_easy_setopt (compact, CURLOPT_COOKIE, session);
+	free (session);
+}
+
+/* Drop the idle handles and the share, handles still in use are dropped when they are released */
+static void
+smm_connection_transfers_drop (smm_connection conn)
+{
+	for (size_t i = 0; i < SMM_TRANSFER_CLASSES; i++)
+	{
+		while (conn->transfers[i])
+		{
+			struct smm_transfer *transfer = conn->transfers[i];
+			conn->transfers[i] = transfer->next;
+			smm_transfer_destroy (transfer);
+		}
+	}
+	while (conn->multis)
+	{
+		struct smm_multi *multi = conn->multis;
+		conn->multis = multi->next;
+		curl_multi_cleanup (multi->multi);
+		free (multi);
+	}
+	smm_share_unref (conn->share);
+	conn->share = NULL;
+}
+
+void
+smm_connection_transfers_free (smm_connection conn)
+{
+	smm_connection_transfers_drop (conn);
+	curl_slist_free_all (conn->compact_headers);
+	conn->compact_headers = NULL;
+}
+
+/* Drop every cached connection, but keep the session cookies, called with conn->lock held */
+static void
+smm_connection_transfers_reset (smm_connection conn)
+{
+	struct curl_slist *cookies = NULL;
+	if (conn->share)
+	{
+		curl_easy_getinfo (conn->share->jar, CURLINFO_COOKIELIST, &cookies);
+	}
+
+	smm_connection_transfers_drop (conn);
+
+	if (cookies)
+	{
+		struct smm_share *share = smm_connection_share (conn);
+		for (struct curl_slist * cookie = cookies; share && cookie; cookie = cookie->next)
+		{
+			curl_easy_setopt (share->jar, CURLOPT_COOKIELIST, cookie->data);
+		}
+		curl_slist_free_all (cookies);
+	}
+}
+
+/* Move on to a new network generation if the path has changed, called with conn->lock held */
+static void
+smm_connection_transfers_check (smm_connection conn)
+{
+	unsigned int generation = __atomic_load_n (&conn->network_generation, __ATOMIC_ACQUIRE);
+	if (generation != conn->transfers_generation)
+	{
+		DEBUG ("network changed, dropping connections\n");
+		smm_connection_transfers_reset (conn);
+		conn->transfers_generation = generation;
+	}
+}
+
+/*
+ * Take a handle from the pool, or make one. Called with conn->lock held,
+ * the handle belongs to the caller until smm_transfer_release.
+ */
+struct smm_transfer *
+smm_transfer_acquire (smm_connection conn, enum smm_transfer_class class)
+{
+	smm_connection_transfers_check (conn);
+
+	struct smm_transfer *transfer = conn->transfers[class];
+	if (transfer)
+	{
+		conn->transfers[class] = transfer->next;
+		transfer->next = NULL;
 	}
 	else
 	{
-		curl_easy_setopt (curl, CURLOPT_REFERER, NULL);
-		curl_easy_setopt (curl, CURLOPT_POSTFIELDS, NULL);
-		curl_easy_setopt (curl, CURLOPT_POST, 0);
+		transfer = smm_transfer_create (conn, class);
+		if (transfer == NULL)
+		{
+			return NULL;
+		}
+	}
+
+	if (transfer->keep_warm != conn->keep_warm_version)
+	{
+		smm_keep_warm_arm (conn, transfer->curl);
+		transfer->keep_warm = conn->keep_warm_version;
+	}
+
+	unsigned int session = __atomic_load_n (&conn->session, __ATOMIC_ACQUIRE);
+	if (class == SMM_TRANSFER_COMPACT && transfer->session != session)
+	{
+		smm_connection_compact_session (conn, transfer->curl);
+		transfer->session = session;
+	}
+
+	transfer->response_date = -1;
+	return transfer;
+}
+
+/* Called with conn->lock held, handles from an old network generation are dropped */
+void
+smm_transfer_release (smm_connection conn, struct smm_transfer *transfer)
+{
+	if (transfer == NULL)
+	{
+		return;
+	}
+	if (transfer->generation != conn->transfers_generation)
+	{
+		smm_transfer_destroy (transfer);
+		return;
+	}
+	transfer->next = conn->transfers[transfer->class];
+	conn->transfers[transfer->class] = transfer;
+}
+
+/* Point an acquired handle at a request, options are only set when they change */
+void
+smm_transfer_setup (struct smm_transfer *transfer, const char *url, const char *post_data,
+		    size_t (*write_func) (char *ptr, size_t size, size_t nmemb, void *userdata), void *write_data,
+		    const char *interface, bool nobody)
+{
+	CURL *curl = transfer->curl;
+
+	curl_easy_setopt (curl, CURLOPT_URL, url);
+	if (post_data)
+	{
+		curl_easy_setopt (curl, CURLOPT_REFERER, url);
+		curl_easy_setopt (curl, CURLOPT_POSTFIELDS, post_data);
 	}
 
-	if (write_func)
+	if (transfer->write_func != write_func)
 	{
 		curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, write_func);
-		curl_easy_setopt (curl, CURLOPT_WRITEDATA, write_data);
+		transfer->write_func = write_func;
 	}
-	else
+	curl_easy_setopt (curl, CURLOPT_WRITEDATA, write_data);
+
+	if (transfer->interface != interface)
 	{
-		curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, eat_data);
-		curl_easy_setopt (curl, CURLOPT_WRITEDATA, NULL);
+		curl_easy_setopt (curl, CURLOPT_INTERFACE, interface);
+		transfer->interface = interface;
+		/* Its connections were made from another interface, so it starts again */
+		transfer->last_used_ms = 0;
+		transfer->last_request_ms = 0;
 	}
 
-	DEBUG ("fetching %s\n", res->full_uri);
-	CURLcode cres = curl_easy_perform (curl);
-	DEBUG ("curl returned %i\n", cres);
-	res->success = (cres == CURLE_OK);
+	if (transfer->nobody != nobody)
+	{
+		curl_easy_setopt (curl, CURLOPT_NOBODY, nobody ? 1L : 0L);
+		transfer->nobody = nobody;
+	}
+}
+
+/* Called with conn->lock held */
+struct smm_multi *
+smm_multi_acquire (smm_connection conn)
+{
+	smm_connection_transfers_check (conn);
+
+	struct smm_multi *multi = conn->multis;
+	if (multi)
+	{
+		conn->multis = multi->next;
+		multi->next = NULL;
+		return multi;
+	}
+
+	multi = calloc (1, sizeof (struct smm_multi));
+	if (multi == NULL)
+	{
+		return NULL;
+	}
+	multi->multi = curl_multi_init ();
+	if (multi->multi == NULL)
+	{
+		free (multi);
+		return NULL;
+	}
+	multi->generation = conn->transfers_generation;
+	return multi;
+}
 
-	curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &res->httpcode);
-	DEBUG ("httpcode = %li\n", res->httpcode);
-	switch (res->httpcode)
+/* Called with conn->lock held, once every handle has been removed from it */
+void
+smm_multi_release (smm_connection conn, struct smm_multi *multi)
+{
+	if (multi->generation != conn->transfers_generation)
 	{
-		case HTTP_SUCCESS:
+		curl_multi_cleanup (multi->multi);
+		free (multi);
+		return;
+	}
+	multi->next = conn->multis;
+	conn->multis = multi;
+}
+
+/*
+ * conn->lock is only held to take a handle and to record the results, so
+ * requests from different threads run side by side.
+ */
+static struct smm_curl_res_s *
+smm_connection_curl_retrieve_url_r (smm_connection conn, const char *path, const char *post_data,
+				   size_t (*write_func) (char *ptr, size_t size, size_t nmemb, void *userdata), void *write_data, unsigned int flags)
+{
+	struct smm_curl_res_s *res = NULL;
+
+	DEBUG ("(%p, %s, %s, %p)\n", (void *) conn, path, post_data, write_data);
+
+	if (conn == NULL || path == NULL)
+	{
+		DEBUG ("conn or path is NULL\n");
+		return NULL;
+	}
+
+	/* Checked before every request, so a backfill never starts another one while a live report waits */
+	if ((flags & SMM_REQUEST_BULK) && __atomic_load_n (&conn->live_waiting, __ATOMIC_RELAXED) > 0)
+	{
+		DEBUG ("Live report waiting, deferring %s\n", path);
+		res = (struct smm_curl_res_s *) calloc (1, sizeof (struct smm_curl_res_s));
+		if (res)
 		{
-			char *ct = NULL;
-			if (curl_easy_getinfo (curl, CURLINFO_CONTENT_TYPE, &ct) == CURLE_OK)
+			res->deferred = true;
+		}
+		return res;
+	}
+
+	res = (struct smm_curl_res_s *) calloc (1, sizeof (struct smm_curl_res_s));
+	if (res == NULL)
+	{
+		return NULL;
+	}
+
+	if (asprintf (&res->full_uri, "%s%s", __atomic_load_n (&conn->host, __ATOMIC_ACQUIRE), path) < 0)
+	{
+		free (res);
+		DEBUG ("failed to allocate full_uri");
+		return NULL;
+	}
+
+	if (write_func == NULL)
+	{
+		write_func = eat_data;
+		write_data = NULL;
+	}
+	/* Only GETs are retried, and only when we know how to discard a partial response */
+	bool retry = post_data == NULL && (write_func == eat_data || write_func == to_buffer);
+
+	struct smm_transfer *transfer = NULL;
+	CURLcode cres;
+	uint64_t start_ms = 0;
+	bool race = false;
+	while (true)
+	{
+		ssize_t link = -1;
+		const char *interface = NULL;
+
+		pthread_mutex_lock (&conn->lock);
+		enum smm_transfer_class class = post_data ? SMM_TRANSFER_POST : SMM_TRANSFER_GET;
+		if ((flags & SMM_REQUEST_COMPACT) && conn->low_bandwidth && post_data == NULL)
+		{
+			class = SMM_TRANSFER_COMPACT;
+		}
+		race = (flags & SMM_REQUEST_RACE) && conn->links_count > 1;
+		if (!race)
+		{
+			transfer = smm_transfer_acquire (conn, class);
+			/* Everything else goes over the link that has been answering fastest */
+			link = smm_link_best (conn);
+			interface = link < 0 ? NULL : conn->links[link].interface;
+		}
+		pthread_mutex_unlock (&conn->lock);
+
+		uint64_t sent_ms = smm_clock_realtime_ms ();
+		start_ms = smm_clock_monotonic_ms ();
+		if (race)
+		{
+			DEBUG ("racing %s over the links\n", res->full_uri);
+			cres = smm_link_race (conn, class, res->full_uri, post_data, write_func, write_data, &transfer);
+		}
+		else
+		{
+			if (transfer == NULL)
+			{
+				DEBUG ("failed to create curl object\n");
+				smm_curl_res_free (res);
+				return NULL;
+			}
+
+			/* A probe only wants the connection, not the page */
+			smm_transfer_setup (transfer, res->full_uri, post_data, write_func, write_data, interface, (flags & SMM_REQUEST_PROBE) != 0);
+
+			DEBUG ("fetching %s\n", res->full_uri);
+			cres = curl_easy_perform (transfer->curl);
+			if (link >= 0)
 			{
-				res->content_type = strdup (ct);
+				double total = 0;
+				curl_easy_getinfo (transfer->curl, CURLINFO_TOTAL_TIME, &total);
+				pthread_mutex_lock (&conn->lock);
+				smm_link_sample (conn, link, cres == CURLE_OK, total * 1000);
+				pthread_mutex_unlock (&conn->lock);
 			}
 		}
-			break;
-		case HTTP_MOVED_PERMANENTLY:
-		case HTTP_FOUND:
-		case HTTP_SEE_OTHER:
+		uint64_t received_ms = smm_clock_realtime_ms ();
+		DEBUG ("curl returned %i\n", cres);
+		if (transfer != NULL && transfer->response_date != -1)
+		{
+			/* The server can't have seen the request before it was sent */
+			double pretransfer = 0;
+			curl_easy_getinfo (transfer->curl, CURLINFO_PRETRANSFER_TIME, &pretransfer);
+			smm_clock_sample (conn, sent_ms + (uint64_t) (pretransfer * 1000), received_ms, transfer->response_date);
+		}
+
+		if (cres == CURLE_ABORTED_BY_CALLBACK && retry)
 		{
-			char *redirect_url = NULL;
-			if (curl_easy_getinfo (curl, CURLINFO_REDIRECT_URL, &redirect_url) == CURLE_OK)
+			DEBUG ("network changed during request, retrying\n");
+			retry = false;
+			if (write_func == to_buffer)
 			{
-				res->redirect_url = strdup (redirect_url);
+				((struct buffer_s *) write_data)->bytes = 0;
 			}
+			pthread_mutex_lock (&conn->lock);
+			smm_transfer_release (conn, transfer);
+			pthread_mutex_unlock (&conn->lock);
+			transfer = NULL;
+			continue;
 		}
-			break;
+		break;
 	}
 
-	/* Clear anything we set in the curl object */
-	curl_easy_setopt (curl, CURLOPT_URL, NULL);
-	curl_easy_setopt (curl, CURLOPT_REFERER, NULL);
-	curl_easy_setopt (curl, CURLOPT_POSTFIELDS, NULL);
-	curl_easy_setopt (curl, CURLOPT_POST, 0);
-	curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, NULL);
-	curl_easy_setopt (curl, CURLOPT_WRITEDATA, NULL);
+	res->success = (cres == CURLE_OK);
 
-	pthread_mutex_unlock(&conn->lock);
+	long connects = 0;
+	if (transfer != NULL)
+	{
+		CURL *curl = transfer->curl;
+		long header_bytes = 0;
+		curl_off_t body_bytes = 0;
+		curl_easy_getinfo (curl, CURLINFO_NUM_CONNECTS, &connects);
+		curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &res->httpcode);
+		curl_easy_getinfo (curl, CURLINFO_REQUEST_SIZE, &header_bytes);
+		curl_easy_getinfo (curl, CURLINFO_SIZE_UPLOAD_T, &body_bytes);
+		res->bytes_sent = (size_t) header_bytes + (size_t) body_bytes;
+		curl_easy_getinfo (curl, CURLINFO_HEADER_SIZE, &header_bytes);
+		curl_easy_getinfo (curl, CURLINFO_SIZE_DOWNLOAD_T, &body_bytes);
+		res->bytes_received = (size_t) header_bytes + (size_t) body_bytes;
+
+		curl_off_t total_us = 0;
+		curl_easy_getinfo (curl, CURLINFO_TOTAL_TIME_T, &total_us);
+		smm_histogram_observe (&conn->metrics.request_duration, (uint64_t) total_us);
+		__atomic_add_fetch (&conn->metrics.bytes_sent, res->bytes_sent, __ATOMIC_RELAXED);
+		__atomic_add_fetch (&conn->metrics.bytes_received, res->bytes_received, __ATOMIC_RELAXED);
+
+		DEBUG ("httpcode = %li\n", res->httpcode);
+		switch (res->httpcode)
+		{
+			case HTTP_SUCCESS:
+			{
+				char *ct = NULL;
+				if (curl_easy_getinfo (curl, CURLINFO_CONTENT_TYPE, &ct) == CURLE_OK && ct)
+				{
+					res->content_type = strdup (ct);
+				}
+			}
+				break;
+			case HTTP_MOVED_PERMANENTLY:
+			case HTTP_FOUND:
+			case HTTP_SEE_OTHER:
+			{
+				char *redirect_url = NULL;
+				if (curl_easy_getinfo (curl, CURLINFO_REDIRECT_URL, &redirect_url) == CURLE_OK && redirect_url)
+				{
+					res->redirect_url = strdup (redirect_url);
+				}
+			}
+				break;
+		}
+	}
+	__atomic_add_fetch (&conn->metrics.requests, 1, __ATOMIC_RELAXED);
+	if (!res->success)
+	{
+		__atomic_add_fetch (&conn->metrics.request_errors, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_lock (&conn->lock);
+	char *local_ip = NULL;
+	if (transfer != NULL && res->success && curl_easy_getinfo (transfer->curl, CURLINFO_LOCAL_IP, &local_ip) == CURLE_OK && local_ip)
+	{
+		/* So the netlink watcher knows when the address in use goes away */
+		snprintf (conn->local_address, sizeof (conn->local_address), "%s", local_ip);
+	}
+	if (transfer != NULL)
+	{
+		smm_keep_warm_observe (conn, race ? NULL : transfer, start_ms, connects, res->success, flags & SMM_REQUEST_PROBE);
+	}
+	smm_transfer_release (conn, transfer);
+	pthread_mutex_unlock (&conn->lock);
 
 	DEBUG ("Done\n");
 
 	return res;
 }
 
+/* Open a connection on the current network path, or keep one open, before anyone needs it */
+void
+smm_connection_rewarm (smm_connection conn)
+{
+	smm_curl_res_free (smm_connection_curl_retrieve_url_r (conn, "/", NULL, NULL, NULL, SMM_REQUEST_PROBE | SMM_REQUEST_COMPACT));
+}
+
 static size_t
 populate_tidy (char *ptr, size_t size, size_t nmemb, void *userdata)
 {
@@ -242,10 +822,22 @@ extract_csrfmiddlewaretoken (TidyDoc tdoc, TidyNode tnod, char **token)
 
 
 
-bool
-smm_connection_login (smm_connection connection)
+/* A copy of the current csrf token, for callers to free */
+static char *
+smm_connection_csrf_token (smm_connection conn)
+{
+	pthread_mutex_lock (&conn->session_lock);
+	char *token = conn->csrfmiddlewaretoken ? strdup (conn->csrfmiddlewaretoken) : NULL;
+	pthread_mutex_unlock (&conn->session_lock);
+	return token;
+}
+
+/* Called with login_lock held */
+static bool
+smm_connection_login_l (smm_connection connection)
 {
 	bool res = false;
+	char *token = NULL;
 	TidyBuffer docbuf = { 0 };
 
 	TidyDoc tdoc = tidyCreate ();
@@ -254,7 +846,7 @@ smm_connection_login (smm_connection connection)
 	tidyBufInit (&docbuf);
 
 	/* Get the login page, so we can get the csrf cookie + token */
-	struct smm_curl_res_s *res_get = smm_connection_curl_retrieve_url (connection, "/accounts/login/", NULL, populate_tidy, &docbuf);
+	struct smm_curl_res_s *res_get = smm_connection_curl_request (connection, "/accounts/login/", NULL, populate_tidy, &docbuf, SMM_REQUEST_NO_LOGIN);
 
 	if (res_get && res_get->success && res_get->httpcode == HTTP_SUCCESS)
 	{
@@ -262,24 +854,32 @@ smm_connection_login (smm_connection connection)
 		tidyCleanAndRepair (tdoc);
 
 		/* find the input token with the csrfmiddlewaretoken */
-		extract_csrfmiddlewaretoken (tdoc, tidyGetRoot (tdoc), &connection->csrfmiddlewaretoken);
+		extract_csrfmiddlewaretoken (tdoc, tidyGetRoot (tdoc), &token);
 
-		if (connection->csrfmiddlewaretoken)
+		if (token)
 		{
+			pthread_mutex_lock (&connection->session_lock);
+			char *old_token = connection->csrfmiddlewaretoken;
+			connection->csrfmiddlewaretoken = token;
+			pthread_mutex_unlock (&connection->session_lock);
+			free (old_token);
+
 			char *post_data = NULL;
 			if (asprintf
-			    (&post_data, "csrfmiddlewaretoken=%s&username=%s&password=%s", connection->csrfmiddlewaretoken, connection->user,
+			    (&post_data, "csrfmiddlewaretoken=%s&username=%s&password=%s", token, connection->user,
 			     connection->pass) >= 0)
 			{
-				struct smm_curl_res_s *res_post = smm_connection_curl_retrieve_url (connection, "/accounts/login/", post_data, NULL, NULL);
+				struct smm_curl_res_s *res_post =
+					smm_connection_curl_request (connection, "/accounts/login/", post_data, NULL, NULL, SMM_REQUEST_NO_LOGIN);
 				if (res_post && res_post->success && res_post->httpcode == HTTP_FOUND)
 				{
 					res = true;
-					connection->state = SMM_CONNECTION_CONNECTED;
+					__atomic_store_n (&connection->state, SMM_CONNECTION_CONNECTED, __ATOMIC_RELEASE);
+					__atomic_add_fetch (&connection->session, 1, __ATOMIC_RELEASE);
 				}
 				else
 				{
-					connection->state = SMM_CONNECTION_AUTHENTICATION_FAILURE;
+					__atomic_store_n (&connection->state, SMM_CONNECTION_AUTHENTICATION_FAILURE, __ATOMIC_RELEASE);
 				}
 				smm_curl_res_free (res_post);
 				free (post_data);
@@ -289,7 +889,7 @@ smm_connection_login (smm_connection connection)
 	else if (!res_get)
 	{
 		DEBUG ("No res object returned\n");
-		connection->state = SMM_CONNECTION_NO_HOST_CONNECTION;
+		__atomic_store_n (&connection->state, SMM_CONNECTION_NO_HOST_CONNECTION, __ATOMIC_RELEASE);
 	}
 	else
 	{
@@ -303,13 +903,87 @@ smm_connection_login (smm_connection connection)
 	return res;
 }
 
+bool
+smm_connection_login (smm_connection connection)
+{
+	pthread_mutex_lock (&connection->login_lock);
+	bool res = smm_connection_login_l (connection);
+	pthread_mutex_unlock (&connection->login_lock);
+	return res;
+}
+
+/* Log in again, unless another thread already has since session was seen */
+static bool
+smm_connection_relogin (smm_connection conn, unsigned int session)
+{
+	bool res = true;
+	pthread_mutex_lock (&conn->login_lock);
+	if (__atomic_load_n (&conn->session, __ATOMIC_ACQUIRE) == session)
+	{
+		__atomic_add_fetch (&conn->metrics.relogins, 1, __ATOMIC_RELAXED);
+		res = smm_connection_login_l (conn);
+	}
+	pthread_mutex_unlock (&conn->login_lock);
+	return res;
+}
+
+/* Switch the host to https, other threads may still be using the old string */
+static bool
+smm_connection_upgrade_https (smm_connection conn)
+{
+	char *host = __atomic_load_n (&conn->host, __ATOMIC_ACQUIRE);
+	char *new_host = NULL;
+	if (strncmp (host, "https://", 8) == 0)
+	{
+		/* Someone else got here first */
+		return true;
+	}
+	if (asprintf (&new_host, "https://%s", strncmp (host, "http://", 7) == 0 ? &host[7] : host) < 0)
+	{
+		DEBUG ("Failed to create new host\n");
+		return false;
+	}
+	if (!__atomic_compare_exchange_n (&conn->host, &host, new_host, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		free (new_host);
+		return true;
+	}
+	/* Only ever upgraded once, so there is only one old host to keep */
+	conn->old_host = host;
+	return true;
+}
+
+/* A login gives a new csrf token, so one baked into a retried post would be refused */
+static struct smm_curl_res_s *
+smm_connection_curl_attempt (smm_connection conn, const char *path, const char *post_data,
+			     size_t (*write_func) (char *ptr, size_t size, size_t nmemb, void *userdata), void *write_data, unsigned int flags)
+{
+	if (!(flags & SMM_REQUEST_CSRF) || conn == NULL || post_data == NULL)
+	{
+		return smm_connection_curl_retrieve_url_r (conn, path, post_data, write_func, write_data, flags);
+	}
+
+	char *token = smm_connection_csrf_token (conn);
+	char *post = NULL;
+	int len = token ? asprintf (&post, "csrfmiddlewaretoken=%s&%s", token, post_data) : asprintf (&post, "%s", post_data);
+	free (token);
+	if (len < 0)
+	{
+		return NULL;
+	}
+	struct smm_curl_res_s *res = smm_connection_curl_retrieve_url_r (conn, path, post, write_func, write_data, flags);
+	free (post);
+	return res;
+}
+
 struct smm_curl_res_s *
-smm_connection_curl_retrieve_url (smm_connection conn, const char *path, const char *post_data,
-				  size_t (*write_func) (char *ptr, size_t size, size_t nmemb, void *userdata), void *write_data)
+smm_connection_curl_request (smm_connection conn, const char *path, const char *post_data,
+			     size_t (*write_func) (char *ptr, size_t size, size_t nmemb, void *userdata), void *write_data, unsigned int flags)
 {
 	bool retry = true;
 	int retries = 0;
-	struct smm_curl_res_s *res = smm_connection_curl_retrieve_url_r (conn, path, post_data, write_func, write_data);
+	unsigned int session = conn ? __atomic_load_n (&conn->session, __ATOMIC_ACQUIRE) : 0;
+	struct smm_curl_res_s *res = smm_connection_curl_attempt (conn, path, post_data, write_func, write_data, flags);
 
 	while (retry && retries < 3 && res != NULL)
 	{
@@ -319,40 +993,21 @@ smm_connection_curl_retrieve_url (smm_connection conn, const char *path, const c
 		{
 			DEBUG ("Got redirected to (%s) accessing %s\n", res->redirect_url, path);
 			/* It's possible we need to upgrade to https */
-			if (strncmp (conn->host, "https://", 8) != 0)
+			if (strncmp (__atomic_load_n (&conn->host, __ATOMIC_ACQUIRE), "https://", 8) != 0)
 			{
 				if (strncmp (res->redirect_url, "https://", 8) == 0)
 				{
 					/* Upgrade to https */
 					DEBUG ("Upgrading to https\n");
-					char *new_host = NULL;
-					if (strncmp (conn->host, "http://", 7) == 0)
-					{
-						if (asprintf (&new_host, "https://%s", &conn->host[7]) < 0)
-						{
-							DEBUG ("Failed to create new host\n");
-						}
-					}
-					else
-					{
-						if (asprintf (&new_host, "https://%s", conn->host) < 0)
-						{
-							DEBUG ("Failed to create new host\n");
-						}
-					}
-					if (new_host)
-					{
-						free (conn->host);
-						conn->host = new_host;
-						retry = true;
-					}
+					retry = smm_connection_upgrade_https (conn);
 				}
 			}
-			else if (strstr (res->redirect_url, "accounts/login") != NULL)
+			else if (strstr (res->redirect_url, "accounts/login") != NULL && !(flags & SMM_REQUEST_NO_LOGIN))
 			{
 				DEBUG ("Login required\n");
-				if (smm_connection_login (conn))
+				if (smm_connection_relogin (conn, session))
 				{
+					session = __atomic_load_n (&conn->session, __ATOMIC_ACQUIRE);
 					retry = true;
 				}
 			}
@@ -364,9 +1019,16 @@ smm_connection_curl_retrieve_url (smm_connection conn, const char *path, const c
 		if (retry && retries < 3)
 		{
 			smm_curl_res_free (res);
-			res = smm_connection_curl_retrieve_url_r (conn, path, post_data, write_func, write_data);
+			res = smm_connection_curl_attempt (conn, path, post_data, write_func, write_data, flags);
 		}
 	}
 
 	return res;
 }
+
+struct smm_curl_res_s *
+smm_connection_curl_retrieve_url (smm_connection conn, const char *path, const char *post_data,
+				  size_t (*write_func) (char *ptr, size_t size, size_t nmemb, void *userdata), void *write_data)
+{
+	return smm_connection_curl_request (conn, path, post_data, write_func, write_data, 0);
+}
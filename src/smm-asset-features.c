@@ -0,0 +1,793 @@
+/**
+ * smm-asset-features.c, Index the features of a search's GeoJSON and decode them on demand
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+
+#include <jansson.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The index only records where each element of the top level "features"
+ * array sits in the raw response, found by skipping over the text without
+ * building any JSON. A feature is handed to jansson the first time it is
+ * asked for, so only the features actually used cost any memory.
+ *
+ * Decoded points are stored at the search's precision. SMM_PRECISION_FLOAT
+ * keeps offsets from the feature's first point, which stay within about a
+ * centimetre for features up to a degree across. SMM_PRECISION_FIXED keeps
+ * whole 1e-7 degree units, about a centimetre anywhere. Both halve the memory
+ * of doubles, and the kernels below read them without expanding them first.
+ */
+
+/* SMM_PRECISION_FIXED units per degree */
+#define SMM_FIXED_PER_DEGREE 1e7
+
+struct smm_point_float
+{
+	float lat;
+	float lon;
+};
+
+struct smm_point_fixed
+{
+	int32_t lat;
+	int32_t lon;
+};
+
+struct smm_feature_part
+{
+	size_t first;
+	size_t count;
+	bool hole;
+};
+
+struct smm_feature_s
+{
+	size_t offset;
+	size_t length;
+	bool decoded;
+	smm_feature_type type;
+	uint64_t version;
+	smm_precision precision;
+	/* SMM_PRECISION_FLOAT points are relative to this */
+	double origin_lat;
+	double origin_lon;
+	void *points;
+	size_t points_count;
+	struct smm_feature_part *parts;
+	size_t parts_count;
+};
+
+static const char *
+skip_space (const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+	{
+		p++;
+	}
+	return p;
+}
+
+/* p is at the opening quote, returns just past the closing one */
+static const char *
+skip_string (const char *p, const char *end)
+{
+	for (p++; p < end; p++)
+	{
+		if (*p == '\\')
+		{
+			p++;
+		}
+		else if (*p == '"')
+		{
+			return p + 1;
+		}
+	}
+	return NULL;
+}
+
+static const char *
+skip_value (const char *p, const char *end)
+{
+	if (p >= end)
+	{
+		return NULL;
+	}
+	if (*p == '"')
+	{
+		return skip_string (p, end);
+	}
+	if (*p == '{' || *p == '[')
+	{
+		size_t depth = 0;
+		while (p < end)
+		{
+			if (*p == '"')
+			{
+				p = skip_string (p, end);
+				if (p == NULL)
+				{
+					return NULL;
+				}
+				continue;
+			}
+			if (*p == '{' || *p == '[')
+			{
+				depth++;
+			}
+			else if ((*p == '}' || *p == ']') && --depth == 0)
+			{
+				return p + 1;
+			}
+			p++;
+		}
+		return NULL;
+	}
+	while (p < end && strchr (",}] \t\r\n", *p) == NULL)
+	{
+		p++;
+	}
+	return p;
+}
+
+/* Record each element of the features array, p is at the '[' */
+static bool
+smm_features_index_array (smm_search search, const char *data, const char *p, const char *end)
+{
+	size_t size = 0;
+
+	p = skip_space (p + 1, end);
+	while (p < end && *p != ']')
+	{
+		const char *value_end = skip_value (p, end);
+		if (value_end == NULL)
+		{
+			return false;
+		}
+		if (search->features_count == size)
+		{
+			size = size ? size * 2 : 4;
+			struct smm_feature_s *tmp = realloc (search->features, size * sizeof (struct smm_feature_s));
+			if (tmp == NULL)
+			{
+				return false;
+			}
+			search->features = tmp;
+		}
+		struct smm_feature_s *feature = &search->features[search->features_count++];
+		memset (feature, 0, sizeof (struct smm_feature_s));
+		feature->offset = p - data;
+		feature->length = value_end - p;
+
+		p = skip_space (value_end, end);
+		if (p < end && *p == ',')
+		{
+			p = skip_space (p + 1, end);
+		}
+	}
+	return p < end;
+}
+
+/* Drop the decoded points of a feature, it is decoded again when next used */
+static void
+smm_feature_release (struct smm_feature_s *feature)
+{
+	free (feature->points);
+	free (feature->parts);
+	feature->points = NULL;
+	feature->parts = NULL;
+	feature->points_count = 0;
+	feature->parts_count = 0;
+	feature->decoded = false;
+}
+
+void
+smm_search_features_free (smm_search search)
+{
+	for (size_t i = 0; i < search->features_count; i++)
+	{
+		free (search->features[i].points);
+		free (search->features[i].parts);
+	}
+	free (search->features);
+	search->features = NULL;
+	search->features_count = 0;
+	search->indexed = false;
+}
+
+/* Find the features in search->geojson */
+bool
+smm_search_index_features (smm_search search)
+{
+	smm_search_features_free (search);
+	if (search->geojson == NULL)
+	{
+		return false;
+	}
+
+	const char *data = search->geojson->data;
+	const char *end = data + search->geojson->bytes;
+	const char *p = skip_space (data, end);
+	if (p == end || *p != '{')
+	{
+		return false;
+	}
+	p = skip_space (p + 1, end);
+	while (p < end && *p == '"')
+	{
+		const char *key = p + 1;
+		p = skip_string (p, end);
+		if (p == NULL)
+		{
+			break;
+		}
+		bool features = (p - 1 - key) == 8 && strncmp (key, "features", 8) == 0;
+		p = skip_space (p, end);
+		if (p == end || *p != ':')
+		{
+			break;
+		}
+		p = skip_space (p + 1, end);
+		if (features && p < end && *p == '[')
+		{
+			search->indexed = smm_features_index_array (search, data, p, end);
+			if (!search->indexed)
+			{
+				smm_search_features_free (search);
+			}
+			DEBUG ("Indexed %zu features\n", search->features_count);
+			return search->indexed;
+		}
+		p = skip_value (p, end);
+		if (p == NULL)
+		{
+			break;
+		}
+		p = skip_space (p, end);
+		if (p < end && *p == ',')
+		{
+			p = skip_space (p + 1, end);
+		}
+	}
+	printf ("Didn't find features\n");
+	return false;
+}
+
+static size_t
+smm_point_size (smm_precision precision)
+{
+	switch (precision)
+	{
+		case SMM_PRECISION_FLOAT:
+			return sizeof (struct smm_point_float);
+		case SMM_PRECISION_FIXED:
+			return sizeof (struct smm_point_fixed);
+		default:
+			return sizeof (struct smm_waypoint_s);
+	}
+}
+
+static void
+smm_point_store (struct smm_feature_s *feature, size_t i, double lat, double lon)
+{
+	switch (feature->precision)
+	{
+		case SMM_PRECISION_FLOAT:
+		{
+			struct smm_point_float *points = feature->points;
+			points[i].lat = (float) (lat - feature->origin_lat);
+			points[i].lon = (float) (lon - feature->origin_lon);
+			break;
+		}
+		case SMM_PRECISION_FIXED:
+		{
+			struct smm_point_fixed *points = feature->points;
+			points[i].lat = (int32_t) lround (lat * SMM_FIXED_PER_DEGREE);
+			points[i].lon = (int32_t) lround (lon * SMM_FIXED_PER_DEGREE);
+			break;
+		}
+		default:
+		{
+			struct smm_waypoint_s *points = feature->points;
+			points[i].lat = lat;
+			points[i].lon = lon;
+			break;
+		}
+	}
+}
+
+static void
+smm_point_load (const struct smm_feature_s *feature, size_t i, struct smm_waypoint_s *waypoint)
+{
+	switch (feature->precision)
+	{
+		case SMM_PRECISION_FLOAT:
+		{
+			const struct smm_point_float *points = feature->points;
+			waypoint->lat = feature->origin_lat + points[i].lat;
+			waypoint->lon = feature->origin_lon + points[i].lon;
+			break;
+		}
+		case SMM_PRECISION_FIXED:
+		{
+			const struct smm_point_fixed *points = feature->points;
+			waypoint->lat = points[i].lat / SMM_FIXED_PER_DEGREE;
+			waypoint->lon = points[i].lon / SMM_FIXED_PER_DEGREE;
+			break;
+		}
+		default:
+			*waypoint = ((const struct smm_waypoint_s *) feature->points)[i];
+			break;
+	}
+}
+
+/* Append one [[lon, lat], ...] array as a part */
+static bool
+smm_feature_add_part (struct smm_feature_s *feature, json_t *json_coords, bool hole)
+{
+	size_t count = json_array_size (json_coords);
+	void *points = realloc (feature->points, (feature->points_count + count) * smm_point_size (feature->precision));
+	struct smm_feature_part *parts = realloc (feature->parts, (feature->parts_count + 1) * sizeof (struct smm_feature_part));
+	if (points)
+	{
+		feature->points = points;
+	}
+	if (parts)
+	{
+		feature->parts = parts;
+	}
+	if ((points == NULL && count > 0) || parts == NULL)
+	{
+		return false;
+	}
+
+	size_t index = 0;
+	json_t *value = NULL;
+	json_array_foreach (json_coords, index, value)
+	{
+		double lat = json_number_value (json_array_get (value, 1));
+		double lon = json_number_value (json_array_get (value, 0));
+		if (feature->points_count == 0 && index == 0)
+		{
+			feature->origin_lat = lat;
+			feature->origin_lon = lon;
+		}
+		smm_point_store (feature, feature->points_count + index, lat, lon);
+	}
+	parts[feature->parts_count].first = feature->points_count;
+	parts[feature->parts_count].count = count;
+	parts[feature->parts_count].hole = hole;
+	feature->parts_count++;
+	feature->points_count += count;
+	return true;
+}
+
+/* The first ring of a polygon is its outline, any others are holes */
+static bool
+smm_feature_add_polygon (struct smm_feature_s *feature, json_t *json_rings)
+{
+	size_t index = 0;
+	json_t *value = NULL;
+	json_array_foreach (json_rings, index, value)
+	{
+		if (!smm_feature_add_part (feature, value, index > 0))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static struct smm_feature_s *
+smm_search_feature_decode (smm_search search, size_t index)
+{
+	json_error_t json_error;
+
+	if (index >= smm_search_features (search))
+	{
+		return NULL;
+	}
+
+	struct smm_feature_s *feature = &search->features[index];
+	if (feature->decoded)
+	{
+		return feature;
+	}
+
+	/* The index is dropped with the body, so this only guards against a failed fetch */
+	if (search->geojson == NULL)
+	{
+		return NULL;
+	}
+	feature->precision = search->precision;
+	json_t *json_feature = json_loadb (search->geojson->data + feature->offset, feature->length, 0, &json_error);
+	if (json_feature == NULL)
+	{
+		printf ("Error on line %i: %s\n", json_error.line, json_error.text);
+		return NULL;
+	}
+	json_t *json_version = json_object_get (json_object_get (json_feature, "properties"), "version");
+	if (json_is_integer (json_version))
+	{
+		feature->version = json_integer_value (json_version);
+	}
+	json_t *json_geometry = json_object_get (json_feature, "geometry");
+	const char *type = json_string_value (json_object_get (json_geometry, "type"));
+	json_t *json_coords = json_object_get (json_geometry, "coordinates");
+	bool ok = true;
+	size_t i = 0;
+	json_t *value = NULL;
+	if (type == NULL)
+	{
+		feature->type = SMM_FEATURE_UNKNOWN;
+	}
+	else if (strcmp (type, "LineString") == 0)
+	{
+		feature->type = SMM_FEATURE_LINE;
+		ok = smm_feature_add_part (feature, json_coords, false);
+	}
+	else if (strcmp (type, "MultiLineString") == 0)
+	{
+		feature->type = SMM_FEATURE_LINE;
+		json_array_foreach (json_coords, i, value)
+		{
+			ok = ok && smm_feature_add_part (feature, value, false);
+		}
+	}
+	else if (strcmp (type, "Polygon") == 0)
+	{
+		feature->type = SMM_FEATURE_AREA;
+		ok = smm_feature_add_polygon (feature, json_coords);
+	}
+	else if (strcmp (type, "MultiPolygon") == 0)
+	{
+		feature->type = SMM_FEATURE_AREA;
+		json_array_foreach (json_coords, i, value)
+		{
+			ok = ok && smm_feature_add_polygon (feature, value);
+		}
+	}
+	else
+	{
+		feature->type = SMM_FEATURE_UNKNOWN;
+	}
+	json_decref (json_feature);
+
+	if (!ok)
+	{
+		smm_feature_release (feature);
+		return NULL;
+	}
+	feature->decoded = true;
+	return feature;
+}
+
+/* Join every line in the search into one path, for smm_search_parse */
+bool
+smm_search_features_path (smm_search search, struct smm_waypoint_s **waypoints, size_t *waypoints_count, uint64_t *version)
+{
+	size_t count = 0;
+	*waypoints = NULL;
+	*waypoints_count = 0;
+	*version = 0;
+
+	size_t features = smm_search_features (search);
+	for (size_t i = 0; i < features; i++)
+	{
+		/* A feature only decoded for the path isn't kept, the waypoints are */
+		bool kept = search->features[i].decoded;
+		struct smm_feature_s *feature = smm_search_feature_decode (search, i);
+		if (feature == NULL)
+		{
+			/* Leaving it out would fly a different path */
+			free (*waypoints);
+			*waypoints = NULL;
+			return false;
+		}
+		if (i == 0)
+		{
+			*version = feature->version;
+		}
+		if (feature->type == SMM_FEATURE_LINE && feature->points_count > 0)
+		{
+			struct smm_waypoint_s *tmp = realloc (*waypoints, (count + feature->points_count) * sizeof (struct smm_waypoint_s));
+			if (tmp == NULL)
+			{
+				free (*waypoints);
+				*waypoints = NULL;
+				return false;
+			}
+			*waypoints = tmp;
+			for (size_t j = 0; j < feature->points_count; j++)
+			{
+				smm_point_load (feature, j, &tmp[count++]);
+			}
+		}
+		if (!kept)
+		{
+			smm_feature_release (feature);
+		}
+	}
+	*waypoints_count = count;
+	return true;
+}
+
+size_t
+smm_search_features (smm_search search)
+{
+	if (search == NULL)
+	{
+		return 0;
+	}
+	if (!search->indexed)
+	{
+		smm_buffer geojson = smm_search_get_geojson (search);
+		if (geojson == NULL)
+		{
+			return 0;
+		}
+		if (!search->indexed)
+		{
+			smm_search_index_features (search);
+		}
+		smm_buffer_unref (geojson);
+	}
+	return search->features_count;
+}
+
+smm_feature_type
+smm_search_feature_type (smm_search search, size_t feature)
+{
+	struct smm_feature_s *decoded = search ? smm_search_feature_decode (search, feature) : NULL;
+	if (decoded == NULL)
+	{
+		return SMM_FEATURE_UNKNOWN;
+	}
+	return decoded->type;
+}
+
+size_t
+smm_search_feature_parts (smm_search search, size_t feature)
+{
+	struct smm_feature_s *decoded = search ? smm_search_feature_decode (search, feature) : NULL;
+	if (decoded == NULL)
+	{
+		return 0;
+	}
+	return decoded->parts_count;
+}
+
+bool
+smm_search_feature_part (smm_search search, size_t feature, size_t part, const struct smm_waypoint_s **waypoints, size_t *waypoints_count,
+			 bool *hole)
+{
+	struct smm_feature_s *decoded = search ? smm_search_feature_decode (search, feature) : NULL;
+	if (decoded == NULL || part >= decoded->parts_count)
+	{
+		return false;
+	}
+	if (waypoints)
+	{
+		/* Compact points have to be read with smm_search_feature_point */
+		if (decoded->precision != SMM_PRECISION_DOUBLE)
+		{
+			return false;
+		}
+		*waypoints = &((const struct smm_waypoint_s *) decoded->points)[decoded->parts[part].first];
+	}
+	*waypoints_count = decoded->parts[part].count;
+	if (hole)
+	{
+		*hole = decoded->parts[part].hole;
+	}
+	return true;
+}
+
+bool
+smm_search_feature_point (smm_search search, size_t feature, size_t part, size_t index, struct smm_waypoint_s *waypoint)
+{
+	struct smm_feature_s *decoded = search ? smm_search_feature_decode (search, feature) : NULL;
+	if (decoded == NULL || part >= decoded->parts_count || index >= decoded->parts[part].count)
+	{
+		return false;
+	}
+	smm_point_load (decoded, decoded->parts[part].first + index, waypoint);
+	return true;
+}
+
+bool
+smm_search_set_precision (smm_search search, smm_precision precision)
+{
+	if (search == NULL || precision < SMM_PRECISION_DOUBLE || precision > SMM_PRECISION_FIXED)
+	{
+		return false;
+	}
+	if (search->precision == precision)
+	{
+		return true;
+	}
+	search->precision = precision;
+	if (search->geojson == NULL)
+	{
+		/* No body to decode again from, the next use fetches one and indexes it afresh */
+		smm_search_features_free (search);
+		return true;
+	}
+	/* Decoded features are decoded again at the new precision when next used */
+	for (size_t i = 0; i < search->features_count; i++)
+	{
+		smm_feature_release (&search->features[i]);
+	}
+	return true;
+}
+
+/*
+ * The kernels work in a plane of meters centred on the query point. Each
+ * point is differenced against the query in its stored form, float against
+ * float or integer against integer, and only the difference is widened.
+ */
+
+struct smm_feature_query
+{
+	double lat;
+	double lon;
+	float lat_float;
+	float lon_float;
+	int64_t lat_fixed;
+	int64_t lon_fixed;
+	double x_scale;
+};
+
+static void
+smm_feature_query_init (const struct smm_feature_s *feature, double lat, double lon, struct smm_feature_query *query)
+{
+	query->lat = lat;
+	query->lon = lon;
+	query->lat_float = (float) (lat - feature->origin_lat);
+	query->lon_float = (float) (lon - feature->origin_lon);
+	query->lat_fixed = llround (lat * SMM_FIXED_PER_DEGREE);
+	query->lon_fixed = llround (lon * SMM_FIXED_PER_DEGREE);
+	query->x_scale = cos (lat * M_PI / 180.0) * SMM_METERS_PER_DEGREE;
+}
+
+/* Where point i is, in meters east (x) and north (y) of the query */
+static inline void
+smm_feature_plane (const struct smm_feature_s *feature, size_t i, const struct smm_feature_query *query, double *x, double *y)
+{
+	switch (feature->precision)
+	{
+		case SMM_PRECISION_FLOAT:
+		{
+			const struct smm_point_float *p = &((const struct smm_point_float *) feature->points)[i];
+			*x = (double) (p->lon - query->lon_float) * query->x_scale;
+			*y = (double) (p->lat - query->lat_float) * SMM_METERS_PER_DEGREE;
+			break;
+		}
+		case SMM_PRECISION_FIXED:
+		{
+			const struct smm_point_fixed *p = &((const struct smm_point_fixed *) feature->points)[i];
+			*x = (double) (p->lon - query->lon_fixed) * (query->x_scale / SMM_FIXED_PER_DEGREE);
+			*y = (double) (p->lat - query->lat_fixed) * (SMM_METERS_PER_DEGREE / SMM_FIXED_PER_DEGREE);
+			break;
+		}
+		default:
+		{
+			const struct smm_waypoint_s *p = &((const struct smm_waypoint_s *) feature->points)[i];
+			*x = (p->lon - query->lon) * query->x_scale;
+			*y = (p->lat - query->lat) * SMM_METERS_PER_DEGREE;
+			break;
+		}
+	}
+}
+
+bool
+smm_search_feature_contains (smm_search search, size_t feature, double lat, double lon)
+{
+	struct smm_feature_query query;
+	struct smm_feature_s *decoded = search ? smm_search_feature_decode (search, feature) : NULL;
+	if (decoded == NULL || decoded->type != SMM_FEATURE_AREA)
+	{
+		return false;
+	}
+	smm_feature_query_init (decoded, lat, lon, &query);
+
+	/* Count crossings of the ray east from the query, holes cancel out their outline */
+	bool inside = false;
+	for (size_t part = 0; part < decoded->parts_count; part++)
+	{
+		size_t first = decoded->parts[part].first;
+		size_t count = decoded->parts[part].count;
+		if (count < 3)
+		{
+			continue;
+		}
+		double ax, ay;
+		smm_feature_plane (decoded, first + count - 1, &query, &ax, &ay);
+		for (size_t i = first; i < first + count; i++)
+		{
+			double bx, by;
+			smm_feature_plane (decoded, i, &query, &bx, &by);
+			if ((ay > 0.0) != (by > 0.0) && ax - ay * (bx - ax) / (by - ay) > 0.0)
+			{
+				inside = !inside;
+			}
+			ax = bx;
+			ay = by;
+		}
+	}
+	return inside;
+}
+
+double
+smm_search_feature_distance (smm_search search, size_t feature, double lat, double lon)
+{
+	struct smm_feature_query query;
+	struct smm_feature_s *decoded = search ? smm_search_feature_decode (search, feature) : NULL;
+	if (decoded == NULL || decoded->points_count == 0)
+	{
+		return -1.0;
+	}
+	smm_feature_query_init (decoded, lat, lon, &query);
+
+	double min_sq = INFINITY;
+	for (size_t part = 0; part < decoded->parts_count; part++)
+	{
+		size_t first = decoded->parts[part].first;
+		size_t count = decoded->parts[part].count;
+		if (count == 0)
+		{
+			continue;
+		}
+		/* Rings close back to their first point */
+		size_t last = decoded->type == SMM_FEATURE_AREA ? first + count - 1 : first;
+		double ax, ay;
+		smm_feature_plane (decoded, last, &query, &ax, &ay);
+		if (count == 1)
+		{
+			min_sq = fmin (min_sq, ax * ax + ay * ay);
+			continue;
+		}
+		for (size_t i = decoded->type == SMM_FEATURE_AREA ? first : first + 1; i < first + count; i++)
+		{
+			double bx, by;
+			smm_feature_plane (decoded, i, &query, &bx, &by);
+			double dx = bx - ax;
+			double dy = by - ay;
+			double len_sq = dx * dx + dy * dy;
+			double t = 0.0;
+			if (len_sq > 0.0)
+			{
+				t = -(ax * dx + ay * dy) / len_sq;
+				t = t < 0.0 ? 0.0 : (t > 1.0 ? 1.0 : t);
+			}
+			double ex = ax + t * dx;
+			double ey = ay + t * dy;
+			min_sq = fmin (min_sq, ex * ex + ey * ey);
+			ax = bx;
+			ay = by;
+		}
+	}
+	return sqrt (min_sq);
+}
@@ -0,0 +1,189 @@
+/**
+ * smm-asset-geometry.c, Immutable search geometry snapshots for concurrent readers
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Quiescent state based reclamation. Readers only do an atomic load of the
+ * current snapshot. Replacing one bumps the search's epoch, and the old
+ * snapshot is freed once every reader has announced a quiescent state in
+ * that epoch or later, since it can't have kept a pointer past that.
+ */
+
+struct smm_geometry_node
+{
+	smm_geometry geometry;
+	uint64_t retired_epoch;
+	struct smm_geometry_node *next;
+	struct smm_waypoint_s waypoints[];
+};
+
+struct smm_geometry_reader_s
+{
+	smm_search search;
+	uint64_t epoch;
+	struct smm_geometry_reader_s *next;
+};
+
+const smm_geometry *
+smm_search_geometry (smm_search search)
+{
+	if (search == NULL)
+	{
+		return NULL;
+	}
+	return __atomic_load_n (&search->geometry, __ATOMIC_ACQUIRE);
+}
+
+smm_geometry_reader
+smm_search_reader_register (smm_search search)
+{
+	if (search == NULL)
+	{
+		return NULL;
+	}
+	smm_geometry_reader reader = calloc (1, sizeof (struct smm_geometry_reader_s));
+	if (reader == NULL)
+	{
+		return NULL;
+	}
+	reader->search = search;
+	pthread_mutex_lock (&search->readers_lock);
+	reader->epoch = __atomic_load_n (&search->epoch, __ATOMIC_SEQ_CST);
+	reader->next = search->readers;
+	search->readers = reader;
+	pthread_mutex_unlock (&search->readers_lock);
+	return reader;
+}
+
+void
+smm_geometry_reader_quiescent (smm_geometry_reader reader)
+{
+	if (reader)
+	{
+		__atomic_store_n (&reader->epoch, __atomic_load_n (&reader->search->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	}
+}
+
+void
+smm_geometry_reader_unregister (smm_geometry_reader reader)
+{
+	if (reader == NULL)
+	{
+		return;
+	}
+	smm_search search = reader->search;
+	pthread_mutex_lock (&search->readers_lock);
+	for (smm_geometry_reader * r = &search->readers; *r; r = &(*r)->next)
+	{
+		if (*r == reader)
+		{
+			*r = reader->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock (&search->readers_lock);
+	free (reader);
+	smm_search_reclaim (search);
+}
+
+void
+smm_search_reclaim (smm_search search)
+{
+	if (search == NULL)
+	{
+		return;
+	}
+	pthread_mutex_lock (&search->readers_lock);
+	uint64_t oldest = UINT64_MAX;
+	for (smm_geometry_reader r = search->readers; r; r = r->next)
+	{
+		uint64_t epoch = __atomic_load_n (&r->epoch, __ATOMIC_SEQ_CST);
+		if (epoch < oldest)
+		{
+			oldest = epoch;
+		}
+	}
+	for (struct smm_geometry_node ** node = &search->retired; *node;)
+	{
+		if ((*node)->retired_epoch <= oldest)
+		{
+			struct smm_geometry_node *tmp = *node;
+			*node = tmp->next;
+			free (tmp);
+		}
+		else
+		{
+			node = &(*node)->next;
+		}
+	}
+	pthread_mutex_unlock (&search->readers_lock);
+}
+
+/* Publish a snapshot of search->waypoints and retire the one it replaces */
+void
+smm_search_publish (smm_search search)
+{
+	size_t count = search->waypoints_count;
+	struct smm_geometry_node *node = malloc (sizeof (struct smm_geometry_node) + count * sizeof (struct smm_waypoint_s));
+	if (node == NULL)
+	{
+		return;
+	}
+	if (count > 0)
+	{
+		memcpy (node->waypoints, search->waypoints, count * sizeof (struct smm_waypoint_s));
+	}
+	node->geometry.version = search->version;
+	node->geometry.waypoints_count = count;
+	node->geometry.waypoints = node->waypoints;
+	node->next = NULL;
+
+	const smm_geometry *old = __atomic_exchange_n (&search->geometry, &node->geometry, __ATOMIC_SEQ_CST);
+	if (old)
+	{
+		struct smm_geometry_node *old_node = (struct smm_geometry_node *) old;
+		pthread_mutex_lock (&search->readers_lock);
+		old_node->retired_epoch = __atomic_add_fetch (&search->epoch, 1, __ATOMIC_SEQ_CST);
+		old_node->next = search->retired;
+		search->retired = old_node;
+		pthread_mutex_unlock (&search->readers_lock);
+	}
+
+	smm_search_reclaim (search);
+}
+
+void
+smm_search_geometry_free (smm_search search)
+{
+	free ((struct smm_geometry_node *) search->geometry);
+	search->geometry = NULL;
+	while (search->retired)
+	{
+		struct smm_geometry_node *node = search->retired;
+		search->retired = node->next;
+		free (node);
+	}
+}
@@ -0,0 +1,787 @@
+/**
+ * smm-asset-gps.c, Read positions from a GPS and report them for an asset
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+/* NMEA 0183 limits a sentence to 82 characters, leave room for proprietary ones */
+#define NMEA_MAX_SENTENCE 128
+#define NMEA_MAX_FIELDS 24
+
+#define KNOTS_TO_MPS 0.514444
+#define DAY_MS 86400000ULL
+
+/* A field within the sentence buffer, never copied or terminated */
+struct nmea_field
+{
+	const char *str;
+	size_t len;
+};
+
+/* The fix currently being assembled from sentences sharing a UTC time */
+struct nmea_epoch
+{
+	uint32_t utc_ms;
+	bool have_time;
+	bool have_gga;
+	bool have_rmc;
+	bool have_position;
+	bool invalid;
+	bool have_altitude;
+	smm_fix fix;
+};
+
+struct smm_gps_source_s
+{
+	smm_asset asset;
+	int fd;
+	bool datagram;
+	uint64_t report_interval_ms;
+	uint64_t last_report_ms;
+	bool reported;
+	char sentence[NMEA_MAX_SENTENCE];
+	size_t sentence_len;
+	bool sentence_overflow;
+	struct nmea_epoch epoch;
+	/* The last date from RMC, in days since 1970, and the UTC time it came with */
+	bool have_date;
+	uint64_t date_days;
+	uint32_t date_utc_ms;
+	uint8_t gsa_mode;
+	bool have_fix;
+	bool pending;
+	smm_fix last_fix;
+};
+
+static bool
+nmea_field_decimal (const struct nmea_field *field, double *value)
+{
+	double result = 0.0;
+	double scale = 1.0;
+	bool negative = false;
+	bool point = false;
+	bool digits = false;
+
+	for (size_t i = 0; i < field->len; i++)
+	{
+		char c = field->str[i];
+		if (c >= '0' && c <= '9')
+		{
+			if (point)
+			{
+				scale /= 10.0;
+				result += (c - '0') * scale;
+			}
+			else
+			{
+				result = result * 10.0 + (c - '0');
+			}
+			digits = true;
+		}
+		else if (c == '.' && !point)
+		{
+			point = true;
+		}
+		else if (c == '-' && i == 0)
+		{
+			negative = true;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	if (!digits)
+	{
+		return false;
+	}
+	*value = negative ? -result : result;
+	return true;
+}
+
+/* ddmm.mmmm or dddmm.mmmm plus a hemisphere field */
+static bool
+nmea_field_coordinate (const struct nmea_field *field, const struct nmea_field *hemisphere, double *value)
+{
+	double raw = 0.0;
+	if (!nmea_field_decimal (field, &raw) || hemisphere->len != 1)
+	{
+		return false;
+	}
+	double degrees = (double) (long) (raw / 100.0);
+	double result = degrees + (raw - degrees * 100.0) / 60.0;
+	switch (hemisphere->str[0])
+	{
+		case 'N':
+		case 'E':
+			break;
+		case 'S':
+		case 'W':
+			result = -result;
+			break;
+		default:
+			return false;
+	}
+	*value = result;
+	return true;
+}
+
+/* hhmmss.sss */
+static bool
+nmea_field_time (const struct nmea_field *field, uint32_t *utc_ms)
+{
+	double raw = 0.0;
+	if (!nmea_field_decimal (field, &raw) || raw < 0.0)
+	{
+		return false;
+	}
+	uint32_t hhmmss = (uint32_t) raw;
+	uint32_t ms = (uint32_t) ((raw - hhmmss) * 1000.0 + 0.5);
+	*utc_ms = ((hhmmss / 10000) * 3600 + ((hhmmss / 100) % 100) * 60 + hhmmss % 100) * 1000 + ms;
+	return true;
+}
+
+/* ddmmyy, as days since 1970 */
+static bool
+nmea_field_date (const struct nmea_field *field, uint64_t *days)
+{
+	if (field->len != 6)
+	{
+		return false;
+	}
+	for (size_t i = 0; i < 6; i++)
+	{
+		if (field->str[i] < '0' || field->str[i] > '9')
+		{
+			return false;
+		}
+	}
+	int year = (field->str[4] - '0') * 10 + (field->str[5] - '0');
+	struct tm tm = {
+		.tm_mday = (field->str[0] - '0') * 10 + (field->str[1] - '0'),
+		.tm_mon = (field->str[2] - '0') * 10 + (field->str[3] - '0') - 1,
+		/* Two digit years from 80 are in the 1900s, GPS started in 1980 */
+		.tm_year = year < 80 ? 100 + year : year,
+	};
+	if (tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_mon < 0 || tm.tm_mon > 11)
+	{
+		return false;
+	}
+	time_t t = timegm (&tm);
+	if (t == (time_t) -1)
+	{
+		return false;
+	}
+	*days = (uint64_t) t / 86400;
+	return true;
+}
+
+static int
+nmea_hex (char c)
+{
+	if (c >= '0' && c <= '9')
+	{
+		return c - '0';
+	}
+	if (c >= 'A' && c <= 'F')
+	{
+		return c - 'A' + 10;
+	}
+	if (c >= 'a' && c <= 'f')
+	{
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+/*
+ * Split a sentence into fields in place, verifying the checksum if present
+ * returns the number of fields, 0 if the sentence is not valid
+ */
+static size_t
+nmea_tokenize (const char *sentence, size_t len, struct nmea_field *fields, size_t max_fields)
+{
+	if (len < 6 || (sentence[0] != '$' && sentence[0] != '!'))
+	{
+		return 0;
+	}
+
+	size_t body_end = len;
+	uint8_t checksum = 0;
+	for (size_t i = 1; i < len; i++)
+	{
+		if (sentence[i] == '*')
+		{
+			body_end = i;
+			break;
+		}
+		checksum ^= (uint8_t) sentence[i];
+	}
+	if (body_end != len)
+	{
+		if (len - body_end < 3)
+		{
+			return 0;
+		}
+		int high = nmea_hex (sentence[body_end + 1]);
+		int low = nmea_hex (sentence[body_end + 2]);
+		if (high < 0 || low < 0 || checksum != (uint8_t) ((high << 4) | low))
+		{
+			return 0;
+		}
+	}
+
+	size_t count = 0;
+	const char *start = &sentence[1];
+	for (const char *p = start;; p++)
+	{
+		if (p == &sentence[body_end] || *p == ',')
+		{
+			if (count == max_fields)
+			{
+				break;
+			}
+			fields[count].str = start;
+			fields[count].len = (size_t) (p - start);
+			count++;
+			if (p == &sentence[body_end])
+			{
+				break;
+			}
+			start = p + 1;
+		}
+	}
+	return count;
+}
+
+static bool
+nmea_field_is (const struct nmea_field *address, const char *type)
+{
+	/* Ignore the talker ID, $GPGGA, $GNGGA, $GLGGA etc are all the same */
+	return address->len == 5 && memcmp (&address->str[2], type, 3) == 0;
+}
+
+static void
+smm_gps_source_report_due (smm_gps_source source)
+{
+	if (!source->pending || source->asset == NULL)
+	{
+		return;
+	}
+	uint64_t now = smm_clock_monotonic_ms ();
+	if (source->reported && now - source->last_report_ms < source->report_interval_ms)
+	{
+		return;
+	}
+	source->pending = false;
+	source->reported = true;
+	source->last_report_ms = now;
+	smm_asset_report_fix (source->asset, &source->last_fix);
+}
+
+/* When the receiver took a fix, from the UTC time of its epoch and the date */
+static uint64_t
+smm_gps_source_fix_time (smm_gps_source source)
+{
+	uint64_t now_ms = smm_clock_realtime_ms ();
+	uint32_t utc_ms = source->epoch.utc_ms;
+
+	if (!source->epoch.have_time)
+	{
+		return now_ms;
+	}
+	if (source->have_date)
+	{
+		/* An epoch without RMC past midnight is on the day after the last date */
+		return (source->date_days + (utc_ms < source->date_utc_ms ? 1 : 0)) * DAY_MS + utc_ms;
+	}
+	/* No date from the receiver yet, use the host's day that puts the fix nearest now */
+	uint64_t time_ms = now_ms - now_ms % DAY_MS + utc_ms;
+	if (time_ms > now_ms + DAY_MS / 2)
+	{
+		time_ms -= DAY_MS;
+	}
+	else if (time_ms + DAY_MS / 2 < now_ms)
+	{
+		time_ms += DAY_MS;
+	}
+	return time_ms;
+}
+
+static void
+smm_gps_source_epoch_complete (smm_gps_source source)
+{
+	struct nmea_epoch *epoch = &source->epoch;
+
+	if (epoch->have_position && !epoch->invalid)
+	{
+		source->last_fix = epoch->fix;
+		source->last_fix.time_ms = smm_gps_source_fix_time (source);
+		if (source->gsa_mode == 2 || source->gsa_mode == 3)
+		{
+			source->last_fix.fix = source->gsa_mode;
+		}
+		else
+		{
+			source->last_fix.fix = epoch->have_altitude ? 3 : 2;
+		}
+		source->have_fix = true;
+		source->pending = true;
+	}
+
+	/* Carry course and speed forward for receivers that don't send them every epoch */
+	epoch->have_time = false;
+	epoch->have_gga = false;
+	epoch->have_rmc = false;
+	epoch->have_position = false;
+	epoch->invalid = false;
+	epoch->have_altitude = false;
+	epoch->fix = source->last_fix;
+
+	smm_gps_source_report_due (source);
+}
+
+static void
+smm_gps_source_epoch_start (smm_gps_source source, const struct nmea_field *time)
+{
+	uint32_t utc_ms = 0;
+	if (!nmea_field_time (time, &utc_ms))
+	{
+		return;
+	}
+	if ((source->epoch.have_gga || source->epoch.have_rmc) && source->epoch.utc_ms != utc_ms)
+	{
+		smm_gps_source_epoch_complete (source);
+	}
+	source->epoch.utc_ms = utc_ms;
+	source->epoch.have_time = true;
+}
+
+static void
+smm_gps_source_position (smm_gps_source source, const struct nmea_field *lat, const struct nmea_field *lat_hemi, const struct nmea_field *lon,
+			 const struct nmea_field *lon_hemi)
+{
+	double latitude = 0.0;
+	double longitude = 0.0;
+	if (nmea_field_coordinate (lat, lat_hemi, &latitude) && nmea_field_coordinate (lon, lon_hemi, &longitude))
+	{
+		source->epoch.fix.lat = latitude;
+		source->epoch.fix.lon = longitude;
+		source->epoch.have_position = true;
+	}
+}
+
+static void
+smm_gps_source_course (smm_gps_source source, const struct nmea_field *course, const struct nmea_field *speed_knots)
+{
+	double value = 0.0;
+	if (nmea_field_decimal (course, &value))
+	{
+		source->epoch.fix.bearing = ((uint16_t) (value + 0.5)) % 360;
+	}
+	if (nmea_field_decimal (speed_knots, &value))
+	{
+		source->epoch.fix.speed = (float) (value * KNOTS_TO_MPS);
+	}
+}
+
+static void
+smm_gps_source_sentence (smm_gps_source source, const char *sentence, size_t len)
+{
+	struct nmea_field fields[NMEA_MAX_FIELDS];
+	size_t count = nmea_tokenize (sentence, len, fields, NMEA_MAX_FIELDS);
+	if (count == 0)
+	{
+		return;
+	}
+
+	if (nmea_field_is (&fields[0], "GGA") && count >= 11)
+	{
+		double quality = 0.0;
+		double altitude = 0.0;
+		smm_gps_source_epoch_start (source, &fields[1]);
+		smm_gps_source_position (source, &fields[2], &fields[3], &fields[4], &fields[5]);
+		if (!nmea_field_decimal (&fields[6], &quality) || quality < 1.0)
+		{
+			source->epoch.invalid = true;
+		}
+		if (nmea_field_decimal (&fields[9], &altitude))
+		{
+			source->epoch.fix.altitude = altitude > 0.0 ? (unsigned int) (altitude + 0.5) : 0;
+			source->epoch.have_altitude = true;
+		}
+		source->epoch.have_gga = true;
+	}
+	else if (nmea_field_is (&fields[0], "RMC") && count >= 9)
+	{
+		smm_gps_source_epoch_start (source, &fields[1]);
+		if (fields[2].len != 1 || fields[2].str[0] != 'A')
+		{
+			source->epoch.invalid = true;
+		}
+		smm_gps_source_position (source, &fields[3], &fields[4], &fields[5], &fields[6]);
+		smm_gps_source_course (source, &fields[8], &fields[7]);
+		uint64_t days = 0;
+		if (count >= 10 && source->epoch.have_time && nmea_field_date (&fields[9], &days))
+		{
+			source->have_date = true;
+			source->date_days = days;
+			source->date_utc_ms = source->epoch.utc_ms;
+		}
+		source->epoch.have_rmc = true;
+	}
+	else if (nmea_field_is (&fields[0], "VTG") && count >= 6)
+	{
+		smm_gps_source_course (source, &fields[1], &fields[5]);
+	}
+	else if (nmea_field_is (&fields[0], "GSA") && count >= 3)
+	{
+		double mode = 0.0;
+		if (nmea_field_decimal (&fields[2], &mode))
+		{
+			source->gsa_mode = (uint8_t) mode;
+		}
+	}
+
+	if (source->epoch.have_gga && source->epoch.have_rmc)
+	{
+		smm_gps_source_epoch_complete (source);
+	}
+}
+
+bool
+smm_gps_source_feed (smm_gps_source source, const char *data, size_t length)
+{
+	if (source == NULL || data == NULL)
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < length; i++)
+	{
+		char c = data[i];
+		if (c == '\r' || c == '\n')
+		{
+			if (!source->sentence_overflow && source->sentence_len > 0)
+			{
+				smm_gps_source_sentence (source, source->sentence, source->sentence_len);
+			}
+			source->sentence_len = 0;
+			source->sentence_overflow = false;
+		}
+		else if (source->sentence_len < NMEA_MAX_SENTENCE)
+		{
+			source->sentence[source->sentence_len++] = c;
+		}
+		else
+		{
+			source->sentence_overflow = true;
+		}
+	}
+
+	/* Each datagram holds whole sentences, the newline is optional */
+	if (source->datagram && source->sentence_len > 0)
+	{
+		if (!source->sentence_overflow)
+		{
+			smm_gps_source_sentence (source, source->sentence, source->sentence_len);
+		}
+		source->sentence_len = 0;
+		source->sentence_overflow = false;
+	}
+
+	return true;
+}
+
+smm_gps_source
+smm_gps_source_create (smm_asset asset, unsigned int report_interval_ms)
+{
+	smm_gps_source source = calloc (1, sizeof (struct smm_gps_source_s));
+	if (source == NULL)
+	{
+		return NULL;
+	}
+	source->asset = asset;
+	source->fd = -1;
+	source->report_interval_ms = report_interval_ms;
+	return source;
+}
+
+static speed_t
+smm_gps_baud (unsigned int baud)
+{
+	switch (baud)
+	{
+		case 4800:
+			return B4800;
+		case 9600:
+			return B9600;
+		case 19200:
+			return B19200;
+		case 38400:
+			return B38400;
+		case 57600:
+			return B57600;
+		case 115200:
+			return B115200;
+		case 230400:
+			return B230400;
+	}
+	return B0;
+}
+
+smm_gps_source
+smm_gps_source_nmea_serial (smm_asset asset, const char *device, unsigned int baud, unsigned int report_interval_ms)
+{
+	struct termios tio;
+	speed_t speed = smm_gps_baud (baud);
+	if (device == NULL || speed == B0)
+	{
+		DEBUG ("Invalid device or baud rate %u\n", baud);
+		return NULL;
+	}
+
+	int fd = open (device, O_RDONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+	{
+		DEBUG ("Failed to open %s: %s\n", device, strerror (errno));
+		return NULL;
+	}
+	if (tcgetattr (fd, &tio) == 0)
+	{
+		cfmakeraw (&tio);
+		cfsetispeed (&tio, speed);
+		cfsetospeed (&tio, speed);
+		tio.c_cflag |= CLOCAL | CREAD;
+		tcsetattr (fd, TCSANOW, &tio);
+	}
+
+	smm_gps_source source = smm_gps_source_create (asset, report_interval_ms);
+	if (source == NULL)
+	{
+		close (fd);
+		return NULL;
+	}
+	source->fd = fd;
+	return source;
+}
+
+smm_gps_source
+smm_gps_source_nmea_udp (smm_asset asset, uint16_t port, unsigned int report_interval_ms)
+{
+	struct sockaddr_in6 addr;
+	int off = 0;
+
+	int fd = socket (AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		DEBUG ("Failed to create socket: %s\n", strerror (errno));
+		return NULL;
+	}
+	/* Accept IPv4 senders as well */
+	setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof (off));
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_any;
+	addr.sin6_port = htons (port);
+	if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+	{
+		DEBUG ("Failed to bind port %u: %s\n", port, strerror (errno));
+		close (fd);
+		return NULL;
+	}
+
+	smm_gps_source source = smm_gps_source_create (asset, report_interval_ms);
+	if (source == NULL)
+	{
+		close (fd);
+		return NULL;
+	}
+	source->fd = fd;
+	source->datagram = true;
+	return source;
+}
+
+smm_gps_source
+smm_gps_source_gpsd (smm_asset asset, const char *host, uint16_t port, unsigned int report_interval_ms)
+{
+	/* Ask gpsd to pass through the raw NMEA so the same parser handles every source */
+	static const char watch[] = "?WATCH={\"enable\":true,\"nmea\":true};\n";
+	struct addrinfo hints;
+	struct addrinfo *result = NULL;
+	char service[8];
+	int fd = -1;
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf (service, sizeof (service), "%u", port);
+	if (getaddrinfo (host ? host : "localhost", service, &hints, &result) != 0)
+	{
+		DEBUG ("Failed to resolve %s\n", host);
+		return NULL;
+	}
+	for (struct addrinfo *ai = result; ai != NULL && fd < 0; ai = ai->ai_next)
+	{
+		fd = socket (ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd >= 0 && connect (fd, ai->ai_addr, ai->ai_addrlen) < 0)
+		{
+			close (fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo (result);
+	if (fd < 0)
+	{
+		DEBUG ("Failed to connect to gpsd on %s:%u\n", host, port);
+		return NULL;
+	}
+
+	if (write (fd, watch, sizeof (watch) - 1) != (ssize_t) (sizeof (watch) - 1))
+	{
+		DEBUG ("Failed to enable gpsd watch: %s\n", strerror (errno));
+		close (fd);
+		return NULL;
+	}
+	fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+
+	smm_gps_source source = smm_gps_source_create (asset, report_interval_ms);
+	if (source == NULL)
+	{
+		close (fd);
+		return NULL;
+	}
+	source->fd = fd;
+	return source;
+}
+
+int
+smm_gps_source_fd (smm_gps_source source)
+{
+	if (source == NULL)
+	{
+		return -1;
+	}
+	return source->fd;
+}
+
+bool
+smm_gps_source_poll (smm_gps_source source, int timeout_ms)
+{
+	char data[512];
+
+	if (source == NULL || source->fd < 0)
+	{
+		return false;
+	}
+
+	/* Don't sleep past the point a held back fix is due */
+	if (source->pending)
+	{
+		uint64_t since = smm_clock_monotonic_ms () - source->last_report_ms;
+		int due = since >= source->report_interval_ms ? 0 : (int) (source->report_interval_ms - since);
+		if (timeout_ms < 0 || due < timeout_ms)
+		{
+			timeout_ms = due;
+		}
+	}
+
+	struct pollfd pfd = {.fd = source->fd,.events = POLLIN };
+	int ret = poll (&pfd, 1, timeout_ms);
+	if (ret < 0)
+	{
+		return errno == EINTR;
+	}
+	if (ret > 0)
+	{
+		if (pfd.revents & (POLLERR | POLLNVAL))
+		{
+			return false;
+		}
+		for (;;)
+		{
+			ssize_t len = read (source->fd, data, sizeof (data));
+			if (len > 0)
+			{
+				smm_gps_source_feed (source, data, (size_t) len);
+			}
+			else if (len == 0 && !source->datagram)
+			{
+				DEBUG ("GPS source closed\n");
+				return false;
+			}
+			else if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				DEBUG ("GPS read failed: %s\n", strerror (errno));
+				return false;
+			}
+			else if (len < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			else
+			{
+				break;
+			}
+		}
+	}
+
+	smm_gps_source_report_due (source);
+	return true;
+}
+
+bool
+smm_gps_source_last_fix (smm_gps_source source, smm_fix * fix)
+{
+	if (source == NULL || fix == NULL || !source->have_fix)
+	{
+		return false;
+	}
+	*fix = source->last_fix;
+	return true;
+}
+
+void
+smm_gps_source_close (smm_gps_source source)
+{
+	if (source)
+	{
+		if (source->fd >= 0)
+		{
+			close (source->fd);
+		}
+		free (source);
+	}
+}
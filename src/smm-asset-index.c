@@ -0,0 +1,104 @@
+/**
+ * smm-asset-index.c, Map asset ids to rows of packed tables
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+
+#include <stdlib.h>
+
+/*
+ * Open addressing with linear probing. The index only stores row numbers,
+ * the ids themselves are read from the table's own id column.
+ */
+
+static size_t
+smm_id_index_hash (long long id)
+{
+	return (size_t) (((uint64_t) id * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+ssize_t
+smm_id_index_find (const struct smm_id_index *index, const long long *ids, long long id, size_t *slot)
+{
+	if (index->slots == NULL)
+	{
+		return -1;
+	}
+	for (size_t i = smm_id_index_hash (id) & index->mask;; i = (i + 1) & index->mask)
+	{
+		int32_t row = index->slots[i];
+		if (row < 0 || ids[row] == id)
+		{
+			*slot = i;
+			return row;
+		}
+	}
+}
+
+bool
+smm_id_index_rebuild (struct smm_id_index *index, const long long *ids, size_t count, size_t slots_count)
+{
+	int32_t *slots = malloc (slots_count * sizeof (int32_t));
+	if (slots == NULL)
+	{
+		return false;
+	}
+	free (index->slots);
+	index->slots = slots;
+	index->mask = slots_count - 1;
+	for (size_t i = 0; i < slots_count; i++)
+	{
+		slots[i] = -1;
+	}
+	for (size_t row = 0; row < count; row++)
+	{
+		size_t slot = 0;
+		smm_id_index_find (index, ids, ids[row], &slot);
+		slots[slot] = (int32_t) row;
+	}
+	return true;
+}
+
+void
+smm_id_index_remove (struct smm_id_index *index, const long long *ids, size_t slot)
+{
+	/* Backward shift deletion, so lookups never need tombstones */
+	index->slots[slot] = -1;
+	for (size_t i = slot, j = (slot + 1) & index->mask; index->slots[j] >= 0; j = (j + 1) & index->mask)
+	{
+		size_t home = smm_id_index_hash (ids[index->slots[j]]) & index->mask;
+		bool movable = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+		if (movable)
+		{
+			index->slots[i] = index->slots[j];
+			index->slots[j] = -1;
+			i = j;
+		}
+	}
+}
+
+void
+smm_id_index_free (struct smm_id_index *index)
+{
+	free (index->slots);
+	index->slots = NULL;
+	index->mask = 0;
+}
@@ -26,6 +26,8 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
 
 #include <curl/curl.h>
 
@@ -40,15 +42,189 @@ extern bool smm_debug;
 	} \
 	while (0)
 
+enum http_return_codes {
+	HTTP_SUCCESS = 200,
+	HTTP_MOVED_PERMANENTLY = 301,
+	HTTP_FOUND = 302,
+	HTTP_SEE_OTHER = 303,
+	HTTP_NOT_FOUND = 404,
+	HTTP_METHOD_NOT_ALLOWED = 405,
+};
+
+/* Meters per degree of latitude, and of longitude at the equator */
+#define SMM_METERS_PER_DEGREE 111319.49
+
+/* Requests that share the same static transfer options */
+enum smm_transfer_class
+{
+	SMM_TRANSFER_GET,
+	SMM_TRANSFER_POST,
+	SMM_TRANSFER_COMPACT,
+	SMM_TRANSFER_CLASSES,
+};
+
+/* The cookies, DNS cache and TLS sessions the handles have in common */
+struct smm_share
+{
+	CURLSH *share;
+	/* Never performed, only used to read and write the cookies */
+	CURL *jar;
+	pthread_mutex_t locks[CURL_LOCK_DATA_LAST];
+	/* Held by the connection and by each handle, guarded by the connection's lock */
+	unsigned int refcount;
+};
+
+/*
+ * An easy handle with its class's options set. It sits in the connection's
+ * pool until a request takes it, and then belongs to that request alone
+ * until it is put back, so it is used without holding any lock.
+ */
+struct smm_transfer
+{
+	CURL *curl;
+	smm_connection conn;
+	enum smm_transfer_class class;
+	struct smm_share *share;
+	/* The network generation its connections were made on */
+	unsigned int generation;
+	/* Options last set on the handle */
+	size_t (*write_func) (char *ptr, size_t size, size_t nmemb, void *userdata);
+	const char *interface;
+	bool nobody;
+	unsigned int session;
+	unsigned int keep_warm;
+	/* Date header of the response in progress */
+	time_t response_date;
+	/* When its own connections were last used, 0 until they carry a request, see smm_keep_warm_observe */
+	uint64_t last_used_ms;
+	uint64_t last_request_ms;
+	struct smm_transfer *next;
+};
+
+/* A multi handle for racing the links, its connections are kept between races */
+struct smm_multi
+{
+	CURLM *multi;
+	unsigned int generation;
+	struct smm_multi *next;
+};
+
+#define SMM_LINKS_MAX 4
+
+/* A network interface or source address requests can be sent from */
+struct smm_link
+{
+	char *interface;
+	bool measured;
+	double srtt_ms;
+};
+
+/* Room for any IPv4 or IPv6 address as text */
+#define SMM_ADDRESS_MAX 64
+
+#define SMM_CLOCK_SAMPLES 8
+
+/* The range of server clock minus our clock a response allows, in ms */
+struct smm_clock_sample
+{
+	int64_t low;
+	int64_t high;
+};
+
+struct smm_clock_s
+{
+	pthread_mutex_t lock;
+	struct smm_clock_sample samples[SMM_CLOCK_SAMPLES];
+	size_t count;
+	size_t next;
+	bool valid;
+	int64_t offset_ms;
+	uint64_t uncertainty_ms;
+};
+
+/* Upper bounds of the histogram buckets, in microseconds, see smm-asset-metrics.c */
+#define SMM_HISTOGRAM_BUCKETS 10
+
+struct smm_histogram
+{
+	uint64_t buckets[SMM_HISTOGRAM_BUCKETS + 1];
+	uint64_t sum_us;
+};
+
+/* Only ever updated and read with atomics, so rendering never blocks a request */
+struct smm_metrics_s
+{
+	uint64_t requests;
+	uint64_t request_errors;
+	uint64_t bytes_sent;
+	uint64_t bytes_received;
+	uint64_t relogins;
+	uint64_t commands;
+	struct smm_histogram request_duration;
+	struct smm_histogram command_latency;
+};
+
+typedef struct smm_metrics_listener_s *smm_metrics_listener;
+typedef struct smm_netlink_s *smm_netlink;
+typedef struct smm_keep_warm_s *smm_keep_warm;
+
 struct smm_connection_s
 {
+	/* Never modified once published, replaced with __atomic_compare_exchange */
 	char *host;
+	char *old_host;
 	char *user;
 	char *pass;
+	/* Read and written with __atomic builtins */
 	smm_connection_status state;
-	CURL *curl;
+	/* Guarded by lock, along with the idle handles of each class */
+	struct smm_share *share;
+	struct smm_transfer *transfers[SMM_TRANSFER_CLASSES];
+	struct smm_multi *multis;
+	/* Only one login at a time, the token is guarded by session_lock */
+	pthread_mutex_t login_lock;
+	pthread_mutex_t session_lock;
 	char *csrfmiddlewaretoken;
 	pthread_mutex_t lock;
+	unsigned int live_waiting;
+	/* Every asset created for this connection */
+	pthread_mutex_t assets_lock;
+	smm_asset *assets;
+	size_t assets_count;
+	size_t assets_size;
+	smm_asset_command_callback command_callback;
+	void *command_data;
+	struct smm_clock_s clock;
+	/* Bumped whenever the network path may have changed */
+	unsigned int network_generation;
+	/* The local address requests last went out from, guarded by lock */
+	char local_address[SMM_ADDRESS_MAX];
+	/* The generation the idle handles belong to, guarded by lock */
+	unsigned int transfers_generation;
+	/* Guarded by lock */
+	smm_netlink netlink;
+	struct smm_link links[SMM_LINKS_MAX];
+	size_t links_count;
+	/* Low bandwidth profile, guarded by lock, coordinate_decimals is also read atomically without it */
+	bool low_bandwidth;
+	unsigned int coordinate_decimals;
+	struct curl_slist *compact_headers;
+	/* Bumped on every successful login */
+	unsigned int session;
+	/* Idle connection tracking, guarded by lock */
+	smm_keep_warm keep_warm;
+	/* Bumped when the keep alive options change, handles are armed again when next used */
+	unsigned int keep_warm_version;
+	uint64_t last_activity_ms;
+	uint64_t idle_timeout_ms;
+	uint64_t saved_reconnects;
+	struct smm_metrics_s metrics;
+	/* Guarded by lock */
+	smm_metrics_listener metrics_listener;
+	/* The server has no endpoint for batches of position reports */
+	bool batch_unsupported;
+	/* Restores still being checked against the server, guarded by assets_lock */
+	struct smm_restore_s *restores;
 };
 
 struct smm_asset_s
@@ -61,24 +237,94 @@ struct smm_asset_s
 	smm_asset_command last_command;
 	double last_command_lat;
 	double last_command_lon;
+	struct smm_track_s *track;
+	smm_search search_hint;
+	size_t report_bytes_sent;
+	size_t report_bytes_received;
+	/* Not owned, the search last accepted for this asset */
+	smm_search accepted_search;
+	/* Owned until returned by smm_asset_get_search */
+	smm_search restored_search;
+	struct smm_restore_s *restore;
+	size_t restore_index;
+	/* The asset's record from /assets/mine/json/, a jansson json_t */
+	struct json_t *properties;
+	/* Reports not yet confirmed by the server, see smm-asset-replay.c */
+	pthread_mutex_t reports_lock;
+	uint64_t report_seq;
+	uint64_t acked_seq;
+	struct smm_report_s *reports;
+	size_t reports_count;
+	size_t reports_dropped;
 };
 
 struct smm_search_s
 {
 	smm_asset asset;
 	char *url;
+	smm_buffer geojson;
 	uint64_t distance;
 	uint64_t length;
 	uint32_t sweep_width;
+	bool accepted;
+	/* Whether asset->accepted_search points here, see smm_asset_remember_search */
+	bool remembered;
+	/* Waypoints parsed from geojson, then kept up to date by smm_search_update */
+	bool parsed;
+	uint64_t version;
+	struct smm_waypoint_s *waypoints;
+	size_t waypoints_count;
+	smm_search_change_callback change_callback;
+	void *change_data;
+	/* Immutable snapshots of waypoints for readers, see smm-asset-geometry.c */
+	const smm_geometry *geometry;
+	uint64_t epoch;
+	pthread_mutex_t readers_lock;
+	struct smm_geometry_reader_s *readers;
+	struct smm_geometry_node *retired;
+	/* Where each feature is in geojson, see smm-asset-features.c */
+	bool indexed;
+	smm_precision precision;
+	struct smm_feature_s *features;
+	size_t features_count;
+};
+
+struct smm_id_index
+{
+	int32_t *slots;
+	size_t mask;
+};
+
+/* The most positions sent in one request by smm_assets_report_positions */
+#define SMM_REPORT_BATCH_MAX 100
+/* The most fixes in each request of a backfill */
+#define SMM_BACKFILL_CHUNK 100
+/* The most reports kept per asset for replay */
+#define SMM_REPORTS_MAX 64
+/* Sequence numbers saved ahead of the last one used, for the reports sent after a save */
+#define SMM_REPORT_SEQ_RESERVE 1000000
+
+enum smm_request_flags
+{
+	SMM_REQUEST_RACE = 1 << 0,	/* Send over every link at once */
+	SMM_REQUEST_COMPACT = 1 << 1,	/* Use the low bandwidth profile when it is enabled */
+	SMM_REQUEST_PROBE = 1 << 2,	/* Only sent to open or keep open a connection */
+	SMM_REQUEST_NO_LOGIN = 1 << 3,	/* Don't log in again when redirected to the login page */
+	SMM_REQUEST_BULK = 1 << 4,	/* Give way to live reports, see live_waiting */
+	SMM_REQUEST_CSRF = 1 << 5,	/* Put the current csrf token in front of post_data on every attempt */
 };
 
 struct smm_curl_res_s
 {
 	bool success;
+	/* A bulk request that wasn't sent because a live report was waiting */
+	bool deferred;
 	long httpcode;
 	char *full_uri;
 	char *redirect_url;
 	char *content_type;
+	size_t bytes_sent;
+	size_t bytes_received;
 };
 
 struct buffer_s
@@ -87,12 +333,84 @@ struct buffer_s
 	size_t bytes;
 };
 
+struct smm_buffer_s
+{
+	unsigned int refcount;
+	char *data;
+	size_t bytes;
+};
+
 size_t to_buffer (char *ptr, size_t size, size_t nmemb, void *userdata);
+smm_buffer smm_buffer_take (struct buffer_s *buf);
+
+uint64_t smm_clock_monotonic_ms (void);
+uint64_t smm_clock_realtime_ms (void);
+size_t smm_clock_header (char *ptr, size_t size, size_t nmemb, void *userdata);
+void smm_clock_sample (smm_connection conn, uint64_t sent_ms, uint64_t received_ms, time_t date);
+uint64_t smm_connection_server_time (smm_connection conn, uint64_t local_ms);
 
 void smm_curl_res_free (struct smm_curl_res_s *);
+struct smm_transfer *smm_transfer_acquire (smm_connection conn, enum smm_transfer_class class);
+void smm_transfer_release (smm_connection conn, struct smm_transfer *transfer);
+void smm_transfer_setup (struct smm_transfer *transfer, const char *url, const char *post_data,
+			 size_t (*write_func) (char *ptr, size_t size, size_t nmemb, void *userdata), void *write_data,
+			 const char *interface, bool nobody);
+struct smm_multi *smm_multi_acquire (smm_connection conn);
+void smm_multi_release (smm_connection conn, struct smm_multi *multi);
+void smm_connection_transfers_free (smm_connection conn);
+void smm_connection_rewarm (smm_connection conn);
+void smm_netlink_stop (smm_netlink netlink);
+void smm_keep_warm_arm (smm_connection conn, CURL *curl);
+void smm_keep_warm_observe (smm_connection conn, struct smm_transfer *transfer, uint64_t start_ms, long connects, bool ok, bool probe);
+void smm_keep_warm_stop (smm_keep_warm keep_warm);
+void smm_histogram_observe (struct smm_histogram *histogram, uint64_t duration_us);
+void smm_metrics_listener_stop (smm_metrics_listener listener);
+
+smm_search smm_search_create (smm_asset asset, const char *url, uint64_t length, uint64_t distance, uint64_t sweep_width);
+void smm_search_publish (smm_search search);
+char *smm_search_delta_path (const char *url, uint64_t version);
+bool smm_asset_send_fix (smm_asset asset, const smm_fix * fix, uint64_t seq);
+bool smm_search_index_features (smm_search search);
+void smm_search_features_free (smm_search search);
+bool smm_search_features_path (smm_search search, struct smm_waypoint_s **waypoints, size_t *waypoints_count, uint64_t *version);
+void smm_report_init (smm_asset asset);
+void smm_report_free (smm_asset asset);
+uint64_t smm_report_queue (smm_asset asset, const smm_fix * fix);
+void smm_report_acknowledge (smm_asset asset, uint64_t seq);
+uint64_t smm_report_seq_mark (smm_asset asset);
+void smm_report_seq_restore (smm_asset asset, uint64_t mark);
+uint64_t smm_report_seq_reserve (smm_asset asset, size_t count);
+void smm_restore_unref (struct smm_restore_s *restore);
+void smm_restore_join (smm_connection conn);
+void smm_search_geometry_free (smm_search search);
 struct smm_curl_res_s *smm_connection_curl_retrieve_url (smm_connection conn, const char *path, const char *post_data,
 							 size_t (*write_func) (char *ptr, size_t size, size_t nmemb, void *userdata), void *write_data);
+struct smm_curl_res_s *smm_connection_curl_request (smm_connection conn, const char *path, const char *post_data,
+						    size_t (*write_func) (char *ptr, size_t size, size_t nmemb, void *userdata), void *write_data,
+						    unsigned int flags);
 bool smm_connection_login (smm_connection connection);
 
+ssize_t smm_link_best (smm_connection conn);
+void smm_link_sample (smm_connection conn, size_t link, bool ok, double rtt_ms);
+CURLcode smm_link_race (smm_connection conn, enum smm_transfer_class class, const char *url, const char *post_data,
+			size_t (*write_func) (char *ptr, size_t size, size_t nmemb, void *userdata), void *write_data, struct smm_transfer **winner);
+void smm_links_free (smm_connection conn);
+
 smm_asset smm_asset_create (smm_connection connection, const char *name, const char *type, long long asset_id, long long asset_type_id);
 void smm_asset_free_asset (smm_asset assets);
+void smm_asset_remember_search (smm_asset asset, smm_search search);
+
+bool smm_peer_feed_attach (smm_peer_feed feed, smm_peer_feed_callback callback, void *data, smm_peer_feed_callback * previous,
+			   void **previous_data);
+void smm_peer_feed_detach (smm_peer_feed feed, smm_peer_feed_callback callback, void *data, smm_peer_feed_callback previous,
+			   void *previous_data);
+
+struct smm_track_s *smm_track_create (void);
+void smm_track_free (struct smm_track_s *track);
+void smm_track_record (struct smm_track_s *track, const smm_fix * fix);
+bool smm_track_get (struct smm_track_s *track, uint64_t from_ms, uint64_t to_ms, const double *area, smm_fix ** fixes, size_t * fixes_count);
+
+ssize_t smm_id_index_find (const struct smm_id_index *index, const long long *ids, long long id, size_t *slot);
+bool smm_id_index_rebuild (struct smm_id_index *index, const long long *ids, size_t count, size_t slots_count);
+void smm_id_index_remove (struct smm_id_index *index, const long long *ids, size_t slot);
+void smm_id_index_free (struct smm_id_index *index);
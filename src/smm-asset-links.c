@@ -0,0 +1,267 @@
+/**
+ * smm-asset-links.c, Send requests over several network links
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Round trip time charged to a link when a request over it fails */
+#define SMM_LINK_FAILURE_MS 10000.0
+
+int
+smm_connection_add_link (smm_connection connection, const char *interface)
+{
+	if (connection == NULL || interface == NULL)
+	{
+		return -1;
+	}
+
+	int link = -1;
+	pthread_mutex_lock (&connection->lock);
+	if (connection->links_count < SMM_LINKS_MAX)
+	{
+		char *copy = strdup (interface);
+		if (copy)
+		{
+			link = (int) connection->links_count++;
+			memset (&connection->links[link], 0, sizeof (struct smm_link));
+			connection->links[link].interface = copy;
+		}
+	}
+	pthread_mutex_unlock (&connection->lock);
+
+	return link;
+}
+
+bool
+smm_connection_link_srtt (smm_connection connection, int link, double *srtt_ms)
+{
+	if (connection == NULL || link < 0 || srtt_ms == NULL)
+	{
+		return false;
+	}
+
+	bool measured = false;
+	pthread_mutex_lock (&connection->lock);
+	if ((size_t) link < connection->links_count && connection->links[link].measured)
+	{
+		*srtt_ms = connection->links[link].srtt_ms;
+		measured = true;
+	}
+	pthread_mutex_unlock (&connection->lock);
+
+	return measured;
+}
+
+/* Links that haven't been measured yet are tried first */
+ssize_t
+smm_link_best (smm_connection conn)
+{
+	ssize_t best = -1;
+	for (size_t i = 0; i < conn->links_count; i++)
+	{
+		const struct smm_link *link = &conn->links[i];
+		if (!link->measured)
+		{
+			return (ssize_t) i;
+		}
+		if (best < 0 || link->srtt_ms < conn->links[best].srtt_ms)
+		{
+			best = (ssize_t) i;
+		}
+	}
+	return best;
+}
+
+void
+smm_link_sample (smm_connection conn, size_t index, bool ok, double rtt_ms)
+{
+	struct smm_link *link = &conn->links[index];
+	if (!ok && rtt_ms < SMM_LINK_FAILURE_MS)
+	{
+		rtt_ms = SMM_LINK_FAILURE_MS;
+	}
+	if (!link->measured)
+	{
+		link->srtt_ms = rtt_ms;
+		link->measured = true;
+	}
+	else
+	{
+		/* RFC 6298 smoothing */
+		link->srtt_ms += (rtt_ms - link->srtt_ms) / 8;
+	}
+	DEBUG ("link %s srtt %.0f ms\n", link->interface, link->srtt_ms);
+}
+
+/*
+ * Send the same request over every link and keep the first answer.
+ * Each link writes into its own buffer and only the winner's response
+ * reaches write_func. The handle of the winner, or of the last link to
+ * fail, is returned in winner for the caller to inspect and release.
+ * Called without conn->lock, which is only taken to pick the handles and
+ * to record each link's time.
+ */
+CURLcode
+smm_link_race (smm_connection conn, enum smm_transfer_class class, const char *url, const char *post_data,
+	       size_t (*write_func) (char *ptr, size_t size, size_t nmemb, void *userdata), void *write_data,
+	       struct smm_transfer **winner)
+{
+	struct buffer_s bufs[SMM_LINKS_MAX] = { { NULL, 0 } };
+	struct smm_transfer *transfers[SMM_LINKS_MAX] = { NULL };
+	const char *interfaces[SMM_LINKS_MAX] = { NULL };
+	bool running[SMM_LINKS_MAX] = { false };
+	CURLcode cres = CURLE_FAILED_INIT;
+	ssize_t won = -1;
+	ssize_t last = -1;
+
+	*winner = NULL;
+
+	/* Links are only ever added, so the first links_count stay valid */
+	pthread_mutex_lock (&conn->lock);
+	size_t links_count = conn->links_count;
+	struct smm_multi *multi = smm_multi_acquire (conn);
+	for (size_t i = 0; multi && i < links_count; i++)
+	{
+		transfers[i] = smm_transfer_acquire (conn, class);
+		interfaces[i] = conn->links[i].interface;
+	}
+	pthread_mutex_unlock (&conn->lock);
+
+	if (multi == NULL)
+	{
+		return CURLE_OUT_OF_MEMORY;
+	}
+
+	for (size_t i = 0; i < links_count; i++)
+	{
+		if (transfers[i] == NULL)
+		{
+			continue;
+		}
+		smm_transfer_setup (transfers[i], url, post_data, to_buffer, &bufs[i], interfaces[i], false);
+		if (curl_multi_add_handle (multi->multi, transfers[i]->curl) == CURLM_OK)
+		{
+			running[i] = true;
+		}
+	}
+
+	uint64_t start_ms = smm_clock_monotonic_ms ();
+	int still_running = 1;
+	while (won < 0 && still_running > 0)
+	{
+		if (curl_multi_perform (multi->multi, &still_running) != CURLM_OK)
+		{
+			break;
+		}
+
+		CURLMsg *msg = NULL;
+		int queued = 0;
+		while (won < 0 && (msg = curl_multi_info_read (multi->multi, &queued)) != NULL)
+		{
+			if (msg->msg != CURLMSG_DONE)
+			{
+				continue;
+			}
+			struct smm_transfer *transfer = NULL;
+			curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, (char **) &transfer);
+			size_t i = 0;
+			while (transfers[i] != transfer)
+			{
+				i++;
+			}
+			double total = 0;
+			curl_easy_getinfo (msg->easy_handle, CURLINFO_TOTAL_TIME, &total);
+			cres = msg->data.result;
+			pthread_mutex_lock (&conn->lock);
+			smm_link_sample (conn, i, cres == CURLE_OK, total * 1000);
+			pthread_mutex_unlock (&conn->lock);
+
+			curl_multi_remove_handle (multi->multi, msg->easy_handle);
+			running[i] = false;
+			last = (ssize_t) i;
+			if (cres == CURLE_OK)
+			{
+				won = (ssize_t) i;
+			}
+		}
+
+		if (won < 0 && still_running > 0)
+		{
+			curl_multi_poll (multi->multi, NULL, 0, 1000, NULL);
+		}
+	}
+
+	/* The losers took at least this long, don't let them look better than that */
+	double elapsed_ms = (double) (smm_clock_monotonic_ms () - start_ms);
+	for (size_t i = 0; i < links_count; i++)
+	{
+		if (running[i])
+		{
+			curl_multi_remove_handle (multi->multi, transfers[i]->curl);
+		}
+	}
+	pthread_mutex_lock (&conn->lock);
+	for (size_t i = 0; i < links_count; i++)
+	{
+		if (running[i] && (!conn->links[i].measured || conn->links[i].srtt_ms < elapsed_ms))
+		{
+			smm_link_sample (conn, i, true, elapsed_ms);
+		}
+		if ((ssize_t) i != last)
+		{
+			smm_transfer_release (conn, transfers[i]);
+		}
+	}
+	smm_multi_release (conn, multi);
+	pthread_mutex_unlock (&conn->lock);
+
+	if (last >= 0)
+	{
+		*winner = transfers[last];
+	}
+	if (won >= 0)
+	{
+		DEBUG ("link %s won\n", interfaces[won]);
+		if (bufs[won].bytes > 0 && write_func (bufs[won].data, 1, bufs[won].bytes, write_data) != bufs[won].bytes)
+		{
+			cres = CURLE_WRITE_ERROR;
+		}
+	}
+	for (size_t i = 0; i < links_count; i++)
+	{
+		free (bufs[i].data);
+	}
+
+	return cres;
+}
+
+void
+smm_links_free (smm_connection conn)
+{
+	for (size_t i = 0; i < conn->links_count; i++)
+	{
+		free (conn->links[i].interface);
+	}
+	conn->links_count = 0;
+}
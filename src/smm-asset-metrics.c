@@ -0,0 +1,297 @@
+/**
+ * smm-asset-metrics.c, Export library statistics in the OpenMetrics format
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const uint64_t histogram_bounds_us[SMM_HISTOGRAM_BUCKETS] = {
+	10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+static const char *const histogram_bounds_le[SMM_HISTOGRAM_BUCKETS] = {
+	"0.01", "0.025", "0.05", "0.1", "0.25", "0.5", "1.0", "2.5", "5.0", "10.0",
+};
+
+struct smm_metrics_listener_s
+{
+	smm_connection conn;
+	pthread_t thread;
+	int fd;
+	int wake[2];
+};
+
+void
+smm_histogram_observe (struct smm_histogram *histogram, uint64_t duration_us)
+{
+	size_t bucket = 0;
+	while (bucket < SMM_HISTOGRAM_BUCKETS && duration_us > histogram_bounds_us[bucket])
+	{
+		bucket++;
+	}
+	__atomic_add_fetch (&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch (&histogram->sum_us, duration_us, __ATOMIC_RELAXED);
+}
+
+struct metrics_output
+{
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static void metrics_printf (struct metrics_output *out, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+static void
+metrics_printf (struct metrics_output *out, const char *fmt, ...)
+{
+	va_list ap;
+	va_start (ap, fmt);
+	char *dest = out->len < out->size ? out->buf + out->len : NULL;
+	size_t space = out->len < out->size ? out->size - out->len : 0;
+	int len = vsnprintf (dest, space, fmt, ap);
+	va_end (ap);
+	if (len > 0)
+	{
+		out->len += (size_t) len;
+	}
+}
+
+static void
+metrics_counter (struct metrics_output *out, const char *name, const char *help, uint64_t *value)
+{
+	metrics_printf (out, "# TYPE %s counter\n# HELP %s %s\n%s_total %llu\n", name, name, help, name,
+			(unsigned long long) __atomic_load_n (value, __ATOMIC_RELAXED));
+}
+
+static void
+metrics_gauge (struct metrics_output *out, const char *name, const char *help, unsigned long long value)
+{
+	metrics_printf (out, "# TYPE %s gauge\n# HELP %s %s\n%s %llu\n", name, name, help, name, value);
+}
+
+static void
+metrics_histogram (struct metrics_output *out, const char *name, const char *help, struct smm_histogram *histogram)
+{
+	uint64_t count = 0;
+	metrics_printf (out, "# TYPE %s histogram\n# HELP %s %s\n", name, name, help);
+	for (size_t i = 0; i < SMM_HISTOGRAM_BUCKETS; i++)
+	{
+		count += __atomic_load_n (&histogram->buckets[i], __ATOMIC_RELAXED);
+		metrics_printf (out, "%s_bucket{le=\"%s\"} %llu\n", name, histogram_bounds_le[i], (unsigned long long) count);
+	}
+	count += __atomic_load_n (&histogram->buckets[SMM_HISTOGRAM_BUCKETS], __ATOMIC_RELAXED);
+	uint64_t sum_us = __atomic_load_n (&histogram->sum_us, __ATOMIC_RELAXED);
+	metrics_printf (out, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %llu.%06llu\n%s_count %llu\n", name, (unsigned long long) count, name,
+			(unsigned long long) (sum_us / 1000000), (unsigned long long) (sum_us % 1000000), name, (unsigned long long) count);
+}
+
+size_t
+smm_connection_metrics_render (smm_connection connection, char *buf, size_t size)
+{
+	struct metrics_output out = { buf, size, 0 };
+
+	if (connection == NULL)
+	{
+		return 0;
+	}
+	if (size > 0)
+	{
+		buf[0] = '\0';
+	}
+
+	struct smm_metrics_s *metrics = &connection->metrics;
+	metrics_counter (&out, "smm_requests", "Requests made to the server.", &metrics->requests);
+	metrics_counter (&out, "smm_request_errors", "Requests that failed, including HTTP error responses.", &metrics->request_errors);
+	metrics_counter (&out, "smm_sent_bytes", "Bytes sent to the server including HTTP headers.", &metrics->bytes_sent);
+	metrics_counter (&out, "smm_received_bytes", "Bytes received from the server including HTTP headers.", &metrics->bytes_received);
+	metrics_counter (&out, "smm_relogins", "Times the session expired and the library logged in again.", &metrics->relogins);
+	metrics_counter (&out, "smm_commands", "Asset commands received from position reports and command syncs.", &metrics->commands);
+	metrics_counter (&out, "smm_saved_reconnects", "Requests that found a connection kept open by keep warm probes.",
+			 &connection->saved_reconnects);
+	metrics_gauge (&out, "smm_reports_in_flight", "Position reports waiting for the server.",
+		       __atomic_load_n (&connection->live_waiting, __ATOMIC_RELAXED));
+	metrics_gauge (&out, "smm_assets", "Assets created on the connection.", __atomic_load_n (&connection->assets_count, __ATOMIC_RELAXED));
+	metrics_histogram (&out, "smm_request_duration_seconds", "Time taken by each request to the server.", &metrics->request_duration);
+	metrics_histogram (&out, "smm_command_latency_seconds", "Time from asking the server to having an asset's command.",
+			   &metrics->command_latency);
+	metrics_printf (&out, "# EOF\n");
+
+	return out.len;
+}
+
+static void
+smm_metrics_serve (smm_connection conn, int client)
+{
+	char request[1024];
+	char body[16384];
+	char header[256];
+
+	/* Don't let a slow scraper hold up the next one */
+	struct timeval timeout = { 1, 0 };
+	setsockopt (client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+	setsockopt (client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+	if (recv (client, request, sizeof (request), 0) <= 0)
+	{
+		return;
+	}
+
+	size_t len = smm_connection_metrics_render (conn, body, sizeof (body));
+	if (len >= sizeof (body))
+	{
+		len = sizeof (body) - 1;
+	}
+	int header_len = snprintf (header, sizeof (header),
+				   "HTTP/1.1 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+				   "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+	if (send (client, header, (size_t) header_len, MSG_NOSIGNAL) == header_len)
+	{
+		send (client, body, len, MSG_NOSIGNAL);
+	}
+}
+
+static void *
+smm_metrics_thread (void *data)
+{
+	smm_metrics_listener listener = (smm_metrics_listener) data;
+
+	while (true)
+	{
+		struct pollfd fds[2] = {
+			{.fd = listener->fd,.events = POLLIN },
+			{.fd = listener->wake[0],.events = POLLIN },
+		};
+		if (poll (fds, 2, -1) < 0 && errno != EINTR)
+		{
+			break;
+		}
+		if (fds[1].revents)
+		{
+			break;
+		}
+		if (fds[0].revents & POLLIN)
+		{
+			int client = accept (listener->fd, NULL, NULL);
+			if (client >= 0)
+			{
+				smm_metrics_serve (listener->conn, client);
+				close (client);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* Called with conn->lock held */
+static smm_metrics_listener
+smm_metrics_listener_start (smm_connection conn, const struct sockaddr_in *addr)
+{
+	smm_metrics_listener listener = calloc (1, sizeof (struct smm_metrics_listener_s));
+	if (listener == NULL)
+	{
+		return NULL;
+	}
+	listener->conn = conn;
+
+	int one = 1;
+	listener->fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener->fd < 0)
+	{
+		free (listener);
+		return NULL;
+	}
+	setsockopt (listener->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+	if (bind (listener->fd, (const struct sockaddr *) addr, sizeof (*addr)) < 0 || listen (listener->fd, 4) < 0
+	    || pipe2 (listener->wake, O_CLOEXEC) < 0)
+	{
+		close (listener->fd);
+		free (listener);
+		return NULL;
+	}
+	if (pthread_create (&listener->thread, NULL, smm_metrics_thread, listener) != 0)
+	{
+		close (listener->wake[0]);
+		close (listener->wake[1]);
+		close (listener->fd);
+		free (listener);
+		return NULL;
+	}
+	return listener;
+}
+
+bool
+smm_connection_metrics_listen (smm_connection connection, const char *address, uint16_t port)
+{
+	if (connection == NULL || address == NULL)
+	{
+		return false;
+	}
+
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons (port),
+	};
+	if (inet_pton (AF_INET, address, &addr.sin_addr) != 1)
+	{
+		return false;
+	}
+
+	/* Only one listener per connection */
+	pthread_mutex_lock (&connection->lock);
+	bool ok = connection->metrics_listener == NULL;
+	if (ok)
+	{
+		connection->metrics_listener = smm_metrics_listener_start (connection, &addr);
+		ok = connection->metrics_listener != NULL;
+	}
+	pthread_mutex_unlock (&connection->lock);
+
+	return ok;
+}
+
+void
+smm_metrics_listener_stop (smm_metrics_listener listener)
+{
+	if (listener == NULL)
+	{
+		return;
+	}
+	char c = 0;
+	if (write (listener->wake[1], &c, 1) == 1)
+	{
+		pthread_join (listener->thread, NULL);
+	}
+	close (listener->wake[0]);
+	close (listener->wake[1]);
+	close (listener->fd);
+	free (listener);
+}
@@ -0,0 +1,264 @@
+/**
+ * smm-asset-netlink.c, Recover quickly when the network path changes
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "config.h"
+
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+
+#include <stdlib.h>
+
+#ifdef HAVE_LINUX_RTNETLINK_H
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+/* How long to wait for the burst of messages from one change to settle */
+#define NETLINK_SETTLE_MS 200
+
+struct smm_netlink_s
+{
+	smm_connection conn;
+	pthread_t thread;
+	int fd;
+	int wake[2];
+};
+
+/* Whether a removed address was in use, by a link or by the path requests last went over */
+static bool
+smm_netlink_address_in_use (smm_connection conn, struct nlmsghdr *nh)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA (nh);
+	char address[SMM_ADDRESS_MAX] = "";
+	int len = IFA_PAYLOAD (nh);
+
+	for (struct rtattr * rta = IFA_RTA (ifa); RTA_OK (rta, len); rta = RTA_NEXT (rta, len))
+	{
+		/* IFA_LOCAL is our end of a point to point link, IFA_ADDRESS is ours on anything else */
+		if (rta->rta_type == IFA_LOCAL || (rta->rta_type == IFA_ADDRESS && address[0] == '\0'))
+		{
+			if (inet_ntop (ifa->ifa_family, RTA_DATA (rta), address, sizeof (address)) == NULL)
+			{
+				address[0] = '\0';
+			}
+		}
+	}
+
+	pthread_mutex_lock (&conn->lock);
+	bool in_use = address[0] != '\0' && strcmp (address, conn->local_address) == 0;
+	for (size_t i = 0; !in_use && i < conn->links_count; i++)
+	{
+		const char *interface = conn->links[i].interface;
+		in_use = strcmp (interface, address) == 0 || if_nametoindex (interface) == ifa->ifa_index;
+	}
+	pthread_mutex_unlock (&conn->lock);
+
+	return in_use;
+}
+
+/*
+ * Read all waiting messages, true if any of them changed the path: the
+ * default route changed, or an address in use was removed. Other routes
+ * and new addresses leave open connections working.
+ */
+static bool
+smm_netlink_read (smm_connection conn, int fd)
+{
+	char buf[8192] __attribute__ ((aligned (__alignof__ (struct nlmsghdr))));
+	bool changed = false;
+
+	while (true)
+	{
+		ssize_t len = recv (fd, buf, sizeof (buf), MSG_DONTWAIT);
+		if (len < 0)
+		{
+			/* ENOBUFS means we missed messages, assume the worst */
+			return changed || errno == ENOBUFS;
+		}
+		for (struct nlmsghdr * nh = (struct nlmsghdr *) buf; NLMSG_OK (nh, (size_t) len); nh = NLMSG_NEXT (nh, len))
+		{
+			switch (nh->nlmsg_type)
+			{
+				case RTM_DELADDR:
+					changed = changed || smm_netlink_address_in_use (conn, nh);
+					break;
+				case RTM_NEWROUTE:
+				case RTM_DELROUTE:
+				{
+					struct rtmsg *rtm = NLMSG_DATA (nh);
+					if (rtm->rtm_dst_len == 0)
+					{
+						changed = true;
+					}
+				}
+					break;
+			}
+		}
+	}
+}
+
+static void *
+smm_netlink_thread (void *data)
+{
+	smm_netlink netlink = (smm_netlink) data;
+	smm_connection conn = netlink->conn;
+	bool rewarm = false;
+
+	while (true)
+	{
+		struct pollfd fds[2] = {
+			{.fd = netlink->fd,.events = POLLIN },
+			{.fd = netlink->wake[0],.events = POLLIN },
+		};
+		int ready = poll (fds, 2, rewarm ? NETLINK_SETTLE_MS : -1);
+		if (ready < 0 && errno != EINTR)
+		{
+			break;
+		}
+		if (fds[1].revents)
+		{
+			break;
+		}
+		if (ready > 0 && (fds[0].revents & POLLIN))
+		{
+			if (smm_netlink_read (conn, netlink->fd))
+			{
+				/* Abort anything stuck on the old path straight away */
+				__atomic_add_fetch (&conn->network_generation, 1, __ATOMIC_RELEASE);
+				rewarm = true;
+			}
+		}
+		else if (ready == 0 && rewarm)
+		{
+			DEBUG ("network settled, reconnecting\n");
+			rewarm = false;
+			smm_connection_rewarm (conn);
+		}
+	}
+
+	return NULL;
+}
+
+/* Called with conn->lock held */
+static smm_netlink
+smm_netlink_start (smm_connection conn)
+{
+	smm_netlink netlink = calloc (1, sizeof (struct smm_netlink_s));
+	if (netlink == NULL)
+	{
+		return NULL;
+	}
+	netlink->conn = conn;
+
+	netlink->fd = socket (AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (netlink->fd < 0)
+	{
+		free (netlink);
+		return NULL;
+	}
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR | RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE,
+	};
+	if (bind (netlink->fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 || pipe2 (netlink->wake, O_CLOEXEC) < 0)
+	{
+		close (netlink->fd);
+		free (netlink);
+		return NULL;
+	}
+	if (pthread_create (&netlink->thread, NULL, smm_netlink_thread, netlink) != 0)
+	{
+		close (netlink->wake[0]);
+		close (netlink->wake[1]);
+		close (netlink->fd);
+		free (netlink);
+		return NULL;
+	}
+	return netlink;
+}
+
+bool
+smm_connection_watch_network (smm_connection connection, bool enable)
+{
+	if (connection == NULL)
+	{
+		return false;
+	}
+
+	pthread_mutex_lock (&connection->lock);
+	if (!enable)
+	{
+		smm_netlink netlink = connection->netlink;
+		connection->netlink = NULL;
+		pthread_mutex_unlock (&connection->lock);
+		/* The thread takes the lock itself, so it is stopped without it */
+		smm_netlink_stop (netlink);
+		return true;
+	}
+	if (connection->netlink == NULL)
+	{
+		connection->netlink = smm_netlink_start (connection);
+	}
+	bool ok = connection->netlink != NULL;
+	pthread_mutex_unlock (&connection->lock);
+
+	return ok;
+}
+
+void
+smm_netlink_stop (smm_netlink netlink)
+{
+	if (netlink == NULL)
+	{
+		return;
+	}
+	char c = 0;
+	if (write (netlink->wake[1], &c, 1) == 1)
+	{
+		pthread_join (netlink->thread, NULL);
+	}
+	close (netlink->wake[0]);
+	close (netlink->wake[1]);
+	close (netlink->fd);
+	free (netlink);
+}
+
+#else
+
+bool
+smm_connection_watch_network (smm_connection connection __attribute__ ((unused)), bool enable __attribute__ ((unused)))
+{
+	return false;
+}
+
+void
+smm_netlink_stop (smm_netlink netlink __attribute__ ((unused)))
+{
+}
+
+#endif
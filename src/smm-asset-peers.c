@@ -0,0 +1,541 @@
+/**
+ * smm-asset-peers.c, Keep track of the positions of the other assets
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jansson.h>
+
+/*
+ * The table is stored as one array per field so scans over positions only
+ * touch the fields they need. Rows are kept packed, removing a row moves the
+ * last row into its place. An id index maps asset ids to rows.
+ */
+struct smm_peer_feed_s
+{
+	smm_connection conn;
+	pthread_mutex_t lock;
+	pthread_mutex_t sync_lock;
+	uint64_t sequence;
+	uint32_t generation;
+	smm_peer_feed_callback callback;
+	void *callback_data;
+
+	size_t count;
+	size_t size;
+	long long *asset_id;
+	uint64_t *time_ms;
+	double *lat;
+	double *lon;
+	uint32_t *altitude;
+	uint16_t *bearing;
+	uint8_t *fix;
+	float *velocity_east;
+	float *velocity_north;
+	uint32_t *row_generation;
+
+	struct smm_id_index index;
+};
+
+/* A change made during a sync, passed to the callback once the feed is unlocked */
+struct smm_peer_change
+{
+	smm_peer peer;
+	bool removed;
+};
+
+struct smm_peer_changes
+{
+	struct smm_peer_change *changes;
+	size_t count;
+};
+
+static void
+smm_peer_feed_row (smm_peer_feed feed, size_t row, smm_peer * peer)
+{
+	peer->asset_id = feed->asset_id[row];
+	peer->time_ms = feed->time_ms[row];
+	peer->lat = feed->lat[row];
+	peer->lon = feed->lon[row];
+	peer->altitude = feed->altitude[row];
+	peer->bearing = feed->bearing[row];
+	peer->fix = feed->fix[row];
+	peer->velocity_east = feed->velocity_east[row];
+	peer->velocity_north = feed->velocity_north[row];
+}
+
+static ssize_t
+smm_peer_feed_lookup (smm_peer_feed feed, long long asset_id, size_t *slot)
+{
+	return smm_id_index_find (&feed->index, feed->asset_id, asset_id, slot);
+}
+
+#define GROW_COLUMN(column, size) do \
+	{ \
+		void *tmp = realloc (feed->column, size * sizeof (*feed->column)); \
+		if (tmp == NULL) \
+		{ \
+			return false; \
+		} \
+		feed->column = tmp; \
+	} \
+	while (0)
+
+static bool
+smm_peer_feed_grow (smm_peer_feed feed)
+{
+	size_t size = feed->size ? feed->size * 2 : 64;
+	GROW_COLUMN (asset_id, size);
+	GROW_COLUMN (time_ms, size);
+	GROW_COLUMN (lat, size);
+	GROW_COLUMN (lon, size);
+	GROW_COLUMN (altitude, size);
+	GROW_COLUMN (bearing, size);
+	GROW_COLUMN (fix, size);
+	GROW_COLUMN (velocity_east, size);
+	GROW_COLUMN (velocity_north, size);
+	GROW_COLUMN (row_generation, size);
+	feed->size = size;
+	/* Keep the hash at most half full */
+	return smm_id_index_rebuild (&feed->index, feed->asset_id, feed->count, size * 2);
+}
+
+#undef GROW_COLUMN
+
+static void
+smm_peer_changes_add (struct smm_peer_changes *changes, smm_peer_feed feed, size_t row, bool removed)
+{
+	if (changes->changes)
+	{
+		smm_peer_feed_row (feed, row, &changes->changes[changes->count].peer);
+		changes->changes[changes->count].removed = removed;
+		changes->count++;
+	}
+}
+
+static void
+smm_peer_feed_update (smm_peer_feed feed, const smm_peer * peer, struct smm_peer_changes *changes)
+{
+	size_t slot = 0;
+	ssize_t row = smm_peer_feed_lookup (feed, peer->asset_id, &slot);
+	float velocity_east = 0.0f;
+	float velocity_north = 0.0f;
+
+	if (row < 0)
+	{
+		if (feed->count == feed->size)
+		{
+			if (!smm_peer_feed_grow (feed))
+			{
+				return;
+			}
+			smm_peer_feed_lookup (feed, peer->asset_id, &slot);
+		}
+		row = (ssize_t) feed->count++;
+		feed->index.slots[slot] = (int32_t) row;
+		feed->asset_id[row] = peer->asset_id;
+	}
+	else if (peer->time_ms > feed->time_ms[row])
+	{
+		double dt = (peer->time_ms - feed->time_ms[row]) / 1000.0;
+		velocity_east = (float) ((peer->lon - feed->lon[row]) * cos (peer->lat * M_PI / 180.0) * SMM_METERS_PER_DEGREE / dt);
+		velocity_north = (float) ((peer->lat - feed->lat[row]) * SMM_METERS_PER_DEGREE / dt);
+	}
+	else
+	{
+		/* Already have this position or a newer one, a late row only shows the peer is still there */
+		feed->row_generation[row] = feed->generation;
+		return;
+	}
+
+	feed->time_ms[row] = peer->time_ms;
+	feed->lat[row] = peer->lat;
+	feed->lon[row] = peer->lon;
+	feed->altitude[row] = peer->altitude;
+	feed->bearing[row] = peer->bearing;
+	feed->fix[row] = peer->fix;
+	feed->velocity_east[row] = velocity_east;
+	feed->velocity_north[row] = velocity_north;
+	feed->row_generation[row] = feed->generation;
+
+	smm_peer_changes_add (changes, feed, (size_t) row, false);
+}
+
+static void
+smm_peer_feed_remove_row (smm_peer_feed feed, size_t row, struct smm_peer_changes *changes)
+{
+	size_t slot = 0;
+
+	smm_peer_changes_add (changes, feed, row, true);
+	smm_peer_feed_lookup (feed, feed->asset_id[row], &slot);
+
+	smm_id_index_remove (&feed->index, feed->asset_id, slot);
+
+	size_t last = feed->count - 1;
+	if (row != last)
+	{
+		feed->asset_id[row] = feed->asset_id[last];
+		feed->time_ms[row] = feed->time_ms[last];
+		feed->lat[row] = feed->lat[last];
+		feed->lon[row] = feed->lon[last];
+		feed->altitude[row] = feed->altitude[last];
+		feed->bearing[row] = feed->bearing[last];
+		feed->fix[row] = feed->fix[last];
+		feed->velocity_east[row] = feed->velocity_east[last];
+		feed->velocity_north[row] = feed->velocity_north[last];
+		feed->row_generation[row] = feed->row_generation[last];
+		smm_peer_feed_lookup (feed, feed->asset_id[row], &slot);
+		feed->index.slots[slot] = (int32_t) row;
+	}
+	feed->count--;
+}
+
+static void
+smm_peer_feed_remove (smm_peer_feed feed, long long asset_id, struct smm_peer_changes *changes)
+{
+	size_t slot = 0;
+	ssize_t row = smm_peer_feed_lookup (feed, asset_id, &slot);
+	if (row >= 0)
+	{
+		smm_peer_feed_remove_row (feed, (size_t) row, changes);
+	}
+}
+
+smm_peer_feed
+smm_connection_peer_feed (smm_connection connection)
+{
+	if (connection == NULL)
+	{
+		return NULL;
+	}
+	smm_peer_feed feed = calloc (1, sizeof (struct smm_peer_feed_s));
+	if (feed == NULL)
+	{
+		return NULL;
+	}
+	feed->conn = connection;
+	pthread_mutex_init (&feed->lock, NULL);
+	pthread_mutex_init (&feed->sync_lock, NULL);
+	return feed;
+}
+
+static bool
+smm_peer_from_json (json_t * json, smm_peer * peer)
+{
+	json_t *tmp = json_object_get (json, "asset_id");
+	if (!json_is_integer (tmp))
+	{
+		return false;
+	}
+	memset (peer, 0, sizeof (smm_peer));
+	peer->asset_id = json_integer_value (tmp);
+	peer->lat = json_number_value (json_object_get (json, "lat"));
+	peer->lon = json_number_value (json_object_get (json, "lon"));
+	peer->altitude = (unsigned int) json_integer_value (json_object_get (json, "alt"));
+	peer->bearing = (uint16_t) json_integer_value (json_object_get (json, "bearing"));
+	peer->fix = (uint8_t) json_integer_value (json_object_get (json, "fix"));
+	peer->time_ms = (uint64_t) (json_number_value (json_object_get (json, "timestamp")) * 1000.0);
+	return true;
+}
+
+/*
+ * The server replies with
+ * {"sequence": N, "full": bool, "positions": [{"asset_id", "lat", "lon", "alt", "bearing", "fix", "timestamp"}], "removed": [asset_id]}
+ * positions holds every asset that changed after the requested sequence,
+ * or every asset when full is true (i.e. the sequence is too old)
+ */
+bool
+smm_peer_feed_sync (smm_peer_feed feed)
+{
+	struct buffer_s buf = { NULL, 0 };
+	json_error_t json_error;
+	char *page = NULL;
+	bool res = false;
+
+	if (feed == NULL)
+	{
+		return false;
+	}
+
+	pthread_mutex_lock (&feed->sync_lock);
+	if (asprintf (&page, "/data/assets/positions/feed/?since=%llu", (unsigned long long) feed->sequence) < 0)
+	{
+		pthread_mutex_unlock (&feed->sync_lock);
+		return false;
+	}
+
+	struct smm_curl_res_s *curl_res = smm_connection_curl_retrieve_url (feed->conn, page, NULL, to_buffer, &buf);
+	free (page);
+	if (curl_res == NULL || !(curl_res->success && curl_res->httpcode == HTTP_SUCCESS))
+	{
+		smm_curl_res_free (curl_res);
+		free (buf.data);
+		pthread_mutex_unlock (&feed->sync_lock);
+		return false;
+	}
+	smm_curl_res_free (curl_res);
+
+	json_t *json_root = json_loadb (buf.data, buf.bytes, 0, &json_error);
+	if (json_root)
+	{
+		size_t index = 0;
+		json_t *value = NULL;
+		json_t *positions = json_object_get (json_root, "positions");
+		json_t *removed = json_object_get (json_root, "removed");
+		bool full = json_is_true (json_object_get (json_root, "full"));
+		struct smm_peer_changes changes = { NULL, 0 };
+
+		pthread_mutex_lock (&feed->lock);
+		smm_peer_feed_callback callback = feed->callback;
+		void *callback_data = feed->callback_data;
+		if (callback)
+		{
+			/* Room for every change this sync can make, so none are lost */
+			size_t most = json_array_size (positions) + json_array_size (removed) + (full ? feed->count : 0);
+			changes.changes = calloc (most ? most : 1, sizeof (struct smm_peer_change));
+			if (changes.changes == NULL)
+			{
+				pthread_mutex_unlock (&feed->lock);
+				json_decref (json_root);
+				free (buf.data);
+				pthread_mutex_unlock (&feed->sync_lock);
+				return false;
+			}
+		}
+		feed->generation++;
+		json_array_foreach (positions, index, value)
+		{
+			smm_peer peer;
+			if (smm_peer_from_json (value, &peer))
+			{
+				smm_peer_feed_update (feed, &peer, &changes);
+			}
+		}
+		json_array_foreach (removed, index, value)
+		{
+			smm_peer_feed_remove (feed, json_integer_value (value), &changes);
+		}
+		if (full)
+		{
+			/* Anything not sent in a full update has gone */
+			for (size_t row = feed->count; row > 0; row--)
+			{
+				if (feed->row_generation[row - 1] != feed->generation)
+				{
+					smm_peer_feed_remove_row (feed, row - 1, &changes);
+				}
+			}
+		}
+		feed->sequence = (uint64_t) json_integer_value (json_object_get (json_root, "sequence"));
+		pthread_mutex_unlock (&feed->lock);
+
+		/* sync_lock is still held, so the callback sees each sync's changes in order */
+		for (size_t i = 0; i < changes.count; i++)
+		{
+			callback (callback_data, &changes.changes[i].peer, changes.changes[i].removed);
+		}
+		free (changes.changes);
+
+		json_decref (json_root);
+		res = true;
+	}
+	else
+	{
+		printf ("Error on line %i: %s\n", json_error.line, json_error.text);
+	}
+
+	free (buf.data);
+	pthread_mutex_unlock (&feed->sync_lock);
+
+	return res;
+}
+
+uint64_t
+smm_peer_feed_sequence (smm_peer_feed feed)
+{
+	uint64_t sequence = 0;
+	if (feed)
+	{
+		pthread_mutex_lock (&feed->lock);
+		sequence = feed->sequence;
+		pthread_mutex_unlock (&feed->lock);
+	}
+	return sequence;
+}
+
+void
+smm_peer_feed_set_callback (smm_peer_feed feed, smm_peer_feed_callback callback, void *data)
+{
+	if (feed)
+	{
+		pthread_mutex_lock (&feed->lock);
+		feed->callback = callback;
+		feed->callback_data = data;
+		pthread_mutex_unlock (&feed->lock);
+	}
+}
+
+/*
+ * Install callback in front of the existing one and give it the current
+ * contents of the feed. The existing callback is only stored in previous
+ * after that, but before sync_lock lets any sync pass changes to callback.
+ */
+bool
+smm_peer_feed_attach (smm_peer_feed feed, smm_peer_feed_callback callback, void *data, smm_peer_feed_callback * previous,
+		      void **previous_data)
+{
+	pthread_mutex_lock (&feed->sync_lock);
+	pthread_mutex_lock (&feed->lock);
+	smm_peer *peers = calloc (feed->count ? feed->count : 1, sizeof (smm_peer));
+	if (peers == NULL)
+	{
+		pthread_mutex_unlock (&feed->lock);
+		pthread_mutex_unlock (&feed->sync_lock);
+		return false;
+	}
+	size_t count = feed->count;
+	for (size_t row = 0; row < count; row++)
+	{
+		smm_peer_feed_row (feed, row, &peers[row]);
+	}
+	smm_peer_feed_callback old_callback = feed->callback;
+	void *old_data = feed->callback_data;
+	feed->callback = callback;
+	feed->callback_data = data;
+	pthread_mutex_unlock (&feed->lock);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		callback (data, &peers[i], false);
+	}
+	*previous = old_callback;
+	*previous_data = old_data;
+	pthread_mutex_unlock (&feed->sync_lock);
+	free (peers);
+	return true;
+}
+
+/* Undo smm_peer_feed_attach, waiting for any sync still calling callback */
+void
+smm_peer_feed_detach (smm_peer_feed feed, smm_peer_feed_callback callback, void *data, smm_peer_feed_callback previous, void *previous_data)
+{
+	pthread_mutex_lock (&feed->sync_lock);
+	pthread_mutex_lock (&feed->lock);
+	if (feed->callback == callback && feed->callback_data == data)
+	{
+		feed->callback = previous;
+		feed->callback_data = previous_data;
+	}
+	pthread_mutex_unlock (&feed->lock);
+	pthread_mutex_unlock (&feed->sync_lock);
+}
+
+size_t
+smm_peer_feed_count (smm_peer_feed feed)
+{
+	size_t count = 0;
+	if (feed)
+	{
+		pthread_mutex_lock (&feed->lock);
+		count = feed->count;
+		pthread_mutex_unlock (&feed->lock);
+	}
+	return count;
+}
+
+bool
+smm_peer_feed_get (smm_peer_feed feed, size_t index, smm_peer * peer)
+{
+	bool res = false;
+	if (feed && peer)
+	{
+		pthread_mutex_lock (&feed->lock);
+		if (index < feed->count)
+		{
+			smm_peer_feed_row (feed, index, peer);
+			res = true;
+		}
+		pthread_mutex_unlock (&feed->lock);
+	}
+	return res;
+}
+
+bool
+smm_peer_feed_find (smm_peer_feed feed, long long asset_id, smm_peer * peer)
+{
+	bool res = false;
+	if (feed && peer)
+	{
+		size_t slot = 0;
+		pthread_mutex_lock (&feed->lock);
+		ssize_t row = smm_peer_feed_lookup (feed, asset_id, &slot);
+		if (row >= 0)
+		{
+			smm_peer_feed_row (feed, (size_t) row, peer);
+			res = true;
+		}
+		pthread_mutex_unlock (&feed->lock);
+	}
+	return res;
+}
+
+size_t
+smm_peer_feed_copy (smm_peer_feed feed, smm_peer * peers, size_t peers_size)
+{
+	size_t count = 0;
+	if (feed && peers)
+	{
+		pthread_mutex_lock (&feed->lock);
+		for (count = 0; count < feed->count && count < peers_size; count++)
+		{
+			smm_peer_feed_row (feed, count, &peers[count]);
+		}
+		pthread_mutex_unlock (&feed->lock);
+	}
+	return count;
+}
+
+void
+smm_peer_feed_destroy (smm_peer_feed feed)
+{
+	if (feed)
+	{
+		free (feed->asset_id);
+		free (feed->time_ms);
+		free (feed->lat);
+		free (feed->lon);
+		free (feed->altitude);
+		free (feed->bearing);
+		free (feed->fix);
+		free (feed->velocity_east);
+		free (feed->velocity_north);
+		free (feed->row_generation);
+		smm_id_index_free (&feed->index);
+		pthread_mutex_destroy (&feed->lock);
+		pthread_mutex_destroy (&feed->sync_lock);
+		free (feed);
+	}
+}
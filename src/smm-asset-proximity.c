@@ -0,0 +1,448 @@
+/**
+ * smm-asset-proximity.c, Find other assets near a position
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Peers are projected onto a plane scaled for the reference latitude and
+ * dropped into a uniform grid. Cells are hashed into a fixed set of buckets,
+ * each bucket holds a doubly linked list of rows so a peer can move cell
+ * without a search. Rows are packed like the peer feed.
+ */
+#define PROXIMITY_BUCKETS 4096
+
+struct smm_proximity_s
+{
+	pthread_mutex_t lock;
+	/* The attached feed and the callback that was set on it before */
+	smm_peer_feed feed;
+	smm_peer_feed_callback chained;
+	void *chained_data;
+	double x_scale;
+	double cell_size;
+	long long ignore_id;
+
+	size_t count;
+	size_t size;
+	long long *asset_id;
+	double *x;
+	double *y;
+	float *altitude;
+	float *velocity_east;
+	float *velocity_north;
+	int32_t *cell_x;
+	int32_t *cell_y;
+	int32_t *next;
+	int32_t *prev;
+
+	int32_t buckets[PROXIMITY_BUCKETS];
+	struct smm_id_index index;
+};
+
+static size_t
+smm_proximity_bucket (int32_t cell_x, int32_t cell_y)
+{
+	return (((uint32_t) cell_x * 73856093u) ^ ((uint32_t) cell_y * 19349663u)) & (PROXIMITY_BUCKETS - 1);
+}
+
+static void
+smm_proximity_link (smm_proximity proximity, size_t row)
+{
+	size_t bucket = smm_proximity_bucket (proximity->cell_x[row], proximity->cell_y[row]);
+	int32_t head = proximity->buckets[bucket];
+	proximity->prev[row] = -1;
+	proximity->next[row] = head;
+	if (head >= 0)
+	{
+		proximity->prev[head] = (int32_t) row;
+	}
+	proximity->buckets[bucket] = (int32_t) row;
+}
+
+static void
+smm_proximity_unlink (smm_proximity proximity, size_t row)
+{
+	int32_t prev = proximity->prev[row];
+	int32_t next = proximity->next[row];
+	if (prev >= 0)
+	{
+		proximity->next[prev] = next;
+	}
+	else
+	{
+		proximity->buckets[smm_proximity_bucket (proximity->cell_x[row], proximity->cell_y[row])] = next;
+	}
+	if (next >= 0)
+	{
+		proximity->prev[next] = prev;
+	}
+}
+
+smm_proximity
+smm_proximity_create (double ref_lat, double cell_size_m)
+{
+	smm_proximity proximity = calloc (1, sizeof (struct smm_proximity_s));
+	if (proximity == NULL)
+	{
+		return NULL;
+	}
+	pthread_mutex_init (&proximity->lock, NULL);
+	proximity->x_scale = cos (ref_lat * M_PI / 180.0) * SMM_METERS_PER_DEGREE;
+	proximity->cell_size = cell_size_m < 1.0 ? 1.0 : cell_size_m;
+	proximity->ignore_id = -1;
+	for (size_t i = 0; i < PROXIMITY_BUCKETS; i++)
+	{
+		proximity->buckets[i] = -1;
+	}
+	return proximity;
+}
+
+#define GROW_COLUMN(column, size) do \
+	{ \
+		void *tmp = realloc (proximity->column, size * sizeof (*proximity->column)); \
+		if (tmp == NULL) \
+		{ \
+			return false; \
+		} \
+		proximity->column = tmp; \
+	} \
+	while (0)
+
+static bool
+smm_proximity_grow (smm_proximity proximity)
+{
+	size_t size = proximity->size ? proximity->size * 2 : 64;
+	GROW_COLUMN (asset_id, size);
+	GROW_COLUMN (x, size);
+	GROW_COLUMN (y, size);
+	GROW_COLUMN (altitude, size);
+	GROW_COLUMN (velocity_east, size);
+	GROW_COLUMN (velocity_north, size);
+	GROW_COLUMN (cell_x, size);
+	GROW_COLUMN (cell_y, size);
+	GROW_COLUMN (next, size);
+	GROW_COLUMN (prev, size);
+	proximity->size = size;
+	return smm_id_index_rebuild (&proximity->index, proximity->asset_id, proximity->count, size * 2);
+}
+
+#undef GROW_COLUMN
+
+void
+smm_proximity_update (smm_proximity proximity, const smm_peer * peer)
+{
+	if (proximity == NULL || peer == NULL)
+	{
+		return;
+	}
+
+	double x = peer->lon * proximity->x_scale;
+	double y = peer->lat * SMM_METERS_PER_DEGREE;
+	int32_t cell_x = (int32_t) floor (x / proximity->cell_size);
+	int32_t cell_y = (int32_t) floor (y / proximity->cell_size);
+	size_t slot = 0;
+
+	pthread_mutex_lock (&proximity->lock);
+	ssize_t row = smm_id_index_find (&proximity->index, proximity->asset_id, peer->asset_id, &slot);
+	if (row < 0)
+	{
+		if (proximity->count == proximity->size)
+		{
+			if (!smm_proximity_grow (proximity))
+			{
+				pthread_mutex_unlock (&proximity->lock);
+				return;
+			}
+			smm_id_index_find (&proximity->index, proximity->asset_id, peer->asset_id, &slot);
+		}
+		row = (ssize_t) proximity->count++;
+		proximity->index.slots[slot] = (int32_t) row;
+		proximity->asset_id[row] = peer->asset_id;
+		proximity->cell_x[row] = cell_x;
+		proximity->cell_y[row] = cell_y;
+		smm_proximity_link (proximity, (size_t) row);
+	}
+	else if (proximity->cell_x[row] != cell_x || proximity->cell_y[row] != cell_y)
+	{
+		smm_proximity_unlink (proximity, (size_t) row);
+		proximity->cell_x[row] = cell_x;
+		proximity->cell_y[row] = cell_y;
+		smm_proximity_link (proximity, (size_t) row);
+	}
+	proximity->x[row] = x;
+	proximity->y[row] = y;
+	proximity->altitude[row] = (float) peer->altitude;
+	proximity->velocity_east[row] = peer->velocity_east;
+	proximity->velocity_north[row] = peer->velocity_north;
+	pthread_mutex_unlock (&proximity->lock);
+}
+
+void
+smm_proximity_remove (smm_proximity proximity, long long asset_id)
+{
+	size_t slot = 0;
+
+	if (proximity == NULL)
+	{
+		return;
+	}
+
+	pthread_mutex_lock (&proximity->lock);
+	ssize_t found = smm_id_index_find (&proximity->index, proximity->asset_id, asset_id, &slot);
+	if (found >= 0)
+	{
+		size_t row = (size_t) found;
+		size_t last = proximity->count - 1;
+		smm_proximity_unlink (proximity, row);
+		smm_id_index_remove (&proximity->index, proximity->asset_id, slot);
+		if (row != last)
+		{
+			/* Move the last row into the gap and repoint everything that referenced it */
+			int32_t prev = proximity->prev[last];
+			int32_t next = proximity->next[last];
+			if (prev >= 0)
+			{
+				proximity->next[prev] = (int32_t) row;
+			}
+			else
+			{
+				proximity->buckets[smm_proximity_bucket (proximity->cell_x[last], proximity->cell_y[last])] = (int32_t) row;
+			}
+			if (next >= 0)
+			{
+				proximity->prev[next] = (int32_t) row;
+			}
+			proximity->asset_id[row] = proximity->asset_id[last];
+			proximity->x[row] = proximity->x[last];
+			proximity->y[row] = proximity->y[last];
+			proximity->altitude[row] = proximity->altitude[last];
+			proximity->velocity_east[row] = proximity->velocity_east[last];
+			proximity->velocity_north[row] = proximity->velocity_north[last];
+			proximity->cell_x[row] = proximity->cell_x[last];
+			proximity->cell_y[row] = proximity->cell_y[last];
+			proximity->next[row] = next;
+			proximity->prev[row] = prev;
+			smm_id_index_find (&proximity->index, proximity->asset_id, proximity->asset_id[row], &slot);
+			proximity->index.slots[slot] = (int32_t) row;
+		}
+		proximity->count--;
+	}
+	pthread_mutex_unlock (&proximity->lock);
+}
+
+void
+smm_proximity_ignore (smm_proximity proximity, long long asset_id)
+{
+	if (proximity)
+	{
+		pthread_mutex_lock (&proximity->lock);
+		proximity->ignore_id = asset_id;
+		pthread_mutex_unlock (&proximity->lock);
+	}
+}
+
+static void
+smm_proximity_feed_changed (void *data, const smm_peer * peer, bool removed)
+{
+	smm_proximity proximity = (smm_proximity) data;
+	if (removed)
+	{
+		smm_proximity_remove (proximity, peer->asset_id);
+	}
+	else
+	{
+		smm_proximity_update (proximity, peer);
+	}
+	/* Only changes while attached are passed on, the feed holds the rest */
+	if (proximity->chained)
+	{
+		proximity->chained (proximity->chained_data, peer, removed);
+	}
+}
+
+void
+smm_proximity_attach (smm_proximity proximity, smm_peer_feed feed)
+{
+	if (proximity == NULL || feed == NULL || proximity->feed != NULL)
+	{
+		return;
+	}
+	if (smm_peer_feed_attach (feed, smm_proximity_feed_changed, proximity, &proximity->chained, &proximity->chained_data))
+	{
+		proximity->feed = feed;
+	}
+}
+
+void
+smm_proximity_detach (smm_proximity proximity)
+{
+	if (proximity && proximity->feed)
+	{
+		smm_peer_feed_detach (proximity->feed, smm_proximity_feed_changed, proximity, proximity->chained, proximity->chained_data);
+		proximity->feed = NULL;
+		proximity->chained = NULL;
+		proximity->chained_data = NULL;
+	}
+}
+
+struct proximity_query
+{
+	double x;
+	double y;
+	double altitude;
+	double velocity_east;
+	double velocity_north;
+	double radius_sq;
+	smm_proximity_hit *hits;
+	size_t hits_size;
+	size_t hits_count;
+};
+
+static void
+smm_proximity_check (smm_proximity proximity, struct proximity_query *query, size_t row)
+{
+	double dx = proximity->x[row] - query->x;
+	double dy = proximity->y[row] - query->y;
+	double distance_sq = dx * dx + dy * dy;
+	if (distance_sq > query->radius_sq || proximity->asset_id[row] == proximity->ignore_id)
+	{
+		return;
+	}
+
+	/* Keep the closest hits_size, in order */
+	size_t pos = query->hits_count;
+	double distance = sqrt (distance_sq);
+	while (pos > 0 && query->hits[pos - 1].distance > distance)
+	{
+		pos--;
+	}
+	if (pos >= query->hits_size)
+	{
+		return;
+	}
+	size_t move = (query->hits_count < query->hits_size ? query->hits_count : query->hits_size - 1) - pos;
+	memmove (&query->hits[pos + 1], &query->hits[pos], move * sizeof (smm_proximity_hit));
+	if (query->hits_count < query->hits_size)
+	{
+		query->hits_count++;
+	}
+
+	double rel_east = proximity->velocity_east[row] - query->velocity_east;
+	double rel_north = proximity->velocity_north[row] - query->velocity_north;
+	smm_proximity_hit *hit = &query->hits[pos];
+	hit->asset_id = proximity->asset_id[row];
+	hit->distance = distance;
+	hit->vertical = proximity->altitude[row] - query->altitude;
+	if (distance > 0.0)
+	{
+		hit->closure_rate = -(dx * rel_east + dy * rel_north) / distance;
+	}
+	else
+	{
+		hit->closure_rate = sqrt (rel_east * rel_east + rel_north * rel_north);
+	}
+}
+
+size_t
+smm_proximity_query (smm_proximity proximity, const smm_fix * own, double radius_m, smm_proximity_hit * hits, size_t hits_size)
+{
+	if (proximity == NULL || own == NULL || hits == NULL || hits_size == 0)
+	{
+		return 0;
+	}
+
+	double bearing = own->bearing * M_PI / 180.0;
+	struct proximity_query query = {
+		.x = own->lon * proximity->x_scale,
+		.y = own->lat * SMM_METERS_PER_DEGREE,
+		.altitude = own->altitude,
+		.velocity_east = own->speed * sin (bearing),
+		.velocity_north = own->speed * cos (bearing),
+		.radius_sq = radius_m * radius_m,
+		.hits = hits,
+		.hits_size = hits_size,
+		.hits_count = 0,
+	};
+
+	int32_t min_x = (int32_t) floor ((query.x - radius_m) / proximity->cell_size);
+	int32_t max_x = (int32_t) floor ((query.x + radius_m) / proximity->cell_size);
+	int32_t min_y = (int32_t) floor ((query.y - radius_m) / proximity->cell_size);
+	int32_t max_y = (int32_t) floor ((query.y + radius_m) / proximity->cell_size);
+	uint64_t cells = (uint64_t) (max_x - min_x + 1) * (uint64_t) (max_y - min_y + 1);
+
+	pthread_mutex_lock (&proximity->lock);
+	if (cells > proximity->count)
+	{
+		/* Radius is large compared to the grid, a scan is cheaper */
+		for (size_t row = 0; row < proximity->count; row++)
+		{
+			smm_proximity_check (proximity, &query, row);
+		}
+	}
+	else
+	{
+		for (int32_t cell_y = min_y; cell_y <= max_y; cell_y++)
+		{
+			for (int32_t cell_x = min_x; cell_x <= max_x; cell_x++)
+			{
+				for (int32_t row = proximity->buckets[smm_proximity_bucket (cell_x, cell_y)]; row >= 0; row = proximity->next[row])
+				{
+					/* Several cells share each bucket */
+					if (proximity->cell_x[row] == cell_x && proximity->cell_y[row] == cell_y)
+					{
+						smm_proximity_check (proximity, &query, (size_t) row);
+					}
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock (&proximity->lock);
+
+	return query.hits_count;
+}
+
+void
+smm_proximity_destroy (smm_proximity proximity)
+{
+	if (proximity)
+	{
+		smm_proximity_detach (proximity);
+		free (proximity->asset_id);
+		free (proximity->x);
+		free (proximity->y);
+		free (proximity->altitude);
+		free (proximity->velocity_east);
+		free (proximity->velocity_north);
+		free (proximity->cell_x);
+		free (proximity->cell_y);
+		free (proximity->next);
+		free (proximity->prev);
+		smm_id_index_free (&proximity->index);
+		pthread_mutex_destroy (&proximity->lock);
+		free (proximity);
+	}
+}
@@ -0,0 +1,244 @@
+/**
+ * smm-asset-replay.c, Number position reports so they can be replayed without duplicates
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+
+#include <jansson.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Every report carries seq, and the server stores at most one fix per asset
+ * and seq. The first sequence number is the realtime clock in microseconds,
+ * so numbers keep increasing across restarts as long as the clock does. An
+ * asset without a clock that survives a restart can step back, so the state
+ * file keeps a mark ahead of the last number used, and a restored asset
+ * carries on from whichever is higher. Reports stay queued until the server
+ * confirms it stored them. The confirmation may come from the response, or
+ * from asking the server before a replay when the response was lost.
+ */
+
+struct smm_report_s
+{
+	uint64_t seq;
+	smm_fix fix;
+};
+
+void
+smm_report_init (smm_asset asset)
+{
+	pthread_mutex_init (&asset->reports_lock, NULL);
+	asset->report_seq = smm_clock_realtime_ms () * 1000;
+}
+
+void
+smm_report_free (smm_asset asset)
+{
+	free (asset->reports);
+	pthread_mutex_destroy (&asset->reports_lock);
+}
+
+/* The mark to save, far enough ahead to cover the reports sent before the next save */
+uint64_t
+smm_report_seq_mark (smm_asset asset)
+{
+	pthread_mutex_lock (&asset->reports_lock);
+	uint64_t mark = asset->report_seq + SMM_REPORT_SEQ_RESERVE;
+	pthread_mutex_unlock (&asset->reports_lock);
+	return mark;
+}
+
+/* Never reuse a number from before the restart, even if the clock is now behind */
+void
+smm_report_seq_restore (smm_asset asset, uint64_t mark)
+{
+	pthread_mutex_lock (&asset->reports_lock);
+	if (mark > asset->report_seq)
+	{
+		asset->report_seq = mark;
+	}
+	pthread_mutex_unlock (&asset->reports_lock);
+}
+
+/* Take count sequence numbers at once, returning the first */
+uint64_t
+smm_report_seq_reserve (smm_asset asset, size_t count)
+{
+	pthread_mutex_lock (&asset->reports_lock);
+	uint64_t first = asset->report_seq + 1;
+	asset->report_seq += count;
+	pthread_mutex_unlock (&asset->reports_lock);
+	return first;
+}
+
+/* Queue a fix for sending, returning its sequence number */
+uint64_t
+smm_report_queue (smm_asset asset, const smm_fix * fix)
+{
+	pthread_mutex_lock (&asset->reports_lock);
+	uint64_t seq = ++asset->report_seq;
+	if (asset->reports_count == SMM_REPORTS_MAX)
+	{
+		/* Give up on the oldest, the track still has it for a backfill */
+		memmove (&asset->reports[0], &asset->reports[1], (SMM_REPORTS_MAX - 1) * sizeof (struct smm_report_s));
+		asset->reports_count--;
+		asset->reports_dropped++;
+	}
+	if (asset->reports == NULL)
+	{
+		asset->reports = malloc (SMM_REPORTS_MAX * sizeof (struct smm_report_s));
+	}
+	if (asset->reports)
+	{
+		asset->reports[asset->reports_count].seq = seq;
+		asset->reports[asset->reports_count].fix = *fix;
+		asset->reports_count++;
+	}
+	pthread_mutex_unlock (&asset->reports_lock);
+	return seq;
+}
+
+/* The server has stored the report numbered seq */
+void
+smm_report_acknowledge (smm_asset asset, uint64_t seq)
+{
+	pthread_mutex_lock (&asset->reports_lock);
+	if (seq > asset->acked_seq)
+	{
+		asset->acked_seq = seq;
+	}
+	/* The queue is in sequence order */
+	for (size_t i = 0; i < asset->reports_count && asset->reports[i].seq <= seq; i++)
+	{
+		if (asset->reports[i].seq == seq)
+		{
+			asset->reports_count--;
+			memmove (&asset->reports[i], &asset->reports[i + 1], (asset->reports_count - i) * sizeof (struct smm_report_s));
+			break;
+		}
+	}
+	pthread_mutex_unlock (&asset->reports_lock);
+}
+
+/* Ask the server which queued reports it already has, so replay can skip them */
+static void
+smm_report_fetch_acks (smm_asset asset, uint64_t since)
+{
+	struct buffer_s buf = { NULL, 0 };
+	json_error_t json_error;
+	char *page = NULL;
+
+	if (asprintf (&page, "/data/assets/%lld/position/ack/?since=%llu", asset->asset_id, (unsigned long long) since) < 0)
+	{
+		return;
+	}
+	struct smm_curl_res_s *res = smm_connection_curl_request (asset->conn, page, NULL, to_buffer, &buf, SMM_REQUEST_COMPACT);
+	free (page);
+	if (res && res->success && res->httpcode == HTTP_SUCCESS)
+	{
+		/* {"stored": [seq, ...]} */
+		json_t *json_root = json_loadb (buf.data, buf.bytes, 0, &json_error);
+		json_t *json_stored = json_object_get (json_root, "stored");
+		size_t index = 0;
+		json_t *value = NULL;
+		json_array_foreach (json_stored, index, value)
+		{
+			if (json_is_integer (value))
+			{
+				smm_report_acknowledge (asset, json_integer_value (value));
+			}
+		}
+		json_decref (json_root);
+	}
+	smm_curl_res_free (res);
+	free (buf.data);
+}
+
+bool
+smm_asset_replay_reports (smm_asset asset)
+{
+	if (asset == NULL)
+	{
+		return false;
+	}
+
+	pthread_mutex_lock (&asset->reports_lock);
+	size_t pending = asset->reports_count;
+	uint64_t first = pending ? asset->reports[0].seq : 0;
+	/* Later reports are still being sent live */
+	uint64_t last = asset->report_seq;
+	pthread_mutex_unlock (&asset->reports_lock);
+	if (pending == 0)
+	{
+		return true;
+	}
+
+	smm_report_fetch_acks (asset, first);
+	uint64_t sent = 0;
+	while (true)
+	{
+		struct smm_report_s report = { 0 };
+		pthread_mutex_lock (&asset->reports_lock);
+		for (size_t i = 0; i < asset->reports_count; i++)
+		{
+			if (asset->reports[i].seq > sent)
+			{
+				report = asset->reports[i];
+				break;
+			}
+		}
+		pthread_mutex_unlock (&asset->reports_lock);
+		if (report.seq == 0 || report.seq > last)
+		{
+			return true;
+		}
+
+		DEBUG ("Replaying report %llu for %lld\n", (unsigned long long) report.seq, asset->asset_id);
+		if (!smm_asset_send_fix (asset, &report.fix, report.seq))
+		{
+			return false;
+		}
+		sent = report.seq;
+	}
+}
+
+size_t
+smm_asset_pending_reports (smm_asset asset, uint64_t *acked, size_t *dropped)
+{
+	if (asset == NULL)
+	{
+		return 0;
+	}
+	pthread_mutex_lock (&asset->reports_lock);
+	size_t pending = asset->reports_count;
+	if (acked)
+	{
+		*acked = asset->acked_seq;
+	}
+	if (dropped)
+	{
+		*dropped = asset->reports_dropped;
+	}
+	pthread_mutex_unlock (&asset->reports_lock);
+	return pending;
+}
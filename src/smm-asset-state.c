@@ -0,0 +1,527 @@
+/**
+ * smm-asset-state.c, Save and restore assets and accepted searches for a warm start
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+
+#include <jansson.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * The file is only ever read back on the same machine, so it is written in
+ * native byte order:
+ *   "SMMS" version:u32 count:u32
+ *   per asset: id:i64 type_id:i64 name type command:u32 lat:f64 lon:f64 seq_mark:u64 has_search:u8
+ *   per search: url distance:u64 length:u64 sweep_width:u32 version:u64 count:u64 (lat:f64 lon:f64)...
+ * with strings stored as length:u16 followed by the bytes.
+ * The session cookie isn't saved, a restored connection logs in again.
+ */
+#define SMM_STATE_MAGIC "SMMS"
+#define SMM_STATE_VERSION 2
+
+struct smm_restore_entry
+{
+	long long asset_id;
+	char *url;
+	uint64_t version;
+	smm_restore_status status;
+};
+
+/* Shared by the restored assets and the thread checking them */
+struct smm_restore_s
+{
+	smm_connection conn;
+	pthread_t thread;
+	unsigned int refs;
+	struct smm_restore_entry *entries;
+	size_t entries_count;
+	struct smm_restore_s *next;
+};
+
+static bool
+write_string (FILE *f, const char *str)
+{
+	size_t len = str ? strlen (str) : 0;
+	if (len > UINT16_MAX)
+	{
+		return false;
+	}
+	uint16_t len16 = len;
+	return fwrite (&len16, sizeof (len16), 1, f) == 1 && (len == 0 || fwrite (str, len, 1, f) == 1);
+}
+
+static bool
+read_string (FILE *f, char **str)
+{
+	uint16_t len = 0;
+	if (fread (&len, sizeof (len), 1, f) != 1)
+	{
+		return false;
+	}
+	*str = malloc (len + 1);
+	if (*str == NULL || (len > 0 && fread (*str, len, 1, f) != 1))
+	{
+		free (*str);
+		*str = NULL;
+		return false;
+	}
+	(*str)[len] = '\0';
+	return true;
+}
+
+static bool
+smm_state_write_search (FILE *f, smm_search search)
+{
+	uint64_t distance = search->distance;
+	uint64_t length = search->length;
+	uint32_t sweep_width = search->sweep_width;
+	/* smm_search_update may be patching waypoints, save the published snapshot instead */
+	smm_geometry_reader reader = smm_search_reader_register (search);
+	if (reader == NULL)
+	{
+		return false;
+	}
+	const smm_geometry *geometry = smm_search_geometry (search);
+	uint64_t version = geometry ? geometry->version : 0;
+	uint64_t count = geometry ? geometry->waypoints_count : 0;
+
+	bool ok = write_string (f, search->url) &&
+		fwrite (&distance, sizeof (distance), 1, f) == 1 &&
+		fwrite (&length, sizeof (length), 1, f) == 1 &&
+		fwrite (&sweep_width, sizeof (sweep_width), 1, f) == 1 &&
+		fwrite (&version, sizeof (version), 1, f) == 1 &&
+		fwrite (&count, sizeof (count), 1, f) == 1 &&
+		(count == 0 || fwrite (geometry->waypoints, sizeof (struct smm_waypoint_s), count, f) == count);
+	smm_geometry_reader_unregister (reader);
+	return ok;
+}
+
+static bool
+smm_state_write_asset (FILE *f, smm_asset asset)
+{
+	int64_t asset_id = asset->asset_id;
+	int64_t asset_type_id = asset->asset_type_id;
+	uint32_t command = asset->last_command;
+	uint64_t seq_mark = smm_report_seq_mark (asset);
+	uint8_t has_search = asset->accepted_search != NULL;
+
+	if (!(fwrite (&asset_id, sizeof (asset_id), 1, f) == 1 &&
+	      fwrite (&asset_type_id, sizeof (asset_type_id), 1, f) == 1 &&
+	      write_string (f, asset->name) &&
+	      write_string (f, asset->type) &&
+	      fwrite (&command, sizeof (command), 1, f) == 1 &&
+	      fwrite (&asset->last_command_lat, sizeof (double), 1, f) == 1 &&
+	      fwrite (&asset->last_command_lon, sizeof (double), 1, f) == 1 &&
+	      fwrite (&seq_mark, sizeof (seq_mark), 1, f) == 1 &&
+	      fwrite (&has_search, sizeof (has_search), 1, f) == 1))
+	{
+		return false;
+	}
+	return !has_search || smm_state_write_search (f, asset->accepted_search);
+}
+
+bool
+smm_connection_save_state (smm_connection conn, const char *path)
+{
+	char *tmp_path = NULL;
+
+	if (conn == NULL || path == NULL || asprintf (&tmp_path, "%s.tmp", path) < 0)
+	{
+		return false;
+	}
+
+	FILE *f = fopen (tmp_path, "wb");
+	if (f == NULL)
+	{
+		free (tmp_path);
+		return false;
+	}
+
+	pthread_mutex_lock (&conn->assets_lock);
+	uint32_t version = SMM_STATE_VERSION;
+	uint32_t count = conn->assets_count;
+	bool ok = fwrite (SMM_STATE_MAGIC, 4, 1, f) == 1 &&
+		fwrite (&version, sizeof (version), 1, f) == 1 &&
+		fwrite (&count, sizeof (count), 1, f) == 1;
+	for (size_t i = 0; ok && i < conn->assets_count; i++)
+	{
+		ok = smm_state_write_asset (f, conn->assets[i]);
+	}
+	pthread_mutex_unlock (&conn->assets_lock);
+
+	/* Only replace the old file once the new one is safely on disk */
+	ok = ok && fflush (f) == 0 && fsync (fileno (f)) == 0;
+	ok = (fclose (f) == 0) && ok;
+	if (ok && rename (tmp_path, path) != 0)
+	{
+		ok = false;
+	}
+	if (!ok)
+	{
+		unlink (tmp_path);
+	}
+	free (tmp_path);
+
+	return ok;
+}
+
+static smm_search
+smm_state_read_search (FILE *f, smm_asset asset)
+{
+	char *url = NULL;
+	uint64_t distance = 0;
+	uint64_t length = 0;
+	uint32_t sweep_width = 0;
+	uint64_t version = 0;
+	uint64_t count = 0;
+
+	if (!(read_string (f, &url) &&
+	      fread (&distance, sizeof (distance), 1, f) == 1 &&
+	      fread (&length, sizeof (length), 1, f) == 1 &&
+	      fread (&sweep_width, sizeof (sweep_width), 1, f) == 1 &&
+	      fread (&version, sizeof (version), 1, f) == 1 &&
+	      fread (&count, sizeof (count), 1, f) == 1) || count > SIZE_MAX / sizeof (struct smm_waypoint_s))
+	{
+		free (url);
+		return NULL;
+	}
+
+	smm_search search = smm_search_create (asset, url, length, distance, sweep_width);
+	free (url);
+	if (search == NULL)
+	{
+		return NULL;
+	}
+	if (count > 0)
+	{
+		search->waypoints = malloc (count * sizeof (struct smm_waypoint_s));
+		if (search->waypoints == NULL || fread (search->waypoints, sizeof (struct smm_waypoint_s), count, f) != count)
+		{
+			smm_search_destroy (search);
+			return NULL;
+		}
+		search->waypoints_count = count;
+		search->version = version;
+		search->parsed = true;
+		smm_search_publish (search);
+	}
+	search->accepted = true;
+
+	return search;
+}
+
+static smm_asset
+smm_state_read_asset (FILE *f, smm_connection conn)
+{
+	int64_t asset_id = 0;
+	int64_t asset_type_id = 0;
+	char *name = NULL;
+	char *type = NULL;
+	uint32_t command = 0;
+	double lat = 0.0;
+	double lon = 0.0;
+	uint64_t seq_mark = 0;
+	uint8_t has_search = 0;
+
+	bool ok = fread (&asset_id, sizeof (asset_id), 1, f) == 1 &&
+		fread (&asset_type_id, sizeof (asset_type_id), 1, f) == 1 &&
+		read_string (f, &name) &&
+		read_string (f, &type) &&
+		fread (&command, sizeof (command), 1, f) == 1 &&
+		fread (&lat, sizeof (lat), 1, f) == 1 &&
+		fread (&lon, sizeof (lon), 1, f) == 1 &&
+		fread (&seq_mark, sizeof (seq_mark), 1, f) == 1 &&
+		fread (&has_search, sizeof (has_search), 1, f) == 1;
+	smm_asset asset = ok ? smm_asset_create (conn, name, type, asset_id, asset_type_id) : NULL;
+	free (name);
+	free (type);
+	if (asset == NULL)
+	{
+		return NULL;
+	}
+
+	asset->last_command = command;
+	asset->last_command_lat = lat;
+	asset->last_command_lon = lon;
+	smm_report_seq_restore (asset, seq_mark);
+	if (has_search)
+	{
+		asset->restored_search = smm_state_read_search (f, asset);
+		if (asset->restored_search == NULL)
+		{
+			smm_asset_free_asset (asset);
+			return NULL;
+		}
+		smm_asset_remember_search (asset, asset->restored_search);
+	}
+
+	return asset;
+}
+
+void
+smm_restore_unref (struct smm_restore_s *restore)
+{
+	if (restore && __atomic_sub_fetch (&restore->refs, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		for (size_t i = 0; i < restore->entries_count; i++)
+		{
+			free (restore->entries[i].url);
+		}
+		free (restore->entries);
+		free (restore);
+	}
+}
+
+static void
+smm_restore_set (struct smm_restore_entry *entry, smm_restore_status status)
+{
+	__atomic_store_n (&entry->status, status, __ATOMIC_RELEASE);
+}
+
+/* Does the server still list the asset for this user */
+static void
+smm_restore_check_assets (struct smm_restore_s *restore)
+{
+	struct buffer_s buf = { NULL, 0 };
+	json_error_t json_error;
+
+	struct smm_curl_res_s *res = smm_connection_curl_retrieve_url (restore->conn, "/assets/mine/json/", NULL, to_buffer, &buf);
+	if (res == NULL || !(res->success && res->httpcode == HTTP_SUCCESS))
+	{
+		smm_curl_res_free (res);
+		free (buf.data);
+		for (size_t i = 0; i < restore->entries_count; i++)
+		{
+			smm_restore_set (&restore->entries[i], SMM_RESTORE_UNVERIFIED);
+		}
+		return;
+	}
+	smm_curl_res_free (res);
+
+	json_t *json_root = json_loadb (buf.data, buf.bytes, 0, &json_error);
+	free (buf.data);
+	if (json_root == NULL)
+	{
+		printf ("Error on line %i: %s\n", json_error.line, json_error.text);
+	}
+	json_t *json_assets = json_object_get (json_root, "assets");
+	for (size_t i = 0; i < restore->entries_count; i++)
+	{
+		smm_restore_status status = json_assets ? SMM_RESTORE_INVALID : SMM_RESTORE_UNVERIFIED;
+		size_t index = 0;
+		json_t *value = NULL;
+		json_array_foreach (json_assets, index, value)
+		{
+			if (json_integer_value (json_object_get (value, "id")) == restore->entries[i].asset_id)
+			{
+				status = SMM_RESTORE_VALID;
+				break;
+			}
+		}
+		smm_restore_set (&restore->entries[i], status);
+	}
+	json_decref (json_root);
+}
+
+/* Has the accepted search's geometry moved on since it was saved */
+static void
+smm_restore_check_search (struct smm_restore_s *restore, struct smm_restore_entry *entry)
+{
+	struct buffer_s buf = { NULL, 0 };
+	json_error_t json_error;
+
+	char *page = smm_search_delta_path (entry->url, entry->version);
+	if (page == NULL)
+	{
+		/* Without a delta endpoint there is no cheap way to tell */
+		smm_restore_set (entry, SMM_RESTORE_STALE);
+		return;
+	}
+	struct smm_curl_res_s *res = smm_connection_curl_retrieve_url (restore->conn, page, NULL, to_buffer, &buf);
+	free (page);
+	if (res == NULL || !(res->success && res->httpcode == HTTP_SUCCESS))
+	{
+		smm_restore_set (entry, res && res->success ? SMM_RESTORE_STALE : SMM_RESTORE_UNVERIFIED);
+		smm_curl_res_free (res);
+		free (buf.data);
+		return;
+	}
+	smm_curl_res_free (res);
+
+	json_t *json_root = json_loadb (buf.data, buf.bytes, 0, &json_error);
+	free (buf.data);
+	json_t *json_version = json_object_get (json_root, "version");
+	bool same = json_is_integer (json_version) && (uint64_t) json_integer_value (json_version) == entry->version;
+	smm_restore_set (entry, same ? SMM_RESTORE_VALID : SMM_RESTORE_STALE);
+	json_decref (json_root);
+}
+
+static void *
+smm_restore_thread (void *arg)
+{
+	struct smm_restore_s *restore = arg;
+
+	smm_restore_check_assets (restore);
+	for (size_t i = 0; i < restore->entries_count; i++)
+	{
+		struct smm_restore_entry *entry = &restore->entries[i];
+		if (entry->url && __atomic_load_n (&entry->status, __ATOMIC_ACQUIRE) == SMM_RESTORE_VALID)
+		{
+			smm_restore_check_search (restore, entry);
+		}
+	}
+	DEBUG ("Checked %zu restored assets\n", restore->entries_count);
+
+	return NULL;
+}
+
+/* Start checking the restored assets against the server */
+static void
+smm_restore_validate (smm_connection conn, smm_assets assets, size_t assets_count)
+{
+	struct smm_restore_s *restore = calloc (1, sizeof (struct smm_restore_s));
+	if (restore == NULL)
+	{
+		return;
+	}
+	restore->conn = conn;
+	restore->entries = calloc (assets_count, sizeof (struct smm_restore_entry));
+	if (restore->entries == NULL)
+	{
+		free (restore);
+		return;
+	}
+	restore->entries_count = assets_count;
+	for (size_t i = 0; i < assets_count; i++)
+	{
+		struct smm_restore_entry *entry = &restore->entries[i];
+		entry->asset_id = assets[i]->asset_id;
+		entry->status = SMM_RESTORE_PENDING;
+		if (assets[i]->restored_search && assets[i]->restored_search->url)
+		{
+			entry->url = strdup (assets[i]->restored_search->url);
+			entry->version = assets[i]->restored_search->version;
+		}
+	}
+
+	/* One reference for the thread, one for each asset */
+	restore->refs = 1 + assets_count;
+	if (pthread_create (&restore->thread, NULL, smm_restore_thread, restore) != 0)
+	{
+		restore->refs = 1;
+		smm_restore_unref (restore);
+		return;
+	}
+	for (size_t i = 0; i < assets_count; i++)
+	{
+		assets[i]->restore = restore;
+		assets[i]->restore_index = i;
+	}
+	pthread_mutex_lock (&conn->assets_lock);
+	restore->next = conn->restores;
+	conn->restores = restore;
+	pthread_mutex_unlock (&conn->assets_lock);
+}
+
+bool
+smm_connection_restore_state (smm_connection conn, const char *path, smm_assets * assets, size_t * assets_count)
+{
+	char magic[4];
+	uint32_t version = 0;
+	uint32_t count = 0;
+
+	if (conn == NULL || path == NULL || assets == NULL || assets_count == NULL)
+	{
+		return false;
+	}
+	*assets = NULL;
+	*assets_count = 0;
+
+	FILE *f = fopen (path, "rb");
+	if (f == NULL)
+	{
+		return false;
+	}
+	if (!(fread (magic, sizeof (magic), 1, f) == 1 && memcmp (magic, SMM_STATE_MAGIC, sizeof (magic)) == 0 &&
+	      fread (&version, sizeof (version), 1, f) == 1 && version == SMM_STATE_VERSION &&
+	      fread (&count, sizeof (count), 1, f) == 1))
+	{
+		fclose (f);
+		return false;
+	}
+
+	smm_assets restored = calloc (count ? count : 1, sizeof (smm_asset));
+	if (restored == NULL)
+	{
+		fclose (f);
+		return false;
+	}
+	size_t restored_count = 0;
+	for (; restored_count < count; restored_count++)
+	{
+		smm_asset asset = smm_state_read_asset (f, conn);
+		if (asset == NULL)
+		{
+			/* A truncated file is no use, start from the server instead */
+			fclose (f);
+			smm_asset_free_assets (restored, restored_count);
+			return false;
+		}
+		restored[restored_count] = asset;
+	}
+	fclose (f);
+
+	smm_restore_validate (conn, restored, restored_count);
+
+	*assets = restored;
+	*assets_count = restored_count;
+	return true;
+}
+
+smm_restore_status
+smm_asset_restore_status (smm_asset asset)
+{
+	if (asset == NULL || asset->restore == NULL)
+	{
+		return SMM_RESTORE_NONE;
+	}
+	return __atomic_load_n (&asset->restore->entries[asset->restore_index].status, __ATOMIC_ACQUIRE);
+}
+
+void
+smm_restore_join (smm_connection conn)
+{
+	pthread_mutex_lock (&conn->assets_lock);
+	struct smm_restore_s *restore = conn->restores;
+	conn->restores = NULL;
+	pthread_mutex_unlock (&conn->assets_lock);
+
+	while (restore)
+	{
+		struct smm_restore_s *next = restore->next;
+		pthread_join (restore->thread, NULL);
+		smm_restore_unref (restore);
+		restore = next;
+	}
+}
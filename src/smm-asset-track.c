@@ -0,0 +1,498 @@
+/**
+ * smm-asset-track.c, Compressed in-memory store of an asset's track
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Fixes are kept in blocks of up to TRACK_BLOCK_FIXES. Each fix is stored as
+ * a flags byte followed by zigzag varint deltas from the previous fix in the
+ * same block, so a block can be decoded without looking at any other block.
+ * Positions are quantised to micro-degrees (about 11cm), speed to dm/s.
+ * The block index records the time span and bounding box of every block so
+ * queries only decode the blocks that can match.
+ */
+#define TRACK_BLOCK_FIXES 256
+#define TRACK_POINT_MAX_BYTES 48
+#define TRACK_DEGREE_SCALE 1000000.0
+
+enum track_flags
+{
+	TRACK_ALTITUDE = 0x01,
+	TRACK_BEARING = 0x02,
+	TRACK_SPEED = 0x04,
+	TRACK_FIX = 0x08,
+};
+
+struct track_point
+{
+	int64_t time_ms;
+	int32_t lat;
+	int32_t lon;
+	int64_t altitude;
+	int32_t bearing;
+	int64_t speed;
+	uint8_t fix;
+};
+
+struct track_block
+{
+	uint64_t min_time_ms;
+	uint64_t max_time_ms;
+	int32_t min_lat;
+	int32_t max_lat;
+	int32_t min_lon;
+	int32_t max_lon;
+	uint32_t count;
+	size_t bytes;
+	size_t size;
+	uint8_t *data;
+};
+
+struct smm_track_s
+{
+	pthread_mutex_t lock;
+	struct track_block *blocks;
+	size_t blocks_count;
+	size_t blocks_size;
+	struct track_point last;
+	size_t count;
+};
+
+static uint8_t *
+varint_put (uint8_t *p, int64_t value)
+{
+	uint64_t zz = ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+	while (zz >= 0x80)
+	{
+		*p++ = (uint8_t) (zz | 0x80);
+		zz >>= 7;
+	}
+	*p++ = (uint8_t) zz;
+	return p;
+}
+
+static const uint8_t *
+varint_get (const uint8_t *p, int64_t *value)
+{
+	uint64_t zz = 0;
+	unsigned int shift = 0;
+	do
+	{
+		zz |= (uint64_t) (*p & 0x7f) << shift;
+		shift += 7;
+	}
+	while (*p++ & 0x80);
+	*value = (int64_t) (zz >> 1) ^ -(int64_t) (zz & 1);
+	return p;
+}
+
+static int32_t
+track_degrees (double degrees)
+{
+	double scaled = degrees * TRACK_DEGREE_SCALE;
+	return (int32_t) (scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+}
+
+static void
+track_point_from_fix (struct track_point *point, const smm_fix * fix)
+{
+	point->time_ms = (int64_t) fix->time_ms;
+	point->lat = track_degrees (fix->lat);
+	point->lon = track_degrees (fix->lon);
+	point->altitude = fix->altitude;
+	point->bearing = fix->bearing;
+	point->speed = fix->speed > 0.0f ? (int64_t) (fix->speed * 10.0f + 0.5f) : 0;
+	point->fix = fix->fix;
+}
+
+static void
+track_point_to_fix (const struct track_point *point, smm_fix * fix)
+{
+	fix->time_ms = (uint64_t) point->time_ms;
+	fix->lat = point->lat / TRACK_DEGREE_SCALE;
+	fix->lon = point->lon / TRACK_DEGREE_SCALE;
+	fix->altitude = (unsigned int) point->altitude;
+	fix->bearing = (uint16_t) point->bearing;
+	fix->speed = point->speed / 10.0f;
+	fix->fix = point->fix;
+}
+
+static uint8_t *
+track_point_encode (uint8_t *p, const struct track_point *prev, const struct track_point *point)
+{
+	uint8_t *flags = p++;
+	*flags = 0;
+	p = varint_put (p, point->time_ms - prev->time_ms);
+	p = varint_put (p, (int64_t) point->lat - prev->lat);
+	p = varint_put (p, (int64_t) point->lon - prev->lon);
+	if (point->altitude != prev->altitude)
+	{
+		*flags |= TRACK_ALTITUDE;
+		p = varint_put (p, point->altitude - prev->altitude);
+	}
+	if (point->bearing != prev->bearing)
+	{
+		*flags |= TRACK_BEARING;
+		p = varint_put (p, (int64_t) point->bearing - prev->bearing);
+	}
+	if (point->speed != prev->speed)
+	{
+		*flags |= TRACK_SPEED;
+		p = varint_put (p, point->speed - prev->speed);
+	}
+	if (point->fix != prev->fix)
+	{
+		*flags |= TRACK_FIX;
+		*p++ = point->fix;
+	}
+	return p;
+}
+
+static const uint8_t *
+track_point_decode (const uint8_t *p, struct track_point *point)
+{
+	int64_t delta = 0;
+	uint8_t flags = *p++;
+	p = varint_get (p, &delta);
+	point->time_ms += delta;
+	p = varint_get (p, &delta);
+	point->lat += (int32_t) delta;
+	p = varint_get (p, &delta);
+	point->lon += (int32_t) delta;
+	if (flags & TRACK_ALTITUDE)
+	{
+		p = varint_get (p, &delta);
+		point->altitude += delta;
+	}
+	if (flags & TRACK_BEARING)
+	{
+		p = varint_get (p, &delta);
+		point->bearing += (int32_t) delta;
+	}
+	if (flags & TRACK_SPEED)
+	{
+		p = varint_get (p, &delta);
+		point->speed += delta;
+	}
+	if (flags & TRACK_FIX)
+	{
+		point->fix = *p++;
+	}
+	return p;
+}
+
+struct smm_track_s *
+smm_track_create (void)
+{
+	struct smm_track_s *track = calloc (1, sizeof (struct smm_track_s));
+	if (track == NULL)
+	{
+		return NULL;
+	}
+	pthread_mutex_init (&track->lock, NULL);
+	return track;
+}
+
+void
+smm_track_free (struct smm_track_s *track)
+{
+	if (track)
+	{
+		for (size_t i = 0; i < track->blocks_count; i++)
+		{
+			free (track->blocks[i].data);
+		}
+		free (track->blocks);
+		pthread_mutex_destroy (&track->lock);
+		free (track);
+	}
+}
+
+static struct track_block *
+smm_track_block_new (struct smm_track_s *track)
+{
+	if (track->blocks_count > 0)
+	{
+		/* Seal the previous block */
+		struct track_block *prev = &track->blocks[track->blocks_count - 1];
+		uint8_t *data = realloc (prev->data, prev->bytes);
+		if (data)
+		{
+			prev->data = data;
+			prev->size = prev->bytes;
+		}
+	}
+	if (track->blocks_count == track->blocks_size)
+	{
+		size_t size = track->blocks_size ? track->blocks_size * 2 : 16;
+		struct track_block *blocks = realloc (track->blocks, size * sizeof (struct track_block));
+		if (blocks == NULL)
+		{
+			return NULL;
+		}
+		track->blocks = blocks;
+		track->blocks_size = size;
+	}
+	struct track_block *block = &track->blocks[track->blocks_count++];
+	memset (block, 0, sizeof (struct track_block));
+	memset (&track->last, 0, sizeof (struct track_point));
+	return block;
+}
+
+void
+smm_track_record (struct smm_track_s *track, const smm_fix * fix)
+{
+	struct track_point point;
+	uint8_t encoded[TRACK_POINT_MAX_BYTES];
+
+	if (track == NULL || fix == NULL)
+	{
+		return;
+	}
+	track_point_from_fix (&point, fix);
+
+	pthread_mutex_lock (&track->lock);
+	struct track_block *block = NULL;
+	if (track->blocks_count > 0 && track->blocks[track->blocks_count - 1].count < TRACK_BLOCK_FIXES)
+	{
+		block = &track->blocks[track->blocks_count - 1];
+	}
+	else
+	{
+		block = smm_track_block_new (track);
+	}
+	if (block == NULL)
+	{
+		pthread_mutex_unlock (&track->lock);
+		return;
+	}
+
+	size_t len = (size_t) (track_point_encode (encoded, &track->last, &point) - encoded);
+	if (block->bytes + len > block->size)
+	{
+		size_t size = block->size ? block->size * 2 : 256;
+		uint8_t *data = realloc (block->data, size);
+		if (data == NULL)
+		{
+			pthread_mutex_unlock (&track->lock);
+			return;
+		}
+		block->data = data;
+		block->size = size;
+	}
+	memcpy (&block->data[block->bytes], encoded, len);
+	block->bytes += len;
+
+	if (block->count == 0)
+	{
+		block->min_time_ms = block->max_time_ms = fix->time_ms;
+		block->min_lat = block->max_lat = point.lat;
+		block->min_lon = block->max_lon = point.lon;
+	}
+	else
+	{
+		/* Fixes are normally in time order, but don't rely on the clock */
+		block->min_time_ms = fix->time_ms < block->min_time_ms ? fix->time_ms : block->min_time_ms;
+		block->max_time_ms = fix->time_ms > block->max_time_ms ? fix->time_ms : block->max_time_ms;
+		block->min_lat = point.lat < block->min_lat ? point.lat : block->min_lat;
+		block->max_lat = point.lat > block->max_lat ? point.lat : block->max_lat;
+		block->min_lon = point.lon < block->min_lon ? point.lon : block->min_lon;
+		block->max_lon = point.lon > block->max_lon ? point.lon : block->max_lon;
+	}
+	block->count++;
+	track->count++;
+	track->last = point;
+	pthread_mutex_unlock (&track->lock);
+}
+
+static bool
+smm_fixes_append (smm_fix ** fixes, size_t * fixes_count, size_t * fixes_size, const smm_fix * fix)
+{
+	if (*fixes_count == *fixes_size)
+	{
+		size_t size = *fixes_size ? *fixes_size * 2 : 64;
+		smm_fix *tmp = realloc (*fixes, size * sizeof (smm_fix));
+		if (tmp == NULL)
+		{
+			return false;
+		}
+		*fixes = tmp;
+		*fixes_size = size;
+	}
+	(*fixes)[(*fixes_count)++] = *fix;
+	return true;
+}
+
+/* area is NULL, or min_lat, min_lon, max_lat, max_lon */
+bool
+smm_track_get (struct smm_track_s *track, uint64_t from_ms, uint64_t to_ms, const double *area, smm_fix ** fixes, size_t * fixes_count)
+{
+	size_t fixes_size = 0;
+	int32_t min_lat = INT32_MIN;
+	int32_t min_lon = INT32_MIN;
+	int32_t max_lat = INT32_MAX;
+	int32_t max_lon = INT32_MAX;
+	bool res = true;
+
+	*fixes = NULL;
+	*fixes_count = 0;
+	if (track == NULL)
+	{
+		return false;
+	}
+	if (area)
+	{
+		min_lat = track_degrees (area[0]);
+		min_lon = track_degrees (area[1]);
+		max_lat = track_degrees (area[2]);
+		max_lon = track_degrees (area[3]);
+	}
+
+	pthread_mutex_lock (&track->lock);
+	for (size_t b = 0; b < track->blocks_count && res; b++)
+	{
+		const struct track_block *block = &track->blocks[b];
+		if (block->max_time_ms < from_ms || block->min_time_ms > to_ms)
+		{
+			continue;
+		}
+		if (block->max_lat < min_lat || block->min_lat > max_lat || block->max_lon < min_lon || block->min_lon > max_lon)
+		{
+			continue;
+		}
+
+		struct track_point point;
+		const uint8_t *p = block->data;
+		memset (&point, 0, sizeof (point));
+		for (uint32_t i = 0; i < block->count; i++)
+		{
+			p = track_point_decode (p, &point);
+			if ((uint64_t) point.time_ms < from_ms || (uint64_t) point.time_ms > to_ms)
+			{
+				continue;
+			}
+			if (point.lat < min_lat || point.lat > max_lat || point.lon < min_lon || point.lon > max_lon)
+			{
+				continue;
+			}
+			smm_fix fix;
+			track_point_to_fix (&point, &fix);
+			if (!smm_fixes_append (fixes, fixes_count, &fixes_size, &fix))
+			{
+				res = false;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock (&track->lock);
+
+	if (!res)
+	{
+		free (*fixes);
+		*fixes = NULL;
+		*fixes_count = 0;
+	}
+	return res;
+}
+
+bool
+smm_asset_track_enable (smm_asset asset, bool enable)
+{
+	if (asset == NULL)
+	{
+		return false;
+	}
+	if (enable && asset->track == NULL)
+	{
+		asset->track = smm_track_create ();
+		return asset->track != NULL;
+	}
+	if (!enable && asset->track != NULL)
+	{
+		smm_track_free (asset->track);
+		asset->track = NULL;
+	}
+	return true;
+}
+
+size_t
+smm_asset_track_count (smm_asset asset)
+{
+	size_t count = 0;
+	if (asset && asset->track)
+	{
+		pthread_mutex_lock (&asset->track->lock);
+		count = asset->track->count;
+		pthread_mutex_unlock (&asset->track->lock);
+	}
+	return count;
+}
+
+size_t
+smm_asset_track_bytes (smm_asset asset)
+{
+	size_t bytes = 0;
+	if (asset && asset->track)
+	{
+		struct smm_track_s *track = asset->track;
+		pthread_mutex_lock (&track->lock);
+		bytes = sizeof (struct smm_track_s) + track->blocks_size * sizeof (struct track_block);
+		for (size_t i = 0; i < track->blocks_count; i++)
+		{
+			bytes += track->blocks[i].size;
+		}
+		pthread_mutex_unlock (&track->lock);
+	}
+	return bytes;
+}
+
+bool
+smm_asset_track_get (smm_asset asset, uint64_t from_ms, uint64_t to_ms, smm_fix ** fixes, size_t * fixes_count)
+{
+	if (asset == NULL || fixes == NULL || fixes_count == NULL)
+	{
+		return false;
+	}
+	return smm_track_get (asset->track, from_ms, to_ms, NULL, fixes, fixes_count);
+}
+
+bool
+smm_asset_track_get_area (smm_asset asset, uint64_t from_ms, uint64_t to_ms, double min_lat, double min_lon, double max_lat, double max_lon,
+			  smm_fix ** fixes, size_t * fixes_count)
+{
+	const double area[4] = { min_lat, min_lon, max_lat, max_lon };
+	if (asset == NULL || fixes == NULL || fixes_count == NULL)
+	{
+		return false;
+	}
+	return smm_track_get (asset->track, from_ms, to_ms, area, fixes, fixes_count);
+}
+
+void
+smm_fixes_free (smm_fix * fixes)
+{
+	free (fixes);
+}
@@ -0,0 +1,278 @@
+/**
+ * smm-asset-warm.c, Keep idle connections to the server open
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+/* Gaps shorter than this say nothing about the network's idle timeout */
+#define SMM_KEEP_WARM_MIN_MS 10000
+
+struct smm_keep_warm_s
+{
+	smm_connection conn;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;
+	uint64_t interval_ms;
+};
+
+/* Probe a little before the connection would be dropped */
+static uint64_t
+smm_keep_warm_interval (smm_connection conn, uint64_t interval_ms)
+{
+	uint64_t idle_timeout_ms = __atomic_load_n (&conn->idle_timeout_ms, __ATOMIC_RELAXED);
+	if (idle_timeout_ms != 0 && idle_timeout_ms * 3 / 4 < interval_ms)
+	{
+		return idle_timeout_ms * 3 / 4;
+	}
+	return interval_ms;
+}
+
+void
+smm_keep_warm_arm (smm_connection conn, CURL *curl)
+{
+	if (conn->keep_warm == NULL)
+	{
+		curl_easy_setopt (curl, CURLOPT_TCP_KEEPALIVE, 0L);
+		return;
+	}
+	long idle_s = (long) (smm_keep_warm_interval (conn, conn->keep_warm->interval_ms) / 1000);
+	if (idle_s < 1)
+	{
+		idle_s = 1;
+	}
+	curl_easy_setopt (curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt (curl, CURLOPT_TCP_KEEPIDLE, idle_s);
+	curl_easy_setopt (curl, CURLOPT_TCP_KEEPINTVL, idle_s);
+}
+
+/* Called with conn->lock held, each handle is armed again when it is next taken from the pool */
+static void
+smm_keep_warm_arm_all (smm_connection conn)
+{
+	conn->keep_warm_version++;
+}
+
+/*
+ * Called with conn->lock held after every request. A new connection after
+ * an idle gap means the old one was dropped, so the network's idle timeout
+ * is no longer than the gap. Reusing one after a longer gap than we thought
+ * possible moves the estimate up. Each handle keeps its own connections, so
+ * the gap is since the same handle was last used. A raced request passes
+ * no transfer, it went over the connections of a multi handle instead.
+ */
+void
+smm_keep_warm_observe (smm_connection conn, struct smm_transfer *transfer, uint64_t start_ms, long connects, bool ok, bool probe)
+{
+	uint64_t now_ms = smm_clock_monotonic_ms ();
+
+	__atomic_store_n (&conn->last_activity_ms, now_ms, __ATOMIC_RELAXED);
+	if (transfer == NULL)
+	{
+		return;
+	}
+
+	if (ok && transfer->last_used_ms != 0)
+	{
+		uint64_t gap_ms = start_ms - transfer->last_used_ms;
+		if (gap_ms >= SMM_KEEP_WARM_MIN_MS)
+		{
+			if (connects > 0 && (conn->idle_timeout_ms == 0 || gap_ms < conn->idle_timeout_ms))
+			{
+				DEBUG ("connection dropped after %llu ms idle\n", (unsigned long long) gap_ms);
+				__atomic_store_n (&conn->idle_timeout_ms, gap_ms, __ATOMIC_RELAXED);
+			}
+			else if (connects == 0 && conn->idle_timeout_ms != 0 && gap_ms > conn->idle_timeout_ms)
+			{
+				__atomic_store_n (&conn->idle_timeout_ms, gap_ms, __ATOMIC_RELAXED);
+			}
+		}
+	}
+
+	/* Without the probes in between this request would have had to reconnect */
+	if (ok && !probe && connects == 0 && conn->keep_warm && conn->idle_timeout_ms != 0 && transfer->last_request_ms != 0
+	    && start_ms - transfer->last_request_ms > conn->idle_timeout_ms)
+	{
+		__atomic_add_fetch (&conn->saved_reconnects, 1, __ATOMIC_RELAXED);
+	}
+
+	transfer->last_used_ms = now_ms;
+	if (!probe)
+	{
+		transfer->last_request_ms = now_ms;
+	}
+}
+
+static void *
+smm_keep_warm_thread (void *data)
+{
+	smm_keep_warm keep_warm = (smm_keep_warm) data;
+	smm_connection conn = keep_warm->conn;
+
+	pthread_mutex_lock (&keep_warm->lock);
+	while (!keep_warm->stop)
+	{
+		uint64_t interval_ms = smm_keep_warm_interval (conn, keep_warm->interval_ms);
+		uint64_t deadline_ms = __atomic_load_n (&conn->last_activity_ms, __ATOMIC_RELAXED) + interval_ms;
+		uint64_t now_ms = smm_clock_monotonic_ms ();
+		if (deadline_ms <= now_ms)
+		{
+			pthread_mutex_unlock (&keep_warm->lock);
+			DEBUG ("idle for %llu ms, probing\n", (unsigned long long) interval_ms);
+			smm_connection_rewarm (conn);
+			pthread_mutex_lock (&keep_warm->lock);
+			deadline_ms = smm_clock_monotonic_ms () + interval_ms;
+		}
+
+		struct timespec ts = {
+			.tv_sec = (time_t) (deadline_ms / 1000),
+			.tv_nsec = (long) (deadline_ms % 1000) * 1000000,
+		};
+		pthread_cond_timedwait (&keep_warm->cond, &keep_warm->lock, &ts);
+	}
+	pthread_mutex_unlock (&keep_warm->lock);
+
+	return NULL;
+}
+
+/* Free a keep warm object, its thread must not be running */
+static void
+smm_keep_warm_free (smm_keep_warm keep_warm)
+{
+	pthread_cond_destroy (&keep_warm->cond);
+	pthread_mutex_destroy (&keep_warm->lock);
+	free (keep_warm);
+}
+
+void
+smm_keep_warm_stop (smm_keep_warm keep_warm)
+{
+	if (keep_warm == NULL)
+	{
+		return;
+	}
+	pthread_mutex_lock (&keep_warm->lock);
+	keep_warm->stop = true;
+	pthread_cond_signal (&keep_warm->cond);
+	pthread_mutex_unlock (&keep_warm->lock);
+	pthread_join (keep_warm->thread, NULL);
+	smm_keep_warm_free (keep_warm);
+}
+
+/* Called with conn->lock held */
+static void
+smm_keep_warm_set_interval (smm_connection conn, smm_keep_warm keep_warm, unsigned int interval_ms)
+{
+	pthread_mutex_lock (&keep_warm->lock);
+	keep_warm->interval_ms = interval_ms;
+	pthread_cond_signal (&keep_warm->cond);
+	pthread_mutex_unlock (&keep_warm->lock);
+	smm_keep_warm_arm_all (conn);
+}
+
+bool
+smm_connection_keep_warm (smm_connection connection, unsigned int interval_ms)
+{
+	if (connection == NULL)
+	{
+		return false;
+	}
+
+	pthread_mutex_lock (&connection->lock);
+	smm_keep_warm keep_warm = connection->keep_warm;
+	if (interval_ms == 0)
+	{
+		connection->keep_warm = NULL;
+		smm_keep_warm_arm_all (connection);
+		pthread_mutex_unlock (&connection->lock);
+		/* The thread may be waiting for the connection lock to probe */
+		smm_keep_warm_stop (keep_warm);
+		return true;
+	}
+	if (keep_warm)
+	{
+		smm_keep_warm_set_interval (connection, keep_warm, interval_ms);
+		pthread_mutex_unlock (&connection->lock);
+		return true;
+	}
+	pthread_mutex_unlock (&connection->lock);
+
+	keep_warm = calloc (1, sizeof (struct smm_keep_warm_s));
+	if (keep_warm == NULL)
+	{
+		return false;
+	}
+	keep_warm->conn = connection;
+	keep_warm->interval_ms = interval_ms;
+	pthread_mutex_init (&keep_warm->lock, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init (&attr);
+	pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+	pthread_cond_init (&keep_warm->cond, &attr);
+	pthread_condattr_destroy (&attr);
+
+	pthread_mutex_lock (&connection->lock);
+	if (connection->keep_warm)
+	{
+		/* Another caller enabled it while we were unlocked */
+		smm_keep_warm_set_interval (connection, connection->keep_warm, interval_ms);
+		pthread_mutex_unlock (&connection->lock);
+		smm_keep_warm_free (keep_warm);
+		return true;
+	}
+	/* The thread is started under the lock, so no one can see keep_warm without it */
+	bool ok = pthread_create (&keep_warm->thread, NULL, smm_keep_warm_thread, keep_warm) == 0;
+	if (ok)
+	{
+		connection->keep_warm = keep_warm;
+		smm_keep_warm_arm_all (connection);
+	}
+	pthread_mutex_unlock (&connection->lock);
+
+	if (!ok)
+	{
+		smm_keep_warm_free (keep_warm);
+	}
+	return ok;
+}
+
+void
+smm_connection_keep_warm_stats (smm_connection connection, uint64_t *idle_timeout_ms, uint64_t *saved_reconnects)
+{
+	if (connection == NULL)
+	{
+		return;
+	}
+	pthread_mutex_lock (&connection->lock);
+	if (idle_timeout_ms)
+	{
+		*idle_timeout_ms = connection->idle_timeout_ms;
+	}
+	if (saved_reconnects)
+	{
+		*saved_reconnects = connection->saved_reconnects;
+	}
+	pthread_mutex_unlock (&connection->lock);
+}
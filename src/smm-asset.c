@@ -26,13 +26,10 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <jansson.h>
 
-enum http_return_codes {
-	HTTP_SUCCESS = 200,
-};
-
 bool smm_debug = false;
 
 void
@@ -41,6 +38,22 @@ smm_asset_debugging_set (bool debug)
 	smm_debug = debug;
 }
 
+uint64_t
+smm_clock_monotonic_ms (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t
+smm_clock_realtime_ms (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 smm_connection
 smm_asset_connect (const char *host, const char *user, const char *pass)
 {
@@ -54,6 +67,11 @@ smm_asset_connect (const char *host, const char *user, const char *pass)
 	conn->user = strdup (user);
 	conn->pass = strdup (pass);
 	pthread_mutex_init (&conn->lock, NULL);
+	pthread_mutex_init (&conn->login_lock, NULL);
+	pthread_mutex_init (&conn->session_lock, NULL);
+	pthread_mutex_init (&conn->assets_lock, NULL);
+	pthread_mutex_init (&conn->clock.lock, NULL);
+	conn->coordinate_decimals = 6;
 
 	smm_connection_login (conn);
 
@@ -67,7 +85,21 @@ smm_asset_connection_get_state (smm_connection connection)
 	{
 		return SMM_CONNECTION_UNKNOWN;
 	}
-	return connection->state;
+	return __atomic_load_n (&connection->state, __ATOMIC_ACQUIRE);
+}
+
+void
+smm_connection_set_low_bandwidth (smm_connection connection, bool enable, unsigned int coordinate_decimals)
+{
+	if (connection == NULL)
+	{
+		return;
+	}
+	pthread_mutex_lock (&connection->lock);
+	connection->low_bandwidth = enable;
+	/* Reports read it without the lock */
+	__atomic_store_n (&connection->coordinate_decimals, enable ? (coordinate_decimals > 9 ? 9 : coordinate_decimals) : 6, __ATOMIC_RELAXED);
+	pthread_mutex_unlock (&connection->lock);
 }
 
 void
@@ -75,12 +107,31 @@ smm_connection_close (smm_connection connection)
 {
 	if (connection != NULL)
 	{
+		smm_netlink_stop (connection->netlink);
+		smm_keep_warm_stop (connection->keep_warm);
+		smm_metrics_listener_stop (connection->metrics_listener);
+		smm_restore_join (connection);
+		/* Assets may still be freed after this, they must not touch the registry */
+		pthread_mutex_lock (&connection->assets_lock);
+		for (size_t i = 0; i < connection->assets_count; i++)
+		{
+			connection->assets[i]->conn = NULL;
+		}
+		connection->assets_count = 0;
+		pthread_mutex_unlock (&connection->assets_lock);
 		free (connection->host);
+		free (connection->old_host);
 		free (connection->user);
 		free (connection->pass);
 		free (connection->csrfmiddlewaretoken);
-		curl_easy_cleanup (connection->curl);
+		smm_connection_transfers_free (connection);
+		smm_links_free (connection);
+		free (connection->assets);
 		pthread_mutex_destroy(&connection->lock);
+		pthread_mutex_destroy (&connection->login_lock);
+		pthread_mutex_destroy (&connection->session_lock);
+		pthread_mutex_destroy (&connection->assets_lock);
+		pthread_mutex_destroy (&connection->clock.lock);
 	}
 	free (connection);
 }
@@ -94,6 +145,25 @@ smm_asset_create (smm_connection conn, const char *name, const char *type, long
 	asset->type = type ? strdup (type) : NULL;
 	asset->asset_id = asset_id;
 	asset->asset_type_id = asset_type_id;
+	smm_report_init (asset);
+
+	/* Remember the asset so commands can be synced for the whole fleet */
+	pthread_mutex_lock (&conn->assets_lock);
+	if (conn->assets_count == conn->assets_size)
+	{
+		size_t size = conn->assets_size ? conn->assets_size * 2 : 8;
+		smm_asset *tmp = realloc (conn->assets, size * sizeof (smm_asset));
+		if (tmp == NULL)
+		{
+			pthread_mutex_unlock (&conn->assets_lock);
+			smm_asset_free_asset (asset);
+			return NULL;
+		}
+		conn->assets = tmp;
+		conn->assets_size = size;
+	}
+	conn->assets[conn->assets_count++] = asset;
+	pthread_mutex_unlock (&conn->assets_lock);
 
 	return asset;
 }
@@ -155,21 +225,17 @@ smm_asset_get_assets (smm_connection connection, smm_assets * assets, size_t * a
 					{
 						type = json_string_value (val);
 					}
-					else
-					{
-						if (json_is_integer (val))
-						{
-							printf ("%s = %lli\n", key, json_integer_value (val));
-						}
-						else if (json_is_string (val))
-						{
-							printf ("%s = %s\n", key, json_string_value (val));
-						}
-					}
 				}
+				smm_asset asset = smm_asset_create (connection, name, type, asset_id, asset_type_id);
+				if (asset == NULL)
+				{
+					continue;
+				}
+				/* Keep the rest of the record for smm_asset_property_* */
+				asset->properties = json_incref (value);
 				*(assets_count) += 1;
 				*assets = realloc (*assets, *assets_count * sizeof (smm_asset));
-				(*assets)[(*assets_count) - 1] = smm_asset_create (connection, name, type, asset_id, asset_type_id);
+				(*assets)[(*assets_count) - 1] = asset;
 			}
 		}
 		else
@@ -190,11 +256,53 @@ smm_asset_get_assets (smm_connection connection, smm_assets * assets, size_t * a
 }
 
 
+void
+smm_asset_remember_search (smm_asset asset, smm_search search)
+{
+	if (asset->accepted_search)
+	{
+		asset->accepted_search->remembered = false;
+	}
+	asset->accepted_search = search;
+	if (search)
+	{
+		search->remembered = true;
+	}
+}
+
 void
 smm_asset_free_asset (smm_asset asset)
 {
+	smm_connection conn = asset->conn;
+	/* The connection may already be closed */
+	if (conn)
+	{
+		pthread_mutex_lock (&conn->assets_lock);
+		for (size_t i = 0; i < conn->assets_count; i++)
+		{
+			if (conn->assets[i] == asset)
+			{
+				conn->assets[i] = conn->assets[--conn->assets_count];
+				break;
+			}
+		}
+		pthread_mutex_unlock (&conn->assets_lock);
+	}
+
 	free (asset->name);
 	free (asset->type);
+	smm_track_free (asset->track);
+	smm_search_destroy (asset->search_hint);
+	smm_search_destroy (asset->restored_search);
+	/* The caller owns any accepted search, and may destroy it after this */
+	if (asset->accepted_search)
+	{
+		asset->accepted_search->asset = NULL;
+	}
+	smm_asset_remember_search (asset, NULL);
+	smm_restore_unref (asset->restore);
+	json_decref (asset->properties);
+	smm_report_free (asset);
 	free (asset);
 }
 
@@ -234,61 +342,136 @@ smm_asset_type (smm_asset asset)
 	return NULL;
 }
 
-static bool
-smm_asset_update_command (smm_asset asset, struct buffer_s *buf)
+bool
+smm_asset_property_int (smm_asset asset, const char *key, long long *value)
 {
-	json_error_t json_error;
+	json_t *tmp = asset ? json_object_get (asset->properties, key) : NULL;
+	if (!json_is_integer (tmp))
+	{
+		return false;
+	}
+	*value = json_integer_value (tmp);
+	return true;
+}
 
-	json_t *json_root = json_loadb (buf->data, buf->bytes, 0, &json_error);
-	if (json_root)
+bool
+smm_asset_property_double (smm_asset asset, const char *key, double *value)
+{
+	json_t *tmp = asset ? json_object_get (asset->properties, key) : NULL;
+	if (!json_is_number (tmp))
+	{
+		return false;
+	}
+	*value = json_number_value (tmp);
+	return true;
+}
+
+const char *
+smm_asset_property_string (smm_asset asset, const char *key)
+{
+	if (asset == NULL)
 	{
-		const char *command = NULL;
+		return NULL;
+	}
+	return json_string_value (json_object_get (asset->properties, key));
+}
+
+static smm_search smm_search_from_json (smm_asset asset, json_t *json_search);
+
+/* Apply one command object, {"action": ..., "latitude": ..., "longitude": ...} */
+static void
+smm_asset_apply_command (smm_asset asset, json_t *json_command)
+{
+	const char *command = NULL;
 
-		json_t *tmp = json_object_get (json_root, "action");
-		if (tmp)
+	json_t *tmp = json_object_get (json_command, "action");
+	if (tmp)
+	{
+		command = json_string_value (tmp);
+		if (command == NULL)
 		{
-			command = json_string_value (tmp);
-			if (strcmp (command, "GOTO") == 0)
-			{
-				/* Get lat and long as well */
-				tmp = json_object_get (json_root, "latitude");
-				if (tmp)
-				{
-					asset->last_command_lat = json_real_value (tmp);
-				}
-				tmp = json_object_get (json_root, "longitude");
-				if (tmp)
-				{
-					asset->last_command_lon = json_real_value (tmp);
-				}
-				asset->last_command = SMM_COMMAND_GOTO;
-			}
-			else if (strcmp (command, "RON") == 0)
-			{
-				asset->last_command = SMM_COMMAND_CONTINUE;
-			}
-			else if (strcmp (command, "RTL") == 0)
-			{
-				asset->last_command = SMM_COMMAND_RTL;
-			}
-			else if (strcmp (command, "CIR") == 0)
-			{
-				asset->last_command = SMM_COMMAND_CIRCLE;
-			}
-			else if (strcmp (command, "AS") == 0)
-			{
-				asset->last_command = SMM_COMMAND_ABANDON_SEARCH;
-			}
-			else if (strcmp (command, "MC") == 0)
+			asset->last_command = SMM_COMMAND_UNKNOWN;
+		}
+		else if (strcmp (command, "GOTO") == 0)
+		{
+			/* Get lat and long as well */
+			tmp = json_object_get (json_command, "latitude");
+			if (tmp)
 			{
-				asset->last_command = SMM_COMMAND_MISSION_COMPLETE;
+				asset->last_command_lat = json_real_value (tmp);
 			}
-			else
+			tmp = json_object_get (json_command, "longitude");
+			if (tmp)
 			{
-				asset->last_command = SMM_COMMAND_UNKNOWN;
+				asset->last_command_lon = json_real_value (tmp);
 			}
+			asset->last_command = SMM_COMMAND_GOTO;
+		}
+		else if (strcmp (command, "RON") == 0)
+		{
+			asset->last_command = SMM_COMMAND_CONTINUE;
 		}
+		else if (strcmp (command, "RTL") == 0)
+		{
+			asset->last_command = SMM_COMMAND_RTL;
+		}
+		else if (strcmp (command, "CIR") == 0)
+		{
+			asset->last_command = SMM_COMMAND_CIRCLE;
+		}
+		else if (strcmp (command, "AS") == 0)
+		{
+			asset->last_command = SMM_COMMAND_ABANDON_SEARCH;
+		}
+		else if (strcmp (command, "MC") == 0)
+		{
+			asset->last_command = SMM_COMMAND_MISSION_COMPLETE;
+		}
+		else
+		{
+			asset->last_command = SMM_COMMAND_UNKNOWN;
+		}
+	}
+}
+
+/* The callback always runs with assets_lock held, as it does from smm_connection_sync_commands */
+static void
+smm_asset_notify_command (smm_asset asset)
+{
+	smm_connection conn = asset->conn;
+
+	pthread_mutex_lock (&conn->assets_lock);
+	if (conn->command_callback)
+	{
+		conn->command_callback (conn->command_data, asset, asset->last_command);
+	}
+	pthread_mutex_unlock (&conn->assets_lock);
+}
+
+/* Apply the server's reply to a position report, {"action": ..., "search": {...}} */
+static void
+smm_asset_apply_report (smm_asset asset, json_t *json_report)
+{
+	smm_asset_apply_command (asset, json_report);
+
+	/* The server may also tell us about a search we could do */
+	json_t *json_search = json_object_get (json_report, "search");
+	if (json_is_object (json_search))
+	{
+		smm_search_destroy (asset->search_hint);
+		asset->search_hint = smm_search_from_json (asset, json_search);
+	}
+}
+
+static bool
+smm_asset_update_command (smm_asset asset, struct buffer_s *buf)
+{
+	json_error_t json_error;
 
+	json_t *json_root = json_loadb (buf->data, buf->bytes, 0, &json_error);
+	if (json_root)
+	{
+		smm_asset_apply_report (asset, json_root);
 		json_decref (json_root);
 	}
 	else
@@ -300,6 +483,136 @@ smm_asset_update_command (smm_asset asset, struct buffer_s *buf)
 	return true;
 }
 
+void
+smm_connection_set_command_callback (smm_connection connection, smm_asset_command_callback callback, void *data)
+{
+	if (connection == NULL)
+	{
+		return;
+	}
+	pthread_mutex_lock (&connection->assets_lock);
+	connection->command_callback = callback;
+	connection->command_data = data;
+	pthread_mutex_unlock (&connection->assets_lock);
+}
+
+bool
+smm_connection_sync_commands (smm_connection connection)
+{
+	struct buffer_s buf = { NULL, 0 };
+	json_error_t json_error;
+	char *post_data = NULL;
+	size_t post_len = 0;
+
+	if (connection == NULL)
+	{
+		return false;
+	}
+
+	/* assets=1,2,3 */
+	FILE *post = open_memstream (&post_data, &post_len);
+	if (post == NULL)
+	{
+		return false;
+	}
+	fprintf (post, "assets=");
+	pthread_mutex_lock (&connection->assets_lock);
+	size_t assets_count = connection->assets_count;
+	for (size_t i = 0; i < assets_count; i++)
+	{
+		fprintf (post, "%s%lld", i == 0 ? "" : ",", connection->assets[i]->asset_id);
+	}
+	pthread_mutex_unlock (&connection->assets_lock);
+	if (fclose (post) != 0)
+	{
+		free (post_data);
+		return false;
+	}
+	if (assets_count == 0)
+	{
+		free (post_data);
+		return true;
+	}
+
+	uint64_t start_ms = smm_clock_monotonic_ms ();
+	struct smm_curl_res_s *res = smm_connection_curl_request (connection, "/data/assets/commands/", post_data, to_buffer, &buf,
+								  SMM_REQUEST_RACE | SMM_REQUEST_CSRF);
+	free (post_data);
+	if (res == NULL)
+	{
+		free (buf.data);
+		return false;
+	}
+	if (!(res->success && res->httpcode == HTTP_SUCCESS))
+	{
+		smm_curl_res_free (res);
+		free (buf.data);
+		return false;
+	}
+	smm_curl_res_free (res);
+
+	/* {"commands": [{"asset": id, "action": ..., ...}, ...]} */
+	json_t *json_root = json_loadb (buf.data, buf.bytes, 0, &json_error);
+	free (buf.data);
+	if (json_root == NULL)
+	{
+		printf ("Error on line %i: %s\n", json_error.line, json_error.text);
+		return false;
+	}
+
+	json_t *json_commands = json_object_get (json_root, "commands");
+	size_t index = 0;
+	json_t *value = NULL;
+	json_array_foreach (json_commands, index, value)
+	{
+		json_t *json_id = json_object_get (value, "asset");
+		if (!json_is_integer (json_id))
+		{
+			continue;
+		}
+		long long asset_id = json_integer_value (json_id);
+
+		/* The callback runs with the registry locked, so it can't add or free assets */
+		pthread_mutex_lock (&connection->assets_lock);
+		for (size_t i = 0; i < connection->assets_count; i++)
+		{
+			smm_asset asset = connection->assets[i];
+			if (asset->asset_id == asset_id)
+			{
+				smm_asset_apply_command (asset, value);
+				__atomic_add_fetch (&connection->metrics.commands, 1, __ATOMIC_RELAXED);
+				smm_histogram_observe (&connection->metrics.command_latency, (smm_clock_monotonic_ms () - start_ms) * 1000);
+				if (connection->command_callback)
+				{
+					connection->command_callback (connection->command_data, asset, asset->last_command);
+				}
+			}
+		}
+		pthread_mutex_unlock (&connection->assets_lock);
+	}
+
+	json_decref (json_root);
+
+	return true;
+}
+
+bool
+smm_asset_last_report_bytes (smm_asset asset, size_t *sent, size_t *received)
+{
+	if (asset == NULL || asset->report_bytes_sent == 0)
+	{
+		return false;
+	}
+	if (sent)
+	{
+		*sent = asset->report_bytes_sent;
+	}
+	if (received)
+	{
+		*received = asset->report_bytes_received;
+	}
+	return true;
+}
 
 smm_asset_command
 smm_asset_last_command (smm_asset asset)
@@ -326,22 +639,62 @@ smm_asset_last_goto_pos (smm_asset asset, double *lat, double *lon)
 
 bool
 smm_asset_report_position (smm_asset asset, double latitude, double longitude, unsigned int altitude, uint16_t bearing, uint8_t fix)
+{
+	smm_fix report_fix = {
+		.time_ms = smm_clock_realtime_ms (),
+		.lat = latitude,
+		.lon = longitude,
+		.altitude = altitude,
+		.bearing = bearing,
+		.fix = fix,
+	};
+	return smm_asset_report_fix (asset, &report_fix);
+}
+
+bool
+smm_asset_report_fix (smm_asset asset, const smm_fix * fix)
+{
+	if (asset->track)
+	{
+		smm_track_record (asset->track, fix);
+	}
+	return smm_asset_send_fix (asset, fix, smm_report_queue (asset, fix));
+}
+
+/* Send a queued fix, seq lets the server drop it if it already has it */
+bool
+smm_asset_send_fix (smm_asset asset, const smm_fix * fix, uint64_t seq)
 {
 	struct buffer_s buf = { NULL, 0 };
 
+	/* Stamp the fix in server time so queueing and latency don't move it */
+	uint64_t time_ms = smm_connection_server_time (asset->conn, fix->time_ms);
+
+	int decimals = (int) __atomic_load_n (&asset->conn->coordinate_decimals, __ATOMIC_RELAXED);
 	char *page = NULL;
-	if (asprintf (&page, "/data/assets/%lld/position/add/?lat=%lf&lon=%lf&alt=%u&bearing=%u&fix=%u", asset->asset_id, latitude, longitude, altitude, bearing, fix)
-	    < 0)
+	if (asprintf (&page, "/data/assets/%lld/position/add/?lat=%.*f&lon=%.*f&alt=%u&bearing=%u&fix=%u&time=%llu&seq=%llu", asset->asset_id, decimals,
+		      fix->lat, decimals, fix->lon, fix->altitude, fix->bearing, fix->fix, (unsigned long long) time_ms, (unsigned long long) seq) < 0)
 	{
 		return false;
 	}
 
-	struct smm_curl_res_s *res = smm_connection_curl_retrieve_url (asset->conn, page, NULL, to_buffer, &buf);
+	/* Any search hint only holds until the next report, even if that one fails */
+	smm_search_destroy (asset->search_hint);
+	asset->search_hint = NULL;
+
+	uint64_t start_ms = smm_clock_monotonic_ms ();
+
+	/* Let any backfill know it must wait for us */
+	__atomic_add_fetch (&asset->conn->live_waiting, 1, __ATOMIC_RELAXED);
+	struct smm_curl_res_s *res = smm_connection_curl_request (asset->conn, page, NULL, to_buffer, &buf, SMM_REQUEST_COMPACT);
+	__atomic_sub_fetch (&asset->conn->live_waiting, 1, __ATOMIC_RELAXED);
 	if (res == NULL)
 	{
 		free (page);
 		return false;
 	}
+	asset->report_bytes_sent = res->bytes_sent;
+	asset->report_bytes_received = res->bytes_received;
 	if (!(res->success && res->httpcode == HTTP_SUCCESS))
 	{
 		smm_curl_res_free (res);
@@ -350,6 +703,7 @@ smm_asset_report_position (smm_asset asset, double latitude, double longitude, u
 	}
 
 	free (page);
+	smm_report_acknowledge (asset, seq);
 
 	/* if json data was returned, update the current action */
 	if (res->content_type != NULL && strcmp (res->content_type, "application/json") == 0)
@@ -367,6 +721,9 @@ smm_asset_report_position (smm_asset asset, double latitude, double longitude, u
 			asset->last_command = SMM_COMMAND_NONE;
 		}
 	}
+	__atomic_add_fetch (&asset->conn->metrics.commands, 1, __ATOMIC_RELAXED);
+	smm_histogram_observe (&asset->conn->metrics.command_latency, (smm_clock_monotonic_ms () - start_ms) * 1000);
+	smm_asset_notify_command (asset);
 
 	free (buf.data);
 
@@ -375,45 +732,262 @@ smm_asset_report_position (smm_asset asset, double latitude, double longitude, u
 	return true;
 }
 
-static smm_search
-smm_search_create (smm_asset asset, const char *url, uint64_t length, uint64_t distance, uint64_t sweep_width)
+enum smm_batch_result
 {
-	smm_search search = calloc (1, sizeof (struct smm_search_s));
-	search->asset = asset;
-	search->url = url ? strdup (url) : NULL;
-	search->length = length;
-	search->distance = distance;
-	search->sweep_width = sweep_width;
-
-	return search;
-}
+	SMM_BATCH_SENT,
+	SMM_BATCH_FAILED,
+	SMM_BATCH_UNSUPPORTED,
+};
 
-uint64_t
-smm_search_distance (smm_search search)
+/* Send one batch of fixes, all for assets on conn; reported is set for each fix the server took */
+static enum smm_batch_result
+smm_assets_report_batch (smm_connection conn, smm_assets assets, const smm_fix * fixes, const uint64_t *seqs, const size_t *batch,
+			 size_t batch_count, bool *reported)
 {
-	if (search)
+	struct buffer_s buf = { NULL, 0 };
+	json_error_t json_error;
+	char *post_data = NULL;
+	size_t post_len = 0;
+
+	/* asset,time,lat,lon,alt,bearing,fix,seq;... */
+	FILE *post = open_memstream (&post_data, &post_len);
+	if (post == NULL)
 	{
-		return search->distance;
+		return SMM_BATCH_FAILED;
 	}
-	return 0;
-}
-
-uint64_t
-smm_search_length (smm_search search)
-{
-	if (search)
+	fprintf (post, "positions=");
+	int decimals = (int) __atomic_load_n (&conn->coordinate_decimals, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < batch_count; i++)
 	{
-		return search->length;
+		smm_asset asset = assets[batch[i]];
+		const smm_fix *fix = &fixes[batch[i]];
+		uint64_t time_ms = smm_connection_server_time (conn, fix->time_ms);
+		fprintf (post, "%s%lld,%llu,%.*f,%.*f,%u,%u,%u,%llu", i == 0 ? "" : ";", asset->asset_id, (unsigned long long) time_ms, decimals,
+			 fix->lat, decimals, fix->lon, fix->altitude, fix->bearing, fix->fix, (unsigned long long) seqs[batch[i]]);
+	}
+	if (fclose (post) != 0)
+	{
+		free (post_data);
+		return SMM_BATCH_FAILED;
 	}
-	return 0;
-}
 
-uint64_t
-smm_search_sweep_width(smm_search search)
-{
-	if (search)
+	/* Any search hint only holds until the next report, even if that one fails */
+	for (size_t i = 0; i < batch_count; i++)
 	{
-		return search->sweep_width;
+		smm_asset asset = assets[batch[i]];
+		smm_search_destroy (asset->search_hint);
+		asset->search_hint = NULL;
+	}
+
+	uint64_t start_ms = smm_clock_monotonic_ms ();
+	__atomic_add_fetch (&conn->live_waiting, 1, __ATOMIC_RELAXED);
+	struct smm_curl_res_s *res = smm_connection_curl_request (conn, "/data/assets/positions/add/", post_data, to_buffer, &buf, SMM_REQUEST_CSRF);
+	__atomic_sub_fetch (&conn->live_waiting, 1, __ATOMIC_RELAXED);
+	free (post_data);
+	if (res == NULL || !(res->success && res->httpcode == HTTP_SUCCESS))
+	{
+		bool unsupported = res && (res->httpcode == HTTP_NOT_FOUND || res->httpcode == HTTP_METHOD_NOT_ALLOWED);
+		smm_curl_res_free (res);
+		free (buf.data);
+		return unsupported ? SMM_BATCH_UNSUPPORTED : SMM_BATCH_FAILED;
+	}
+	smm_curl_res_free (res);
+
+	/* {"positions": [{"asset": id, "seq": seq, "action": ..., "search": {...}}, ...]}, one entry per fix taken */
+	json_t *json_root = json_loadb (buf.data, buf.bytes, 0, &json_error);
+	free (buf.data);
+	if (json_root == NULL)
+	{
+		printf ("Error on line %i: %s\n", json_error.line, json_error.text);
+		return SMM_BATCH_FAILED;
+	}
+	json_t *json_positions = json_object_get (json_root, "positions");
+	size_t index = 0;
+	json_t *value = NULL;
+	json_array_foreach (json_positions, index, value)
+	{
+		json_t *json_seq = json_object_get (value, "seq");
+		if (!json_is_integer (json_seq))
+		{
+			continue;
+		}
+		long long asset_id = json_integer_value (json_object_get (value, "asset"));
+		uint64_t seq = (uint64_t) json_integer_value (json_seq);
+		/* An asset can have several fixes in the batch, only its seq tells them apart */
+		size_t i = 0;
+		while (i < batch_count && (reported[batch[i]] || assets[batch[i]]->asset_id != asset_id || seqs[batch[i]] != seq))
+		{
+			i++;
+		}
+		if (i == batch_count)
+		{
+			continue;
+		}
+
+		smm_asset asset = assets[batch[i]];
+		reported[batch[i]] = true;
+		smm_report_acknowledge (asset, seqs[batch[i]]);
+		smm_asset_apply_report (asset, value);
+		__atomic_add_fetch (&conn->metrics.commands, 1, __ATOMIC_RELAXED);
+		smm_histogram_observe (&conn->metrics.command_latency, (smm_clock_monotonic_ms () - start_ms) * 1000);
+		smm_asset_notify_command (asset);
+	}
+	json_decref (json_root);
+
+	return SMM_BATCH_SENT;
+}
+
+bool
+smm_assets_report_positions (smm_assets assets, const smm_fix * fixes, size_t count, bool *reported)
+{
+	bool all = true;
+
+	if (assets == NULL || fixes == NULL)
+	{
+		return false;
+	}
+
+	bool *results = reported ? reported : calloc (count, sizeof (bool));
+	size_t *batch = malloc (count * sizeof (size_t));
+	bool *done = calloc (count, sizeof (bool));
+	uint64_t *seqs = malloc (count * sizeof (uint64_t));
+	if (results == NULL || batch == NULL || done == NULL || seqs == NULL)
+	{
+		if (results != reported)
+		{
+			free (results);
+		}
+		free (batch);
+		free (done);
+		free (seqs);
+		return false;
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		results[i] = false;
+		if (assets[i]->track)
+		{
+			smm_track_record (assets[i]->track, &fixes[i]);
+		}
+		seqs[i] = smm_report_queue (assets[i], &fixes[i]);
+	}
+
+	/* One request per connection, split so no request gets too large */
+	for (size_t first = 0; first < count; first++)
+	{
+		if (done[first])
+		{
+			continue;
+		}
+		smm_connection conn = assets[first]->conn;
+		size_t batch_count = 0;
+		for (size_t i = first; i < count && batch_count < SMM_REPORT_BATCH_MAX; i++)
+		{
+			if (!done[i] && assets[i]->conn == conn)
+			{
+				batch[batch_count++] = i;
+				done[i] = true;
+			}
+		}
+		if (__atomic_load_n (&conn->batch_unsupported, __ATOMIC_RELAXED) ||
+		    smm_assets_report_batch (conn, assets, fixes, seqs, batch, batch_count, results) == SMM_BATCH_UNSUPPORTED)
+		{
+			/* The server doesn't take batches, report them one at a time */
+			DEBUG ("Reporting %zu positions one at a time\n", batch_count);
+			__atomic_store_n (&conn->batch_unsupported, true, __ATOMIC_RELAXED);
+			for (size_t i = 0; i < batch_count; i++)
+			{
+				results[batch[i]] = smm_asset_send_fix (assets[batch[i]], &fixes[batch[i]], seqs[batch[i]]);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		all = all && results[i];
+	}
+	if (results != reported)
+	{
+		free (results);
+	}
+	free (batch);
+	free (done);
+	free (seqs);
+
+	return all;
+}
+
+smm_search
+smm_search_create (smm_asset asset, const char *url, uint64_t length, uint64_t distance, uint64_t sweep_width)
+{
+	smm_search search = calloc (1, sizeof (struct smm_search_s));
+	search->asset = asset;
+	search->url = url ? strdup (url) : NULL;
+	search->length = length;
+	search->distance = distance;
+	search->sweep_width = sweep_width;
+	pthread_mutex_init (&search->readers_lock, NULL);
+
+	return search;
+}
+
+/* {"object_url": ..., "distance": ..., "length": ..., "sweep_width": ...} */
+static smm_search
+smm_search_from_json (smm_asset asset, json_t *json_search)
+{
+	const char *url = NULL;
+	uint64_t distance = 0;
+	uint64_t length = 0;
+	uint64_t sweep_width = 0;
+	json_t *tmp = json_object_get (json_search, "object_url");
+	if (tmp)
+	{
+		url = json_string_value (tmp);
+	}
+	tmp = json_object_get (json_search, "distance");
+	if (tmp)
+	{
+		distance = json_integer_value (tmp);
+	}
+	tmp = json_object_get (json_search, "length");
+	if (tmp)
+	{
+		length = json_integer_value (tmp);
+	}
+	tmp = json_object_get (json_search, "sweep_width");
+	if (tmp)
+	{
+		sweep_width = json_integer_value (tmp);
+	}
+	return smm_search_create (asset, url, length, distance, sweep_width);
+}
+
+uint64_t
+smm_search_distance (smm_search search)
+{
+	if (search)
+	{
+		return search->distance;
+	}
+	return 0;
+}
+
+uint64_t
+smm_search_length (smm_search search)
+{
+	if (search)
+	{
+		return search->length;
+	}
+	return 0;
+}
+
+uint64_t
+smm_search_sweep_width(smm_search search)
+{
+	if (search)
+	{
+		return search->sweep_width;
 	}
 	return 0;
 }
@@ -423,7 +997,18 @@ smm_search_destroy (smm_search search)
 {
 	if (search)
 	{
+		/* Only follow search->asset while the asset still links back here,
+		 * the caller may have freed the asset already */
+		if (search->remembered)
+		{
+			smm_asset_remember_search (search->asset, NULL);
+		}
 		free (search->url);
+		smm_buffer_unref (search->geojson);
+		free (search->waypoints);
+		smm_search_features_free (search);
+		smm_search_geometry_free (search);
+		pthread_mutex_destroy (&search->readers_lock);
 		free (search);
 	}
 }
@@ -444,92 +1029,382 @@ smm_waypoint_free (smm_waypoint waypoint)
 }
 
 
-bool
-smm_search_get_waypoints (smm_search search, smm_waypoints * waypoints, size_t * waypoints_count)
+/* Download the search's geometry body, without touching the search */
+static smm_buffer
+smm_search_download (smm_search search)
 {
 	struct buffer_s buf = { NULL, 0 };
-	json_t *json_root = NULL;
-	json_error_t json_error;
 
 	struct smm_curl_res_s *res = smm_connection_curl_retrieve_url (search->asset->conn, search->url, NULL, to_buffer, &buf);
 
 	if (res == NULL)
 	{
-		return false;
+		free (buf.data);
+		return NULL;
 	}
 	else if (!(res->success && res->httpcode == HTTP_SUCCESS))
 	{
 		/* Login, try again */
 		smm_curl_res_free (res);
-		return false;
+		free (buf.data);
+		return NULL;
 	}
 
 	smm_curl_res_free (res);
 
+	smm_buffer geojson = smm_buffer_take (&buf);
+	if (geojson == NULL)
+	{
+		free (buf.data);
+	}
+	return geojson;
+}
+
+bool
+smm_search_fetch (smm_search search)
+{
+	if (search == NULL)
+	{
+		return false;
+	}
+
+	/* Keep the body as it arrived, parsing waits until waypoints are wanted */
+	smm_buffer geojson = smm_search_download (search);
+	if (geojson == NULL)
+	{
+		return false;
+	}
+	smm_buffer_unref (search->geojson);
+	search->geojson = geojson;
+	search->parsed = false;
+	smm_search_index_features (search);
+
+	return true;
+}
+
+smm_buffer
+smm_search_get_geojson (smm_search search)
+{
+	if (search == NULL)
+	{
+		return NULL;
+	}
+	if (search->geojson == NULL)
+	{
+		/* The body was dropped by smm_search_update, the waypoints it patched stay as they are */
+		search->geojson = smm_search_download (search);
+		if (search->geojson == NULL)
+		{
+			return NULL;
+		}
+		smm_search_index_features (search);
+	}
+	return smm_buffer_ref (search->geojson);
+}
+
+/* Parse the geometry into search->waypoints, if it hasn't been already */
+static bool
+smm_search_parse (smm_search search)
+{
+	struct smm_waypoint_s *waypoints = NULL;
+	size_t waypoints_count = 0;
+	uint64_t version = 0;
+
+	if (search->parsed)
+	{
+		return true;
+	}
+
+	smm_buffer geojson = smm_search_get_geojson (search);
+	if (geojson == NULL)
+	{
+		return false;
+	}
+
+	/* Every line in the search, in order, makes up the path to fly */
+	bool ok = smm_search_features_path (search, &waypoints, &waypoints_count, &version);
+	smm_buffer_unref (geojson);
+	if (!ok)
+	{
+		return false;
+	}
+
+	free (search->waypoints);
+	search->waypoints = waypoints;
+	search->waypoints_count = waypoints_count;
+	search->version = version;
+	search->parsed = true;
+	smm_search_publish (search);
+
+	return true;
+}
+
+bool
+smm_search_get_waypoint_array (smm_search search, struct smm_waypoint_s **waypoints, size_t * waypoints_count)
+{
+	if (search == NULL || !smm_search_parse (search))
+	{
+		return false;
+	}
 
-	/* Parse the assets */
 	*waypoints_count = 0;
 	*waypoints = NULL;
 
-	json_root = json_loadb (buf.data, buf.bytes, 0, &json_error);
-	if (json_root)
+	if (search->waypoints_count > 0)
 	{
-		json_t *json_features = json_object_get (json_root, "features");
-		if (json_features)
+		*waypoints = malloc (search->waypoints_count * sizeof (struct smm_waypoint_s));
+		if (*waypoints != NULL)
 		{
-			if (json_array_size (json_features) == 1)
-			{
+			memcpy (*waypoints, search->waypoints, search->waypoints_count * sizeof (struct smm_waypoint_s));
+			*waypoints_count = search->waypoints_count;
+		}
+	}
 
-				printf ("Parsing waypoints\n");
-				size_t index = 0;
-				json_t *value = NULL;
+	return true;
+}
 
-				json_t *json_search = json_array_get (json_features, 0);
-				if (json_search == NULL)
-				{
-					printf ("No json_search :(\n");
-				}
-				json_t *json_geometry = json_object_get (json_search, "geometry");
-				if (json_geometry == NULL)
-				{
-					printf ("No json_geometry \n");
-				}
-				json_t *json_coords = json_object_get (json_geometry, "coordinates");
-				if (json_coords == NULL)
-				{
-					printf ("No json_coords\n");
-				}
-				json_array_foreach (json_coords, index, value)
-				{
-					double lat = 0.0;
-					double lon = 0.0;
-					json_t *json_lat = json_array_get (value, 1);
-					json_t *json_lon = json_array_get (value, 0);
-					lat = json_real_value (json_lat);
-					lon = json_real_value (json_lon);
-					*(waypoints_count) += 1;
-					*waypoints = realloc (*waypoints, *waypoints_count * sizeof (smm_waypoint));
-					(*waypoints)[(*waypoints_count) - 1] = smm_waypoint_create (lat, lon);
-				}
-			}
-			else
+static void
+smm_search_notify_change (smm_search search, size_t start, size_t removed, size_t inserted, size_t old_count)
+{
+	if (search->change_callback == NULL)
+	{
+		return;
+	}
+
+	/* The legs into and out of the replaced waypoints change too */
+	size_t first_leg = start > 0 ? start - 1 : 0;
+	size_t old_end = start + removed < old_count ? start + removed : (old_count > 0 ? old_count - 1 : 0);
+	size_t new_end = start + inserted < search->waypoints_count ? start + inserted : (search->waypoints_count > 0 ? search->waypoints_count - 1 : 0);
+	size_t old_legs = old_end > first_leg ? old_end - first_leg : 0;
+	size_t new_legs = new_end > first_leg ? new_end - first_leg : 0;
+
+	search->change_callback (search->change_data, search, first_leg, old_legs, new_legs);
+}
+
+/* Download and parse the whole geometry again */
+static bool
+smm_search_reload (smm_search search)
+{
+	size_t old_count = search->waypoints_count;
+
+	if (!smm_search_fetch (search) || !smm_search_parse (search))
+	{
+		return false;
+	}
+	smm_search_notify_change (search, 0, old_count, search->waypoints_count, old_count);
+	return true;
+}
+
+/* Replace removed waypoints at start with the coordinates given, search->waypoints must have room for them */
+static void
+smm_search_patch (smm_search search, size_t start, size_t removed, json_t *json_coords)
+{
+	size_t old_count = search->waypoints_count;
+	size_t inserted = json_array_size (json_coords);
+
+	memmove (&search->waypoints[start + inserted], &search->waypoints[start + removed],
+		 (old_count - start - removed) * sizeof (struct smm_waypoint_s));
+
+	size_t index = 0;
+	json_t *value = NULL;
+	json_array_foreach (json_coords, index, value)
+	{
+		search->waypoints[start + index].lat = json_number_value (json_array_get (value, 1));
+		search->waypoints[start + index].lon = json_number_value (json_array_get (value, 0));
+	}
+	search->waypoints_count = old_count - removed + inserted;
+
+	smm_search_notify_change (search, start, removed, inserted, old_count);
+}
+
+/*
+ * Check that every change applies to the waypoints in turn, and find the
+ * most waypoints there will be along the way
+ */
+static bool
+smm_search_check_changes (smm_search search, json_t *json_changes, size_t *most)
+{
+	size_t count = search->waypoints_count;
+	size_t index = 0;
+	json_t *value = NULL;
+
+	*most = count;
+	json_array_foreach (json_changes, index, value)
+	{
+		json_t *json_start = json_object_get (value, "start");
+		json_t *json_remove = json_object_get (value, "remove");
+		if (!json_is_integer (json_start) || !json_is_integer (json_remove) || json_integer_value (json_start) < 0
+		    || json_integer_value (json_remove) < 0)
+		{
+			return false;
+		}
+		uint64_t start = json_integer_value (json_start);
+		uint64_t removed = json_integer_value (json_remove);
+		if (start > count || removed > count - start)
+		{
+			return false;
+		}
+		count = count - removed + json_array_size (json_object_get (value, "coordinates"));
+		if (count > *most)
+		{
+			*most = count;
+		}
+	}
+	return true;
+}
+
+/* The delta endpoint sits beside the search's json */
+char *
+smm_search_delta_path (const char *url, uint64_t version)
+{
+	char *page = NULL;
+	char *tmp = url ? strdup (url) : NULL;
+	char *json_str = tmp ? strstr (tmp, "/json/") : NULL;
+	if (json_str)
+	{
+		*json_str = '\0';
+		if (asprintf (&page, "%s/delta/?since=%llu", tmp, (unsigned long long) version) < 0)
+		{
+			page = NULL;
+		}
+	}
+	free (tmp);
+	return page;
+}
+
+bool
+smm_search_update (smm_search search)
+{
+	struct buffer_s buf = { NULL, 0 };
+	json_error_t json_error;
+	char *page = NULL;
+
+	if (search == NULL)
+	{
+		return false;
+	}
+	if (!search->parsed)
+	{
+		return smm_search_parse (search);
+	}
+
+	page = smm_search_delta_path (search->url, search->version);
+	if (page == NULL)
+	{
+		return smm_search_reload (search);
+	}
+
+	/* {"version": v, "changes": [{"start": i, "remove": n, "coordinates": [[lon, lat], ...]}, ...]} */
+	struct smm_curl_res_s *res = smm_connection_curl_retrieve_url (search->asset->conn, page, NULL, to_buffer, &buf);
+	free (page);
+	if (res == NULL || !(res->success && res->httpcode == HTTP_SUCCESS))
+	{
+		/* The server can't give us the changes, get everything */
+		smm_curl_res_free (res);
+		free (buf.data);
+		return smm_search_reload (search);
+	}
+	smm_curl_res_free (res);
+
+	json_t *json_root = json_loadb (buf.data, buf.bytes, 0, &json_error);
+	free (buf.data);
+	json_t *json_version = json_object_get (json_root, "version");
+	json_t *json_changes = json_object_get (json_root, "changes");
+	if (!json_is_integer (json_version) || json_changes == NULL)
+	{
+		json_decref (json_root);
+		return smm_search_reload (search);
+	}
+
+	uint64_t version = json_integer_value (json_version);
+	if (version != search->version)
+	{
+		/* Every change is checked before any is applied, so the waypoints are never left half patched */
+		size_t most = 0;
+		if (!smm_search_check_changes (search, json_changes, &most))
+		{
+			/* Our copy no longer matches the server's, start again */
+			json_decref (json_root);
+			return smm_search_reload (search);
+		}
+		if (most > search->waypoints_count)
+		{
+			struct smm_waypoint_s *tmp = realloc (search->waypoints, most * sizeof (struct smm_waypoint_s));
+			if (tmp == NULL)
 			{
-				printf ("array size != 1 (%zi)", json_array_size (json_features));
+				json_decref (json_root);
+				return false;
 			}
+			search->waypoints = tmp;
 		}
-		else
+		size_t index = 0;
+		json_t *value = NULL;
+		json_array_foreach (json_changes, index, value)
 		{
-			printf ("Didn't find waypoints\n");
+			smm_search_patch (search, json_integer_value (json_object_get (value, "start")),
+					  json_integer_value (json_object_get (value, "remove")), json_object_get (value, "coordinates"));
 		}
+		search->version = version;
+		smm_search_publish (search);
+
+		/* The body we kept is now out of date, and so is everything found in it */
+		smm_buffer_unref (search->geojson);
+		search->geojson = NULL;
+		smm_search_features_free (search);
 	}
-	else
+	json_decref (json_root);
+
+	return true;
+}
+
+uint64_t
+smm_search_version (smm_search search)
+{
+	if (search == NULL)
 	{
-		printf ("Error on line %i: %s\n", json_error.line, json_error.text);
+		return 0;
 	}
+	return search->version;
+}
 
-	json_decref (json_root);
+void
+smm_search_set_change_callback (smm_search search, smm_search_change_callback callback, void *data)
+{
+	if (search)
+	{
+		search->change_callback = callback;
+		search->change_data = data;
+	}
+}
 
-	free (buf.data);
+bool
+smm_search_get_waypoints (smm_search search, smm_waypoints * waypoints, size_t * waypoints_count)
+{
+	struct smm_waypoint_s *array = NULL;
+	size_t count = 0;
+
+	if (!smm_search_get_waypoint_array (search, &array, &count))
+	{
+		return false;
+	}
+
+	*waypoints_count = 0;
+	*waypoints = NULL;
+
+	if (count > 0)
+	{
+		*waypoints = calloc (count, sizeof (smm_waypoint));
+		if (*waypoints != NULL)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				(*waypoints)[i] = smm_waypoint_create (array[i].lat, array[i].lon);
+			}
+			*waypoints_count = count;
+		}
+	}
+
+	smm_waypoint_array_free (array);
 
 	return true;
 }
@@ -559,7 +1434,8 @@ smm_search_action (smm_search search, const char *action)
 		return false;
 	}
 
-	struct smm_curl_res_s *res = smm_connection_curl_retrieve_url (search->asset->conn, action_page, NULL, to_buffer, &buf);
+	/* Accepting and completing searches are worth sending over every link */
+	struct smm_curl_res_s *res = smm_connection_curl_request (search->asset->conn, action_page, NULL, to_buffer, &buf, SMM_REQUEST_RACE);
 	if (res == NULL)
 	{
 		return false;
@@ -582,13 +1458,35 @@ smm_search_action (smm_search search, const char *action)
 bool
 smm_search_accept (smm_search search)
 {
-	return smm_search_action (search, "begin");
+	if (!smm_search_action (search, "begin"))
+	{
+		return false;
+	}
+	/* Remember it, so it can be saved with smm_connection_save_state */
+	search->accepted = true;
+	smm_asset_remember_search (search->asset, search);
+	return true;
 }
 
 bool
 smm_search_complete (smm_search search)
 {
-	return smm_search_action (search, "finished");
+	if (!smm_search_action (search, "finished"))
+	{
+		return false;
+	}
+	search->accepted = false;
+	if (search->remembered)
+	{
+		smm_asset_remember_search (search->asset, NULL);
+	}
+	return true;
+}
+
+bool
+smm_search_accepted (smm_search search)
+{
+	return search != NULL && search->accepted;
 }
 
 void
@@ -601,12 +1499,34 @@ smm_waypoints_free (smm_waypoints waypoints, size_t waypoints_count)
 	free (waypoints);
 }
 
+void
+smm_waypoint_array_free (struct smm_waypoint_s *waypoints)
+{
+	free (waypoints);
+}
+
 smm_search
 smm_asset_get_search (smm_asset asset, double latitude, double longitude)
 {
 	smm_search search = NULL;
 	struct buffer_s buf = { NULL, 0 };
 
+	/* Carry on with the search we had accepted before a restart */
+	if (asset->restored_search)
+	{
+		search = asset->restored_search;
+		asset->restored_search = NULL;
+		return search;
+	}
+
+	/* Use the search the last position report told us about */
+	if (asset->search_hint)
+	{
+		search = asset->search_hint;
+		asset->search_hint = NULL;
+		return search;
+	}
+
 	char *page = NULL;
 	if (asprintf (&page, "/search/find/closest/?asset_id=%lli&latitude=%lf&longitude=%lf", asset->asset_id, latitude, longitude) < 0)
 	{
@@ -636,31 +1556,7 @@ smm_asset_get_search (smm_asset asset, double latitude, double longitude)
 		json_root = json_loadb (buf.data, buf.bytes, 0, &json_error);
 		if (json_root)
 		{
-			const char *url = NULL;
-			uint64_t distance = 0;
-			uint64_t length = 0;
-			uint64_t sweep_width = 0;
-			json_t *tmp = json_object_get (json_root, "object_url");
-			if (tmp)
-			{
-				url = json_string_value (tmp);
-			}
-			tmp = json_object_get (json_root, "distance");
-			if (tmp)
-			{
-				distance = json_integer_value (tmp);
-			}
-			tmp = json_object_get (json_root, "length");
-			if (tmp)
-			{
-				length = json_integer_value (tmp);
-			}
-			tmp = json_object_get (json_root, "sweep_width");
-			if (tmp)
-			{
-				sweep_width = json_integer_value (tmp);
-			}
-			search = smm_search_create (asset, url, length, distance, sweep_width);
+			search = smm_search_from_json (asset, json_root);
 			json_decref (json_root);
 		}
 	}
@@ -46,6 +46,11 @@ typedef struct smm_asset_s **smm_assets;
  */
 typedef struct smm_search_s *smm_search;
 
+/**
+ * An opaque, reference counted, immutable block of data
+ */
+typedef struct smm_buffer_s *smm_buffer;
+
 /**
  * A waypoint
  */
@@ -60,6 +65,105 @@ typedef struct smm_waypoint_s
  */
 typedef struct smm_waypoint_s **smm_waypoints;
 
+/**
+ * A position fix
+ */
+typedef struct smm_fix_s
+{
+	uint64_t time_ms;	/*!< When the fix was taken, in milliseconds since the unix epoch */
+	double lat;	/*!< Latitude in degrees */
+	double lon;	/*!< Longitude in degrees */
+	unsigned int altitude;	/*!< Altitude in meters */
+	uint16_t bearing;	/*!< Course over ground in degrees true */
+	float speed;	/*!< Speed over ground in meters per second */
+	uint8_t fix;	/*!< The accuracy of the fix (0=unknown, 2=2d only, 3=3d fix) */
+} smm_fix;
+
+/**
+ * An opaque object that reads positions from a GPS and reports them for an asset
+ */
+typedef struct smm_gps_source_s *smm_gps_source;
+
+/**
+ * An opaque object that uploads a portion of an asset's recorded track
+ */
+typedef struct smm_backfill_s *smm_backfill;
+
+/**
+ * The latest known position of another asset
+ */
+typedef struct smm_peer_s
+{
+	long long asset_id;	/*!< The id of the asset on the server */
+	uint64_t time_ms;	/*!< When the position was reported, in milliseconds since the unix epoch */
+	double lat;	/*!< Latitude in degrees */
+	double lon;	/*!< Longitude in degrees */
+	unsigned int altitude;	/*!< Altitude in meters */
+	uint16_t bearing;	/*!< Course over ground in degrees true */
+	uint8_t fix;	/*!< The accuracy of the fix (0=unknown, 2=2d only, 3=3d fix) */
+	float velocity_east;	/*!< Eastward velocity in meters per second, estimated from the last two positions */
+	float velocity_north;	/*!< Northward velocity in meters per second, estimated from the last two positions */
+} smm_peer;
+
+/**
+ * An opaque object that keeps the positions of other assets up to date
+ */
+typedef struct smm_peer_feed_s *smm_peer_feed;
+
+/**
+ * Called for each peer that changed during @ref smm_peer_feed_sync
+ *
+ * @param data the data passed to @ref smm_peer_feed_set_callback
+ * @param peer the new state of the peer
+ * @param removed true if the peer is no longer part of the feed
+ */
+typedef void (*smm_peer_feed_callback) (void *data, const smm_peer * peer, bool removed);
+
+/**
+ * Another asset found near a position by @ref smm_proximity_query
+ */
+typedef struct smm_proximity_hit_s
+{
+	long long asset_id;	/*!< The id of the other asset */
+	double distance;	/*!< Horizontal distance to the other asset in meters */
+	double vertical;	/*!< Height of the other asset above this one in meters */
+	double closure_rate;	/*!< Rate the horizontal distance is shrinking in meters per second, negative when separating */
+} smm_proximity_hit;
+
+/**
+ * An opaque spatial index of the positions of other assets
+ */
+typedef struct smm_proximity_s *smm_proximity;
+
+/**
+ * An immutable snapshot of a search's waypoints, see @ref smm_search_geometry
+ */
+typedef struct smm_geometry_s
+{
+	uint64_t version;	/*!< The geometry version the snapshot is of */
+	size_t waypoints_count;	/*!< How many waypoints there are */
+	const struct smm_waypoint_s *waypoints;	/*!< The waypoints */
+} smm_geometry;
+
+/**
+ * A thread that reads search geometry snapshots, see @ref smm_search_reader_register
+ */
+typedef struct smm_geometry_reader_s *smm_geometry_reader;
+
+/**
+ * Called when @ref smm_search_update changes part of a search's geometry
+ * Leg n runs from waypoint n to waypoint n + 1. The old_legs legs starting at
+ * first_leg have been replaced by new_legs legs, legs after them are unchanged
+ * but have moved by new_legs - old_legs.
+ *
+ * @param data the data passed to @ref smm_search_set_change_callback
+ * @param search the search that changed
+ * @param first_leg the first leg that changed
+ * @param old_legs how many legs were replaced
+ * @param new_legs how many legs replaced them
+ */
+typedef void (*smm_search_change_callback) (void *data, smm_search search, size_t first_leg, size_t old_legs, size_t new_legs);
+
 /**
  * Possible current states for an smm_connection object
  */
@@ -73,6 +177,39 @@ typedef enum
 	SMM_CONNECTION_FAILURE,	/*!< Unable to communicate, for another reason */
 } smm_connection_status;
 
+/**
+ * The kind of geometry in a feature of a search, see @ref smm_search_feature_type
+ */
+typedef enum
+{
+	SMM_FEATURE_UNKNOWN,	/*!< Not a geometry the library understands */
+	SMM_FEATURE_LINE,	/*!< A LineString or MultiLineString to follow */
+	SMM_FEATURE_AREA,	/*!< A Polygon or MultiPolygon to cover */
+} smm_feature_type;
+
+/**
+ * How the points of a search's features are stored, see @ref smm_search_set_precision
+ */
+typedef enum
+{
+	SMM_PRECISION_DOUBLE,	/*!< Two doubles, 16 bytes a point */
+	SMM_PRECISION_FLOAT,	/*!< Two floats relative to the feature's first point, 8 bytes a point, about 1 cm within a degree of it */
+	SMM_PRECISION_FIXED,	/*!< Two int32 in 1e-7 degrees, 8 bytes a point, about 1 cm */
+} smm_precision;
+
+/**
+ * How a restored asset compares with the server, see @ref smm_connection_restore_state
+ */
+typedef enum
+{
+	SMM_RESTORE_NONE,	/*!< The asset wasn't restored from a file */
+	SMM_RESTORE_PENDING,	/*!< The asset hasn't been checked against the server yet */
+	SMM_RESTORE_VALID,	/*!< The asset and its search are unchanged on the server */
+	SMM_RESTORE_STALE,	/*!< The search geometry has changed, call @ref smm_search_update */
+	SMM_RESTORE_INVALID,	/*!< The asset is no longer available to this user */
+	SMM_RESTORE_UNVERIFIED,	/*!< The server couldn't be reached to check */
+} smm_restore_status;
+
 /**
  * Possible commands for an asset
  */
@@ -88,6 +225,18 @@ typedef enum
 	SMM_COMMAND_UNKNOWN,	/*!< The command from the server is not known */
 } smm_asset_command;
 
+/**
+ * Called whenever the server tells us the command for an asset, either in
+ * response to a position report or from @ref smm_connection_sync_commands
+ * The connection's list of assets is locked during the call, so the callback
+ * must not get or free assets, or sync commands
+ *
+ * @param data the data passed to @ref smm_connection_set_command_callback
+ * @param asset the asset the command is for
+ * @param command the command that now applies to the asset
+ */
+typedef void (*smm_asset_command_callback) (void *data, smm_asset asset, smm_asset_command command);
+
 /**
  * Enable/disable the debugging
  *
@@ -116,14 +265,110 @@ smm_connection smm_asset_connect (const char *host, const char *user, const char
  */
 smm_connection_status smm_asset_connection_get_state (smm_connection connection);
 
+/**
+ * Use as few bytes as possible for position reports, for links such as Iridium
+ * Reports are sent without an Accept header and with only the session cookie,
+ * and coordinates are rounded to the given number of decimal places
+ * (5 is about 1m, 4 about 10m)
+ *
+ * @param connection the smm_connection object
+ * @param enable true to use the low bandwidth profile, false to go back to normal reports
+ * @param coordinate_decimals how many decimal places of latitude and longitude to send, at most 9
+ */
+void smm_connection_set_low_bandwidth (smm_connection connection, bool enable, unsigned int coordinate_decimals);
+
 
 /**
  * Close a connection to smm and free associated resources
+ * Assets from the connection can still be freed afterwards, but nothing else
  *
  * @param connection the smm_connection object to close and free
  */
 void smm_connection_close (smm_connection connection);
 
+/**
+ * Watch for network address and route changes, such as moving from Wi-Fi to cellular
+ * On a change any request still using the old path is aborted, GET requests are retried,
+ * and a new connection is opened on the new path. Only available on Linux.
+ *
+ * @param connection the smm_connection object
+ * @param enable true to start watching, false to stop
+ *
+ * @return true if the watcher is now in the requested state
+ */
+bool smm_connection_watch_network (smm_connection connection, bool enable);
+
+/**
+ * Add a network link requests can be sent over, such as a cellular or satellite modem
+ * Once more than one link is added, commands, search accepts and completions are
+ * sent over every link at once and the first answer is used. Other requests,
+ * including position reports, use the link with the lowest smoothed round trip time.
+ *
+ * @param connection the smm_connection object
+ * @param interface an interface name, IP address or host name as accepted by CURLOPT_INTERFACE
+ * (i.e. "wwan0", "if!eth1" or "host!192.168.1.10")
+ *
+ * @return the index of the new link, or -1 on failure
+ */
+int smm_connection_add_link (smm_connection connection, const char *interface);
+
+/**
+ * Get the smoothed round trip time of a link
+ *
+ * @param connection the smm_connection object
+ * @param link the index returned by @ref smm_connection_add_link
+ * @param srtt_ms where to store the smoothed round trip time in milliseconds
+ *
+ * @return true if the link has been used and srtt_ms was set
+ */
+bool smm_connection_link_srtt (smm_connection connection, int link, double *srtt_ms);
+
+/**
+ * Keep the connection to the server open while no requests are being made
+ * TCP keepalives are enabled, and a small request is made whenever the connection
+ * has been idle for interval_ms, or for a little less than the idle timeout
+ * learnt from connections that were dropped by NAT or the cellular network.
+ *
+ * @param connection the smm_connection object
+ * @param interval_ms the longest the connection is left idle, 0 to stop keeping it warm
+ *
+ * @return true if the connection is now in the requested state
+ */
+bool smm_connection_keep_warm (smm_connection connection, unsigned int interval_ms);
+
+/**
+ * Get what keeping the connection warm has learnt and saved
+ *
+ * @param connection the smm_connection object
+ * @param idle_timeout_ms where to store the learnt idle timeout of the network in milliseconds, 0 if unknown, may be NULL
+ * @param saved_reconnects where to store how many requests found a connection open that would otherwise have timed out, may be NULL
+ */
+void smm_connection_keep_warm_stats (smm_connection connection, uint64_t *idle_timeout_ms, uint64_t *saved_reconnects);
+
+/**
+ * Render the connection's counters and latency histograms in the OpenMetrics text format
+ * Nothing is allocated and no locks are taken, so this can be called at any time
+ *
+ * @param connection the smm_connection object
+ * @param buf where to write the metrics, always NUL terminated when size is not 0
+ * @param size the size of buf
+ *
+ * @return the length of the full output like snprintf, if this is size or more the output was truncated
+ */
+size_t smm_connection_metrics_render (smm_connection connection, char *buf, size_t size);
+
+/**
+ * Serve the connection's metrics over HTTP for a Prometheus scraper
+ * Every request on the port, whatever its path, is answered with the metrics
+ *
+ * @param connection the smm_connection object
+ * @param address the IPv4 address to listen on (i.e. "127.0.0.1")
+ * @param port the TCP port to listen on
+ *
+ * @return true if the listener was started
+ */
+bool smm_connection_metrics_listen (smm_connection connection, const char *address, uint16_t port);
+
 /**
  * Get all the assets that this user account has access to
  *
@@ -161,6 +406,39 @@ const char *smm_asset_name (smm_asset asset);
  */
 const char *smm_asset_type (smm_asset asset);
 
+/**
+ * Get an integer field from the record the server sent for the asset
+ *
+ * @param asset the Asset
+ * @param key the name of the field
+ * @param value Where to store the value
+ *
+ * @return true if the field exists and is an integer
+ */
+bool smm_asset_property_int (smm_asset asset, const char *key, long long *value);
+
+/**
+ * Get a numeric field from the record the server sent for the asset
+ *
+ * @param asset the Asset
+ * @param key the name of the field
+ * @param value Where to store the value
+ *
+ * @return true if the field exists and is a number
+ */
+bool smm_asset_property_double (smm_asset asset, const char *key, double *value);
+
+/**
+ * Get a string field from the record the server sent for the asset
+ * Assets restored with @ref smm_connection_restore_state have no record
+ *
+ * @param asset the Asset
+ * @param key the name of the field
+ *
+ * @return The value, valid until the asset is freed, or NULL if the field isn't a string
+ */
+const char *smm_asset_property_string (smm_asset asset, const char *key);
+
 /**
  * Report the current position of the asset to the server
  *
@@ -175,6 +453,78 @@ const char *smm_asset_type (smm_asset asset);
  */
 bool smm_asset_report_position (smm_asset asset, double latitude, double longitude, unsigned int altitude, uint16_t bearing, uint8_t fix);
 
+/**
+ * Report a position fix taken at a known time
+ * The fix time is converted to server time using @ref smm_connection_clock_offset,
+ * so the server places the fix when it was taken rather than when it arrived
+ *
+ * @param asset the Asset
+ * @param fix the fix, time_ms is by the local realtime clock
+ *
+ * @return true if the position was reported to the server
+ */
+bool smm_asset_report_fix (smm_asset asset, const smm_fix * fix);
+
+/**
+ * Report fixes for many assets at once
+ * The fixes are sent in as few requests as possible, and the command for each
+ * asset is updated from the server's reply as @ref smm_asset_report_fix would.
+ * If the server can't take a batch the fixes are reported one at a time.
+ *
+ * @param assets the Assets, the same asset may appear more than once
+ * @param fixes the fix to report for each asset, time_ms is by the local realtime clock
+ * @param count how many assets and fixes there are
+ * @param reported Where to store whether each fix was reported, or NULL
+ *
+ * @return true if every fix was reported to the server
+ */
+bool smm_assets_report_positions (smm_assets assets, const smm_fix * fixes, size_t count, bool *reported);
+
+/**
+ * How many bytes the last position report used on the wire, including HTTP headers
+ *
+ * @param asset the Asset
+ * @param sent where to store the bytes sent, may be NULL
+ * @param received where to store the bytes received, may be NULL
+ *
+ * @return true if the asset has made a report
+ */
+bool smm_asset_last_report_bytes (smm_asset asset, size_t *sent, size_t *received);
+
+/**
+ * Send the position reports the server hasn't confirmed, oldest first
+ * Each report carries a sequence number, so the server stores each fix once
+ * however often it is sent. Reports the server already has are skipped.
+ *
+ * @param asset the Asset
+ *
+ * @return true if every queued report has now been sent
+ */
+bool smm_asset_replay_reports (smm_asset asset);
+
+/**
+ * How many position reports are waiting for the server to confirm them
+ *
+ * @param asset the Asset
+ * @param acked where to store the highest sequence number the server confirmed, may be NULL
+ * @param dropped where to store how many reports were discarded because too many were queued, may be NULL
+ *
+ * @return the number of reports waiting
+ */
+size_t smm_asset_pending_reports (smm_asset asset, uint64_t *acked, size_t *dropped);
+
+/**
+ * Get the estimated offset between the server clock and ours
+ * The estimate is refined from the Date header of every response
+ *
+ * @param connection the smm_connection object
+ * @param offset_ms where to store the server time minus local time in milliseconds, may be NULL
+ * @param uncertainty_ms where to store how far the true offset may be from offset_ms, may be NULL
+ *
+ * @return true if an estimate is available
+ */
+bool smm_connection_clock_offset (smm_connection connection, int64_t *offset_ms, uint64_t *uncertainty_ms);
+
 /**
  * Get the last command we saw from the server
  * the command is set in response to a position report,
@@ -197,6 +547,26 @@ smm_asset_command smm_asset_last_command (smm_asset asset);
  */
 bool smm_asset_last_goto_pos (smm_asset asset, double *lat, double *lon);
 
+/**
+ * Set a function to call when the command for any asset on the connection is updated
+ *
+ * @param connection the smm_connection object
+ * @param callback the function to call, or NULL to stop notifications
+ * @param data passed to callback unchanged
+ */
+void smm_connection_set_command_callback (smm_connection connection, smm_asset_command_callback callback, void *data);
+
+/**
+ * Fetch the pending commands for every asset on the connection in a single request
+ * The command for each asset listed by the server is updated as if it had reported
+ * its position, assets the server does not list keep their current command.
+ *
+ * @param connection the smm_connection object
+ *
+ * @return true if the commands were retrieved
+ */
+bool smm_connection_sync_commands (smm_connection connection);
+
 /**
  * Get a search to perform from the SMM
  *
@@ -204,6 +574,9 @@ bool smm_asset_last_goto_pos (smm_asset asset, double *lat, double *lon);
  * @param latitude the current latitude of the asset in degrees
  * @param longitude the current longitude of the asset in degrees
  *
+ * If the response to the last @ref smm_asset_report_position included a search,
+ * that search is returned without asking the server again.
+ *
  * @return the closest or next queued search for this asset type, it will need to be accepted with @ref smm_search_accept before searching begins
  */
 smm_search smm_asset_get_search (smm_asset asset, double latitude, double longitude);
@@ -236,8 +609,110 @@ uint64_t smm_search_length (smm_search search);
  */
 uint64_t smm_search_sweep_width (smm_search search);
 
+/**
+ * Download the search geometry from the server
+ * This is done automatically the first time the geometry or waypoints are needed,
+ * call this to pick up any changes made on the server since
+ *
+ * @param search the search
+ *
+ * @return true if the geometry was downloaded
+ */
+bool smm_search_fetch (smm_search search);
+
+/**
+ * Get the search geometry exactly as the server sent it (GeoJSON)
+ * This is the body from the last @ref smm_search_fetch, it is only downloaded if there isn't one yet.
+ * The buffer stays valid after the search is destroyed or fetched again
+ *
+ * @param search the search
+ *
+ * @return a new reference to the response body, release with @ref smm_buffer_unref, or NULL on error
+ */
+smm_buffer smm_search_get_geojson (smm_search search);
+
+/**
+ * Bring the search's waypoints up to date with changes made on the server
+ * Only the changed ranges of waypoints are downloaded and patched into place,
+ * if the server can't provide them the whole geometry is downloaded again.
+ * The change callback is called for every range that changed. A change also
+ * drops the features, so waypoints from @ref smm_search_feature_part are no
+ * longer valid.
+ *
+ * @param search the search
+ *
+ * @return true if the waypoints are now up to date
+ */
+bool smm_search_update (smm_search search);
+
+/**
+ * Get the version of the search geometry the waypoints are from
+ *
+ * @param search the search
+ *
+ * @return the geometry version, 0 if unknown
+ */
+uint64_t smm_search_version (smm_search search);
+
+/**
+ * Set a function to call when @ref smm_search_update changes the waypoints
+ *
+ * @param search the search
+ * @param callback the function to call, or NULL to stop notifications
+ * @param data passed to callback unchanged
+ */
+void smm_search_set_change_callback (smm_search search, smm_search_change_callback callback, void *data);
+
+/**
+ * Get the latest snapshot of the search's waypoints without taking any locks
+ * A new snapshot is published whenever the waypoints are fetched or updated,
+ * the old one stays valid until every registered reader has called
+ * @ref smm_geometry_reader_quiescent after it was replaced.
+ * This never downloads anything, it is NULL until the waypoints have been
+ * fetched by @ref smm_search_update or @ref smm_search_get_waypoints.
+ *
+ * @param search the search
+ *
+ * @return the current snapshot, or NULL if there isn't one yet
+ */
+const smm_geometry *smm_search_geometry (smm_search search);
+
+/**
+ * Register the calling thread as a reader of a search's geometry snapshots
+ *
+ * @param search the search
+ *
+ * @return a reader to pass to @ref smm_geometry_reader_quiescent, or NULL on error
+ */
+smm_geometry_reader smm_search_reader_register (smm_search search);
+
+/**
+ * Tell the search that this reader holds no snapshot pointers any more
+ * Call this regularly, i.e. once per guidance loop, so replaced snapshots can be freed
+ *
+ * @param reader the reader
+ */
+void smm_geometry_reader_quiescent (smm_geometry_reader reader);
+
+/**
+ * Stop reading a search's geometry, must be called before the search is destroyed
+ *
+ * @param reader the reader to unregister and free
+ */
+void smm_geometry_reader_unregister (smm_geometry_reader reader);
+
+/**
+ * Free any replaced snapshots that no reader can still be using
+ * This is also done each time a new snapshot is published
+ *
+ * @param search the search
+ */
+void smm_search_reclaim (smm_search search);
+
 /**
  * Get all the waypoints associated with a a search
+ * The geometry is downloaded on first use and kept, later calls never download it again.
+ * Call @ref smm_search_update or @ref smm_search_fetch to pick up changes made on the server.
  *
  * @param search the search
  * @param waypoints a place to store the list of waypoints
@@ -247,6 +722,121 @@ uint64_t smm_search_sweep_width (smm_search search);
  */
 bool smm_search_get_waypoints (smm_search search, smm_waypoints * waypoints, size_t * waypoints_count);
 
+/**
+ * Get all the waypoints associated with a search as one contiguous array
+ * Every line in the search's features is joined in order, areas are left out
+ * The array is laid out as waypoints_count pairs of doubles (lat, lon),
+ * so it can be handed to other code as an N x 2 array without copying
+ * The geometry is downloaded on first use and kept, see @ref smm_search_get_waypoints
+ *
+ * @param search the search
+ * @param waypoints a place to store the array of waypoints
+ * @param waypoints_count a place to store the count of waypoints
+ *
+ * @return true if waypoints for the search were stored in waypoints, free them with @ref smm_waypoint_array_free
+ */
+bool smm_search_get_waypoint_array (smm_search search, struct smm_waypoint_s **waypoints, size_t * waypoints_count);
+
+/**
+ * Get how many features the search's GeoJSON has
+ * Only the position of each feature is found, features are decoded when first used
+ *
+ * @param search the search
+ *
+ * @return the number of features, 0 if the geometry couldn't be downloaded
+ */
+size_t smm_search_features (smm_search search);
+
+/**
+ * Get what kind of geometry a feature of the search has
+ *
+ * @param search the search
+ * @param feature which feature, from 0 to @ref smm_search_features - 1
+ *
+ * @return the type of the feature, SMM_FEATURE_UNKNOWN if it couldn't be decoded
+ */
+smm_feature_type smm_search_feature_type (smm_search search, size_t feature);
+
+/**
+ * Get how many parts a feature has, the lines of a MultiLineString or the rings of (Multi)Polygons
+ *
+ * @param search the search
+ * @param feature which feature, from 0 to @ref smm_search_features - 1
+ *
+ * @return the number of parts
+ */
+size_t smm_search_feature_parts (smm_search search, size_t feature);
+
+/**
+ * Get the waypoints of one part of a feature
+ * After @ref smm_search_update applies a change the features are found again in
+ * a new download of the geometry, the next time they are used.
+ *
+ * @param search the search
+ * @param feature which feature, from 0 to @ref smm_search_features - 1
+ * @param part which part, from 0 to @ref smm_search_feature_parts - 1
+ * @param waypoints a place to store the waypoints, valid until the search is fetched again, changed by
+ *                  @ref smm_search_update, given a new precision with @ref smm_search_set_precision or destroyed,
+ *                  may be NULL to only get the count, only available at SMM_PRECISION_DOUBLE
+ * @param waypoints_count a place to store the count of waypoints
+ * @param hole a place to store whether the part is a hole in an area, may be NULL
+ *
+ * @return true if the part exists
+ */
+bool smm_search_feature_part (smm_search search, size_t feature, size_t part, const struct smm_waypoint_s **waypoints, size_t *waypoints_count,
+			      bool *hole);
+
+/**
+ * Get one waypoint of a part of a feature, at any precision
+ *
+ * @param search the search
+ * @param feature which feature, from 0 to @ref smm_search_features - 1
+ * @param part which part, from 0 to @ref smm_search_feature_parts - 1
+ * @param index which waypoint of the part
+ * @param waypoint a place to store the waypoint
+ *
+ * @return true if the waypoint exists
+ */
+bool smm_search_feature_point (smm_search search, size_t feature, size_t part, size_t index, struct smm_waypoint_s *waypoint);
+
+/**
+ * Choose how the points of the search's features are stored
+ * The default is SMM_PRECISION_DOUBLE. Features already decoded are decoded
+ * again at the new precision when next used, fetching the GeoJSON again if it
+ * isn't kept. Waypoints returned by @ref smm_search_feature_part before the
+ * change are no longer valid.
+ *
+ * @param search the search
+ * @param precision the storage to use
+ *
+ * @return true if the precision was set
+ */
+bool smm_search_set_precision (smm_search search, smm_precision precision);
+
+/**
+ * Check whether a position is inside an area feature, and not in one of its holes
+ *
+ * @param search the search
+ * @param feature which feature, from 0 to @ref smm_search_features - 1
+ * @param lat the latitude
+ * @param lon the longitude
+ *
+ * @return true if the position is inside, false if it isn't or the feature isn't an area
+ */
+bool smm_search_feature_contains (smm_search search, size_t feature, double lat, double lon);
+
+/**
+ * Get the distance from a position to the nearest line or edge of a feature
+ *
+ * @param search the search
+ * @param feature which feature, from 0 to @ref smm_search_features - 1
+ * @param lat the latitude
+ * @param lon the longitude
+ *
+ * @return the distance in meters, or -1 if the feature couldn't be decoded or is empty
+ */
+double smm_search_feature_distance (smm_search search, size_t feature, double lat, double lon);
+
 /**
  * Accept a search
  * This is an agreement with the server to conduct this search
@@ -258,6 +848,52 @@ bool smm_search_get_waypoints (smm_search search, smm_waypoints * waypoints, siz
  */
 bool smm_search_accept (smm_search search);
 
+/**
+ * Check whether a search has been accepted
+ *
+ * @param search the search
+ *
+ * @return true if the search was accepted, or restored as accepted, and not yet completed
+ */
+bool smm_search_accepted (smm_search search);
+
+/**
+ * Save the connection's assets to a file, so they can be restored after a restart
+ * For each asset the last command and the accepted search, including its
+ * geometry, are saved, along with how far its position reports have been
+ * numbered so a restart never reuses a number. The session itself isn't saved.
+ *
+ * @param connection the smm_connection object
+ * @param path the file to write, it is replaced atomically
+ *
+ * @return true if the file was written
+ */
+bool smm_connection_save_state (smm_connection connection, const char *path);
+
+/**
+ * Restore assets saved by @ref smm_connection_save_state without asking the server
+ * The first @ref smm_asset_get_search for each asset returns the search it had
+ * accepted. The assets and searches are checked against the server in the
+ * background, see @ref smm_asset_restore_status.
+ *
+ * @param connection the smm_connection object
+ * @param path the file to read
+ * @param assets Where to store the assets, free them with @ref smm_asset_free_assets
+ * @param assets_count Where to store how many assets there are
+ *
+ * @return true if the file was read
+ */
+bool smm_connection_restore_state (smm_connection connection, const char *path, smm_assets * assets, size_t * assets_count);
+
+/**
+ * Get the result of checking a restored asset against the server
+ *
+ * @param asset the Asset
+ *
+ * @return the status of the check, SMM_RESTORE_NONE if the asset wasn't restored
+ */
+smm_restore_status smm_asset_restore_status (smm_asset asset);
+
 /**
  * Mark a search as completed
  * Once the current search has been completed, call this function to notify the server
@@ -284,3 +920,431 @@ void smm_search_destroy (smm_search search);
  * @param waypoints_count the number of waypoints
  */
 void smm_waypoints_free (smm_waypoints waypoints, size_t waypoints_count);
+
+/**
+ * Free an array of waypoints
+ * i.e. from @ref smm_search_get_waypoint_array
+ *
+ * @param waypoints the array of waypoints to free
+ */
+void smm_waypoint_array_free (struct smm_waypoint_s *waypoints);
+
+/**
+ * Create a GPS source that is fed NMEA data by the caller
+ * Positions are reported to the server no more often than report_interval_ms
+ *
+ * @param asset the Asset to report positions for
+ * @param report_interval_ms the minimum time between position reports
+ *
+ * @return a new gps source, or NULL on error
+ */
+smm_gps_source smm_gps_source_create (smm_asset asset, unsigned int report_interval_ms);
+
+/**
+ * Create a GPS source that reads NMEA sentences from a serial port
+ *
+ * @param asset the Asset to report positions for
+ * @param device the serial device (i.e. /dev/ttyUSB0)
+ * @param baud the baud rate of the serial port
+ * @param report_interval_ms the minimum time between position reports
+ *
+ * @return a new gps source, or NULL if the device could not be opened
+ */
+smm_gps_source smm_gps_source_nmea_serial (smm_asset asset, const char *device, unsigned int baud, unsigned int report_interval_ms);
+
+/**
+ * Create a GPS source that receives NMEA sentences as UDP datagrams
+ *
+ * @param asset the Asset to report positions for
+ * @param port the local UDP port to listen on
+ * @param report_interval_ms the minimum time between position reports
+ *
+ * @return a new gps source, or NULL if the port could not be bound
+ */
+smm_gps_source smm_gps_source_nmea_udp (smm_asset asset, uint16_t port, unsigned int report_interval_ms);
+
+/**
+ * Create a GPS source that reads from a gpsd daemon
+ *
+ * @param asset the Asset to report positions for
+ * @param host the host gpsd is running on (i.e. localhost)
+ * @param port the port gpsd is listening on (normally 2947)
+ * @param report_interval_ms the minimum time between position reports
+ *
+ * @return a new gps source, or NULL if gpsd could not be contacted
+ */
+smm_gps_source smm_gps_source_gpsd (smm_asset asset, const char *host, uint16_t port, unsigned int report_interval_ms);
+
+/**
+ * Get the file descriptor a GPS source reads from, for use with poll/select
+ *
+ * @param source the gps source
+ *
+ * @return the file descriptor, or -1 if the source is fed by the caller
+ */
+int smm_gps_source_fd (smm_gps_source source);
+
+/**
+ * Wait for and process input from a GPS source
+ * Any complete fix that is due is reported to the server before returning
+ *
+ * @param source the gps source
+ * @param timeout_ms how long to wait for input, -1 to wait forever
+ *
+ * @return false if the source has failed (i.e. device removed, gpsd closed the connection)
+ */
+bool smm_gps_source_poll (smm_gps_source source, int timeout_ms);
+
+/**
+ * Feed NMEA data to a GPS source
+ * The data does not need to be split on sentence boundaries
+ *
+ * @param source the gps source
+ * @param data the NMEA data
+ * @param length the number of bytes in data
+ *
+ * @return true if the data was processed
+ */
+bool smm_gps_source_feed (smm_gps_source source, const char *data, size_t length);
+
+/**
+ * Get the most recent complete fix seen by a GPS source
+ *
+ * @param source the gps source
+ * @param fix a place to store the fix
+ *
+ * @return true if a fix has been seen and was stored in fix
+ */
+bool smm_gps_source_last_fix (smm_gps_source source, smm_fix * fix);
+
+/**
+ * Close a GPS source and free associated resources
+ *
+ * @param source the gps source to close
+ */
+void smm_gps_source_close (smm_gps_source source);
+
+/**
+ * Enable/disable recording of the asset's track
+ * When enabled every fix passed to @ref smm_asset_report_position is kept in
+ * a compressed in-memory store, whether or not it reached the server
+ *
+ * @param asset the Asset
+ * @param enable true to start recording, false to stop recording and discard the track
+ *
+ * @return true if the track store is in the requested state
+ */
+bool smm_asset_track_enable (smm_asset asset, bool enable);
+
+/**
+ * Get the number of fixes in the asset's track
+ *
+ * @param asset the Asset
+ *
+ * @return the number of fixes recorded
+ */
+size_t smm_asset_track_count (smm_asset asset);
+
+/**
+ * Get the memory used by the asset's track
+ *
+ * @param asset the Asset
+ *
+ * @return the number of bytes used to store the track
+ */
+size_t smm_asset_track_bytes (smm_asset asset);
+
+/**
+ * Get the fixes recorded between two times
+ *
+ * @param asset the Asset
+ * @param from_ms the start of the time range, in milliseconds since the unix epoch
+ * @param to_ms the end of the time range (inclusive)
+ * @param fixes a place to store the fixes, free with @ref smm_fixes_free
+ * @param fixes_count a place to store the number of fixes
+ *
+ * @return true if the fixes (if any) were stored in fixes
+ */
+bool smm_asset_track_get (smm_asset asset, uint64_t from_ms, uint64_t to_ms, smm_fix ** fixes, size_t * fixes_count);
+
+/**
+ * Get the fixes recorded between two times within an area
+ *
+ * @param asset the Asset
+ * @param from_ms the start of the time range, in milliseconds since the unix epoch
+ * @param to_ms the end of the time range (inclusive)
+ * @param min_lat the southern edge of the area in degrees
+ * @param min_lon the western edge of the area in degrees
+ * @param max_lat the northern edge of the area in degrees
+ * @param max_lon the eastern edge of the area in degrees
+ * @param fixes a place to store the fixes, free with @ref smm_fixes_free
+ * @param fixes_count a place to store the number of fixes
+ *
+ * @return true if the fixes (if any) were stored in fixes
+ */
+bool smm_asset_track_get_area (smm_asset asset, uint64_t from_ms, uint64_t to_ms, double min_lat, double min_lon, double max_lat, double max_lon,
+			       smm_fix ** fixes, size_t * fixes_count);
+
+/**
+ * Free a list of fixes
+ * i.e. from @ref smm_asset_track_get
+ *
+ * @param fixes the fixes to free
+ */
+void smm_fixes_free (smm_fix * fixes);
+
+/**
+ * Simplify a list of fixes in place using the Douglas-Peucker algorithm
+ * Fixes where the bearing changes by at least turn_degrees from the previous fix are always kept
+ *
+ * @param fixes the fixes to simplify, in time order
+ * @param fixes_count the number of fixes
+ * @param tolerance_m the maximum distance in meters between the original and simplified tracks
+ * @param turn_degrees the change in bearing that marks a turn point, 0 to disable
+ *
+ * @return the number of fixes remaining at the start of fixes
+ */
+size_t smm_fixes_simplify (smm_fix * fixes, size_t fixes_count, double tolerance_m, double turn_degrees);
+
+/**
+ * Prepare to upload a portion of the asset's recorded track
+ * i.e. after an outage, see @ref smm_asset_track_enable
+ *
+ * @param asset the Asset
+ * @param from_ms the start of the time range, in milliseconds since the unix epoch
+ * @param to_ms the end of the time range (inclusive)
+ * @param tolerance_m the simplification tolerance in meters, see @ref smm_fixes_simplify
+ * @param turn_degrees the change in bearing that marks a turn point, see @ref smm_fixes_simplify
+ *
+ * @return a backfill object, or NULL if the asset has no recorded track
+ */
+smm_backfill smm_asset_backfill_create (smm_asset asset, uint64_t from_ms, uint64_t to_ms, double tolerance_m, double turn_degrees);
+
+/**
+ * Upload the next part of a backfill as timestamped bulk reports
+ * The fixes go in requests of at most 100, and the upload stops early whenever a
+ * live position report is waiting on the same connection, so call this repeatedly
+ * between live reports until @ref smm_backfill_remaining is 0. Each fix carries a
+ * sequence number, so after a failure it is safe to call this again.
+ *
+ * @param backfill the backfill
+ * @param max_fixes the most fixes to send in this call, 0 for no limit
+ *
+ * @return false if the server rejected the upload
+ */
+bool smm_backfill_send (smm_backfill backfill, size_t max_fixes);
+
+/**
+ * Get the number of fixes still to be uploaded
+ *
+ * @param backfill the backfill
+ *
+ * @return the number of fixes not yet accepted by the server
+ */
+size_t smm_backfill_remaining (smm_backfill backfill);
+
+/**
+ * Destroy a backfill object
+ *
+ * @param backfill the backfill to free
+ */
+void smm_backfill_destroy (smm_backfill backfill);
+
+/**
+ * Create a feed of the positions of the other assets on the server
+ * The feed is empty until @ref smm_peer_feed_sync is called
+ *
+ * @param connection the smm_connection object to use
+ *
+ * @return a new peer feed, or NULL on error
+ */
+smm_peer_feed smm_connection_peer_feed (smm_connection connection);
+
+/**
+ * Bring the peer feed up to date
+ * Only the positions that changed since the last sync are retrieved
+ *
+ * @param feed the peer feed
+ *
+ * @return true if the feed was updated
+ */
+bool smm_peer_feed_sync (smm_peer_feed feed);
+
+/**
+ * Get the sequence number the feed is synchronised to
+ *
+ * @param feed the peer feed
+ *
+ * @return the server sequence number of the last update applied, 0 if never synced
+ */
+uint64_t smm_peer_feed_sequence (smm_peer_feed feed);
+
+/**
+ * Get notified about each peer that changes during a sync
+ * The callback is called once the sync has finished updating the feed, so it may read
+ * the feed, but must not call @ref smm_peer_feed_sync
+ *
+ * @param feed the peer feed
+ * @param callback the function to call, NULL to disable
+ * @param data passed to callback
+ */
+void smm_peer_feed_set_callback (smm_peer_feed feed, smm_peer_feed_callback callback, void *data);
+
+/**
+ * Get the number of peers in the feed
+ *
+ * @param feed the peer feed
+ *
+ * @return the number of peers
+ */
+size_t smm_peer_feed_count (smm_peer_feed feed);
+
+/**
+ * Get a peer by position in the feed
+ * Positions are only stable between calls to @ref smm_peer_feed_sync
+ *
+ * @param feed the peer feed
+ * @param index the position in the feed
+ * @param peer a place to store the peer
+ *
+ * @return true if index was valid and peer was set
+ */
+bool smm_peer_feed_get (smm_peer_feed feed, size_t index, smm_peer * peer);
+
+/**
+ * Find a peer by asset id
+ *
+ * @param feed the peer feed
+ * @param asset_id the id of the asset
+ * @param peer a place to store the peer
+ *
+ * @return true if the asset is in the feed and peer was set
+ */
+bool smm_peer_feed_find (smm_peer_feed feed, long long asset_id, smm_peer * peer);
+
+/**
+ * Copy every peer out of the feed
+ *
+ * @param feed the peer feed
+ * @param peers a place to store the peers
+ * @param peers_size how many peers fit in peers
+ *
+ * @return the number of peers stored in peers
+ */
+size_t smm_peer_feed_copy (smm_peer_feed feed, smm_peer * peers, size_t peers_size);
+
+/**
+ * Destroy a peer feed
+ *
+ * @param feed the peer feed to free
+ */
+void smm_peer_feed_destroy (smm_peer_feed feed);
+
+/**
+ * Create a spatial index for finding other assets near a position
+ *
+ * @param ref_lat a latitude near the middle of the operating area, in degrees
+ * @param cell_size_m the grid size in meters, about the separation radius normally queried
+ *
+ * @return a new spatial index, or NULL on error
+ */
+smm_proximity smm_proximity_create (double ref_lat, double cell_size_m);
+
+/**
+ * Add or move a peer in the spatial index
+ *
+ * @param proximity the spatial index
+ * @param peer the peer's current state
+ */
+void smm_proximity_update (smm_proximity proximity, const smm_peer * peer);
+
+/**
+ * Remove a peer from the spatial index
+ *
+ * @param proximity the spatial index
+ * @param asset_id the id of the peer
+ */
+void smm_proximity_remove (smm_proximity proximity, long long asset_id);
+
+/**
+ * Never report an asset, normally the asset doing the query
+ *
+ * @param proximity the spatial index
+ * @param asset_id the id of the asset to ignore, -1 for none
+ */
+void smm_proximity_ignore (smm_proximity proximity, long long asset_id);
+
+/**
+ * Keep the spatial index up to date with a peer feed
+ * The current contents of the feed are loaded and every change applied from then on.
+ * Any callback already set with @ref smm_peer_feed_set_callback is still called for
+ * each change, after the index is updated. Setting a callback afterwards detaches the index.
+ *
+ * @param proximity the spatial index
+ * @param feed the peer feed, only one can be attached at a time
+ */
+void smm_proximity_attach (smm_proximity proximity, smm_peer_feed feed);
+
+/**
+ * Stop updating the spatial index from its peer feed
+ * The feed's previous callback is put back, this must not be called from a feed callback
+ *
+ * @param proximity the spatial index
+ */
+void smm_proximity_detach (smm_proximity proximity);
+
+/**
+ * Find the other assets within a radius of a fix
+ *
+ * @param proximity the spatial index
+ * @param own the current fix of this asset, speed and bearing are used for closure rates
+ * @param radius_m the separation radius in meters
+ * @param hits a place to store the nearest peers, closest first
+ * @param hits_size how many hits fit in hits
+ *
+ * @return the number of hits stored in hits
+ */
+size_t smm_proximity_query (smm_proximity proximity, const smm_fix * own, double radius_m, smm_proximity_hit * hits, size_t hits_size);
+
+/**
+ * Destroy a spatial index
+ * Any attached feed is detached first, and must not be destroyed before this
+ *
+ * @param proximity the spatial index to free
+ */
+void smm_proximity_destroy (smm_proximity proximity);
+
+/**
+ * Take another reference to a buffer
+ *
+ * @param buffer the buffer
+ *
+ * @return buffer
+ */
+smm_buffer smm_buffer_ref (smm_buffer buffer);
+
+/**
+ * Release a reference to a buffer, the buffer is freed when the last reference is released
+ *
+ * @param buffer the buffer
+ */
+void smm_buffer_unref (smm_buffer buffer);
+
+/**
+ * Get the contents of a buffer
+ * The contents are always followed by a terminating NUL which is not included in the length
+ *
+ * @param buffer the buffer
+ *
+ * @return the contents of the buffer, or NULL if buffer is invalid
+ */
+const char *smm_buffer_data (smm_buffer buffer);
+
+/**
+ * Get the length of a buffer
+ *
+ * @param buffer the buffer
+ *
+ * @return the number of bytes in the buffer, 0 if buffer is invalid
+ */
+size_t smm_buffer_length (smm_buffer buffer);
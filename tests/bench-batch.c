@@ -0,0 +1,102 @@
+/**
+ * bench-batch.c, Measure batched position reports against one report per asset
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-test.h"
+
+#define ASSETS 50
+#define FRAMES 40
+
+static void
+fleet_frame (smm_fix * fixes, size_t frame)
+{
+	for (size_t i = 0; i < ASSETS; i++)
+	{
+		fixes[i].time_ms = 1000 * (uint64_t) (frame + 1);
+		fixes[i].lat = -43.5 + 0.01 * (double) i;
+		fixes[i].lon = 172.6 + 0.0005 * (double) frame;
+		fixes[i].altitude = 300;
+		fixes[i].bearing = 90;
+		fixes[i].fix = 3;
+	}
+}
+
+static void
+report (const char *name, double seconds)
+{
+	printf ("%-12s %6.2f ms per frame of %d assets\n", name, seconds * 1e3 / FRAMES, ASSETS);
+}
+
+int
+main (void)
+{
+	char url[64];
+	smm_assets assets = NULL;
+	size_t assets_count = 0;
+	smm_fix fixes[ASSETS];
+	bool reported[ASSETS];
+
+	pid_t server = smm_test_stand_in_start (url, sizeof (url));
+	smm_test_stand_in_get (url, "/test/assets/?count=50");
+	smm_test_stand_in_get (url, "/test/command/?asset_id=7&action=RTL");
+
+	smm_connection conn = smm_asset_connect (url, "user", "pass");
+	SMM_TEST_CHECK (smm_asset_connection_get_state (conn) == SMM_CONNECTION_CONNECTED);
+	SMM_TEST_CHECK (smm_asset_get_assets (conn, &assets, &assets_count));
+	SMM_TEST_CHECK (assets_count == ASSETS);
+
+	/* What a fleet gateway did before, one request per asset */
+	double start = smm_test_seconds ();
+	for (size_t frame = 0; frame < FRAMES; frame++)
+	{
+		fleet_frame (fixes, frame);
+		for (size_t i = 0; i < ASSETS; i++)
+		{
+			SMM_TEST_CHECK (smm_asset_report_fix (assets[i], &fixes[i]));
+		}
+	}
+	report ("loop", smm_test_seconds () - start);
+
+	start = smm_test_seconds ();
+	for (size_t frame = 0; frame < FRAMES; frame++)
+	{
+		fleet_frame (fixes, frame);
+		SMM_TEST_CHECK (smm_assets_report_positions (assets, fixes, ASSETS, reported));
+	}
+	report ("batched", smm_test_seconds () - start);
+
+	/* A server without the endpoint, every fix falls back to its own request */
+	smm_test_stand_in_get (url, "/test/batch/?unsupported=1");
+	start = smm_test_seconds ();
+	for (size_t frame = 0; frame < FRAMES; frame++)
+	{
+		fleet_frame (fixes, frame);
+		SMM_TEST_CHECK (smm_assets_report_positions (assets, fixes, ASSETS, reported));
+	}
+	report ("fallback", smm_test_seconds () - start);
+	SMM_TEST_CHECK (smm_asset_last_command (assets[6]) == SMM_COMMAND_RTL);
+
+	smm_asset_free_assets (assets, assets_count);
+	smm_connection_close (conn);
+	smm_test_stand_in_stop (server);
+
+	return 0;
+}
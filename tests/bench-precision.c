@@ -0,0 +1,138 @@
+/**
+ * bench-precision.c, Measure feature kernels and point error at each storage precision
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+#include "smm-test.h"
+
+#include <math.h>
+
+/* A wavy ring about 11 km across with a small square hole, and a line */
+#define POINTS 100000
+#define QUERIES 2000
+#define REF_LAT -43.5
+#define REF_LON 172.6
+#define RADIUS 0.05
+
+static const char *names[] = { "double", "float", "fixed" };
+
+static void
+ring_point (size_t i, double *lat, double *lon)
+{
+	double a = 2 * M_PI * (double) (i % POINTS) / POINTS;
+	double r = RADIUS * (1 + 0.1 * sin (a * 37));
+	*lat = REF_LAT + r * sin (a);
+	*lon = REF_LON + r * cos (a) / cos (REF_LAT * M_PI / 180.0);
+}
+
+/* The search as the server would send it, indexed without a connection */
+static smm_search
+search_create (void)
+{
+	struct buffer_s buf = { NULL, 0 };
+	FILE *f = open_memstream (&buf.data, &buf.bytes);
+	SMM_TEST_CHECK (f != NULL);
+
+	fprintf (f, "{\"features\": [{\"type\": \"Feature\", \"geometry\": {\"type\": \"Polygon\", \"coordinates\": [[");
+	for (size_t i = 0; i <= POINTS; i++)
+	{
+		double lat, lon;
+		ring_point (i, &lat, &lon);
+		fprintf (f, "%s[%.9f, %.9f]", i ? ", " : "", lon, lat);
+	}
+	fprintf (f, "], [[172.6, -43.5], [172.61, -43.5], [172.61, -43.49], [172.6, -43.49], [172.6, -43.5]]]}}, ");
+	fprintf (f, "{\"type\": \"Feature\", \"geometry\": {\"type\": \"LineString\", \"coordinates\": [[172.5, -43.4], [172.7, -43.4]]}}]}");
+	SMM_TEST_CHECK (fclose (f) == 0);
+
+	smm_search search = smm_search_create (NULL, "/search/1/json/", 0, 0, 0);
+	SMM_TEST_CHECK (search != NULL);
+	search->geojson = smm_buffer_take (&buf);
+	SMM_TEST_CHECK (search->geojson != NULL && smm_search_index_features (search));
+	return search;
+}
+
+int
+main (void)
+{
+	static double queries[QUERIES][2];
+	static bool inside_double[QUERIES];
+	static double distance_double[QUERIES];
+
+	smm_search search = search_create ();
+	srand (1);
+	for (size_t i = 0; i < QUERIES; i++)
+	{
+		queries[i][0] = REF_LAT + ((double) rand () / RAND_MAX - 0.5) * 2.6 * RADIUS;
+		queries[i][1] = REF_LON + ((double) rand () / RAND_MAX - 0.5) * 3.6 * RADIUS;
+	}
+
+	printf ("%d point polygon with a hole, %d queries\n", POINTS, QUERIES);
+	for (smm_precision precision = SMM_PRECISION_DOUBLE; precision <= SMM_PRECISION_FIXED; precision++)
+	{
+		SMM_TEST_CHECK (smm_search_set_precision (search, precision));
+
+		/* How far each stored point is from what was sent */
+		double max_error = 0.0;
+		for (size_t i = 0; i < POINTS; i++)
+		{
+			struct smm_waypoint_s point;
+			double lat, lon;
+			SMM_TEST_CHECK (smm_search_feature_point (search, 0, 0, i, &point));
+			ring_point (i, &lat, &lon);
+			double error = hypot ((point.lat - lat) * SMM_METERS_PER_DEGREE,
+					      (point.lon - lon) * SMM_METERS_PER_DEGREE * cos (REF_LAT * M_PI / 180.0));
+			max_error = error > max_error ? error : max_error;
+		}
+
+		size_t mismatches = 0;
+		double start = smm_test_seconds ();
+		for (size_t i = 0; i < QUERIES; i++)
+		{
+			bool inside = smm_search_feature_contains (search, 0, queries[i][0], queries[i][1]);
+			if (precision == SMM_PRECISION_DOUBLE)
+			{
+				inside_double[i] = inside;
+			}
+			mismatches += inside != inside_double[i];
+		}
+		double contains = smm_test_seconds () - start;
+
+		double max_difference = 0.0;
+		start = smm_test_seconds ();
+		for (size_t i = 0; i < QUERIES; i++)
+		{
+			double distance = smm_search_feature_distance (search, 0, queries[i][0], queries[i][1]);
+			if (precision == SMM_PRECISION_DOUBLE)
+			{
+				distance_double[i] = distance;
+			}
+			max_difference = fmax (max_difference, fabs (distance - distance_double[i]));
+		}
+		double distance = smm_test_seconds () - start;
+
+		printf ("%-6s max error %.1f mm, contains %.0f Mpt/s (%zu differ), distance %.0f Mpt/s (within %.1f mm)\n", names[precision],
+			max_error * 1e3, (double) QUERIES * POINTS / contains / 1e6, mismatches, (double) QUERIES * POINTS / distance / 1e6,
+			max_difference * 1e3);
+	}
+
+	smm_search_destroy (search);
+	return 0;
+}
@@ -0,0 +1,123 @@
+/**
+ * bench-proximity.c, Measure proximity updates and queries against a linear scan
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-test.h"
+
+#include <math.h>
+
+/* A fleet spread over about 100 km square, queried at a 1 km separation */
+#define FLEET 1000
+#define ROUNDS 200
+#define QUERIES 200000
+#define REF_LAT -43.5
+#define REF_LON 172.6
+#define SPREAD 1.0
+#define RADIUS_M 1000.0
+#define HITS 8
+
+/* What the index replaces, every peer's distance on every fix */
+static size_t
+linear_scan (const smm_peer * peers, size_t count, const smm_fix * own, double radius_m)
+{
+	size_t hits = 0;
+	double x_scale = cos (REF_LAT * M_PI / 180.0);
+	for (size_t i = 0; i < count; i++)
+	{
+		double dx = (peers[i].lon - own->lon) * x_scale * 111319.49;
+		double dy = (peers[i].lat - own->lat) * 111319.49;
+		if (dx * dx + dy * dy <= radius_m * radius_m)
+		{
+			hits++;
+		}
+	}
+	return hits;
+}
+
+int
+main (void)
+{
+	static smm_peer peers[FLEET];
+	static smm_fix own[QUERIES / 100];
+	smm_proximity_hit hits[HITS];
+	size_t found = 0;
+	size_t scanned = 0;
+
+	srand (1);
+	for (size_t i = 0; i < FLEET; i++)
+	{
+		peers[i].asset_id = (long long) i + 1;
+		peers[i].lat = REF_LAT + SPREAD * rand () / RAND_MAX;
+		peers[i].lon = REF_LON + SPREAD * rand () / RAND_MAX;
+		peers[i].altitude = 300 + rand () % 1000;
+		peers[i].velocity_east = 20.0f;
+	}
+	for (size_t i = 0; i < QUERIES / 100; i++)
+	{
+		own[i].lat = REF_LAT + SPREAD * rand () / RAND_MAX;
+		own[i].lon = REF_LON + SPREAD * rand () / RAND_MAX;
+		own[i].speed = 30.0f;
+	}
+
+	smm_proximity proximity = smm_proximity_create (REF_LAT, RADIUS_M);
+	if (proximity == NULL)
+	{
+		return 1;
+	}
+	for (size_t i = 0; i < FLEET; i++)
+	{
+		smm_proximity_update (proximity, &peers[i]);
+	}
+
+	/* Every peer moves about 20 m east each round, crossing cells now and then */
+	double start = smm_test_seconds ();
+	for (size_t round = 0; round < ROUNDS; round++)
+	{
+		for (size_t i = 0; i < FLEET; i++)
+		{
+			peers[i].lon += 0.00025;
+			smm_proximity_update (proximity, &peers[i]);
+		}
+	}
+	double update = smm_test_seconds () - start;
+
+	start = smm_test_seconds ();
+	for (size_t i = 0; i < QUERIES; i++)
+	{
+		found += smm_proximity_query (proximity, &own[i % (QUERIES / 100)], RADIUS_M, hits, HITS);
+	}
+	double query = smm_test_seconds () - start;
+
+	start = smm_test_seconds ();
+	for (size_t i = 0; i < QUERIES; i++)
+	{
+		scanned += linear_scan (peers, FLEET, &own[i % (QUERIES / 100)], RADIUS_M);
+	}
+	double scan = smm_test_seconds () - start;
+
+	printf ("%d peers, %.0f m radius\n", FLEET, RADIUS_M);
+	printf ("update: %.0f ns\n", update * 1e9 / (ROUNDS * FLEET));
+	printf ("query: %.0f ns, %.2f hits\n", query * 1e9 / QUERIES, (double) found / QUERIES);
+	printf ("linear scan: %.0f ns, %.2f hits\n", scan * 1e9 / QUERIES, (double) scanned / QUERIES);
+
+	smm_proximity_destroy (proximity);
+	return 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * bench-track.c, Measure the size and decode speed of the compressed track store
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+#include "smm-test.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* One hour at 10 Hz */
+#define FIXES 36000
+#define START_MS 1700000000000ULL
+#define ROUNDS 20
+
+int
+main (void)
+{
+	struct smm_asset_s asset = { 0 };
+	smm_fix *fixes = NULL;
+	size_t fixes_count = 0;
+	double lat = -43.5;
+	double lon = 172.6;
+
+	if (!smm_asset_track_enable (&asset, true))
+	{
+		return 1;
+	}
+
+	/* A gently curving flight with a climb and the odd turn */
+	double start = smm_test_seconds ();
+	for (size_t i = 0; i < FIXES; i++)
+	{
+		smm_fix fix = {
+			.time_ms = START_MS + i * 100,
+			.lat = lat,
+			.lon = lon,
+			.altitude = 300 + (i / 50) % 3,
+			.bearing = (uint16_t) ((i / 300) % 360),
+			.speed = 50.0f,
+			.fix = 3,
+		};
+		smm_track_record (asset.track, &fix);
+		lat += 0.00004 * cos (i / 3000.0);
+		lon += 0.00005 * sin (i / 3000.0);
+	}
+	double record = smm_test_seconds () - start;
+
+	size_t bytes = smm_asset_track_bytes (&asset);
+	printf ("recorded %zu fixes in %.1f ms, %zu bytes, %.2f bytes per fix (%zu as smm_fix)\n", smm_asset_track_count (&asset),
+		record * 1000, bytes, (double) bytes / FIXES, sizeof (smm_fix));
+
+	start = smm_test_seconds ();
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		smm_fixes_free (fixes);
+		smm_asset_track_get (&asset, 0, UINT64_MAX, &fixes, &fixes_count);
+	}
+	double decode = smm_test_seconds () - start;
+	printf ("decoded the whole track %d times, %.1f million fixes per second\n", ROUNDS, ROUNDS * fixes_count / decode / 1e6);
+	bool ok = fixes_count == FIXES && fabs (fixes[FIXES - 1].lat - (lat - 0.00004 * cos ((FIXES - 1) / 3000.0))) < 1e-6;
+	smm_fixes_free (fixes);
+
+	/* A minute from the middle only decodes the blocks it overlaps */
+	start = smm_test_seconds ();
+	smm_asset_track_get (&asset, START_MS + 1800000, START_MS + 1859999, &fixes, &fixes_count);
+	printf ("one minute range: %zu fixes in %.1f us\n", fixes_count, (smm_test_seconds () - start) * 1e6);
+	ok = ok && fixes_count == 600;
+	smm_fixes_free (fixes);
+
+	start = smm_test_seconds ();
+	smm_asset_track_get_area (&asset, 0, UINT64_MAX, -43.6, 172.0, -43.4, 172.65, &fixes, &fixes_count);
+	printf ("bounding box: %zu fixes in %.1f us\n", fixes_count, (smm_test_seconds () - start) * 1e6);
+	smm_fixes_free (fixes);
+
+	smm_asset_track_enable (&asset, false);
+
+	return ok ? 0 : 1;
+}
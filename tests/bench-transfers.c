@@ -0,0 +1,136 @@
+/**
+ * bench-transfers.c, Measure the client CPU cost of a request against the stand-in server
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+#include "smm-test.h"
+
+#define REQUESTS 2000
+
+/* CPU used by this process only, the server's time isn't counted */
+static double
+cpu_seconds (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/* What every request used to do, set a dozen options then clear six */
+static void
+churn_request (CURL *curl, const char *url, struct buffer_s *buf)
+{
+	curl_easy_setopt (curl, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt (curl, CURLOPT_SSL_VERIFYPEER, 0L);
+	curl_easy_setopt (curl, CURLOPT_SSL_VERIFYHOST, 0L);
+	curl_easy_setopt (curl, CURLOPT_COOKIEFILE, "");
+	curl_easy_setopt (curl, CURLOPT_FOLLOWLOCATION, 0L);
+	curl_easy_setopt (curl, CURLOPT_URL, url);
+	curl_easy_setopt (curl, CURLOPT_REFERER, NULL);
+	curl_easy_setopt (curl, CURLOPT_POSTFIELDS, NULL);
+	curl_easy_setopt (curl, CURLOPT_POST, 0L);
+	curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, to_buffer);
+	curl_easy_setopt (curl, CURLOPT_WRITEDATA, buf);
+	SMM_TEST_CHECK (curl_easy_perform (curl) == CURLE_OK);
+	curl_easy_setopt (curl, CURLOPT_URL, NULL);
+	curl_easy_setopt (curl, CURLOPT_REFERER, NULL);
+	curl_easy_setopt (curl, CURLOPT_POSTFIELDS, NULL);
+	curl_easy_setopt (curl, CURLOPT_POST, 0L);
+	curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, NULL);
+	curl_easy_setopt (curl, CURLOPT_WRITEDATA, NULL);
+}
+
+/* A pre-armed handle, only the URL and write data change */
+static void
+armed_request (CURL *curl, const char *url, struct buffer_s *buf)
+{
+	curl_easy_setopt (curl, CURLOPT_URL, url);
+	curl_easy_setopt (curl, CURLOPT_WRITEDATA, buf);
+	SMM_TEST_CHECK (curl_easy_perform (curl) == CURLE_OK);
+}
+
+static void
+report (const char *name, double cpu, double wall)
+{
+	printf ("%-16s %6.1f us CPU, %6.1f us wall per request\n", name, cpu * 1e6 / REQUESTS, wall * 1e6 / REQUESTS);
+}
+
+int
+main (void)
+{
+	char url[64];
+	char *ping = NULL;
+
+	pid_t server = smm_test_stand_in_start (url, sizeof (url));
+	SMM_TEST_CHECK (asprintf (&ping, "%s/test/ping/", url) >= 0);
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		CURL *curl = curl_easy_init ();
+		SMM_TEST_CHECK (curl != NULL);
+		if (pass == 1)
+		{
+			curl_easy_setopt (curl, CURLOPT_FAILONERROR, 1L);
+			curl_easy_setopt (curl, CURLOPT_SSL_VERIFYPEER, 0L);
+			curl_easy_setopt (curl, CURLOPT_SSL_VERIFYHOST, 0L);
+			curl_easy_setopt (curl, CURLOPT_COOKIEFILE, "");
+			curl_easy_setopt (curl, CURLOPT_FOLLOWLOCATION, 0L);
+			curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, to_buffer);
+		}
+		double cpu = cpu_seconds ();
+		double wall = smm_test_seconds ();
+		for (int i = 0; i < REQUESTS; i++)
+		{
+			struct buffer_s buf = { NULL, 0 };
+			if (pass == 0)
+			{
+				churn_request (curl, ping, &buf);
+			}
+			else
+			{
+				armed_request (curl, ping, &buf);
+			}
+			free (buf.data);
+		}
+		report (pass == 0 ? "option churn" : "pre-armed", cpu_seconds () - cpu, smm_test_seconds () - wall);
+		curl_easy_cleanup (curl);
+	}
+
+	/* The whole request path, including the cookie share, metrics and clock sampling */
+	smm_connection conn = smm_asset_connect (url, "user", "pass");
+	SMM_TEST_CHECK (smm_asset_connection_get_state (conn) == SMM_CONNECTION_CONNECTED);
+	double cpu = cpu_seconds ();
+	double wall = smm_test_seconds ();
+	for (int i = 0; i < REQUESTS; i++)
+	{
+		struct buffer_s buf = { NULL, 0 };
+		struct smm_curl_res_s *res = smm_connection_curl_retrieve_url (conn, "/test/ping/", NULL, to_buffer, &buf);
+		SMM_TEST_CHECK (res != NULL && res->success);
+		smm_curl_res_free (res);
+		free (buf.data);
+	}
+	report ("libsmm-asset", cpu_seconds () - cpu, smm_test_seconds () - wall);
+
+	smm_connection_close (conn);
+	free (ping);
+	smm_test_stand_in_stop (server);
+	return 0;
+}
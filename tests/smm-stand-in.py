@@ -0,0 +1,387 @@
+#!/usr/bin/env python3
+# smm-stand-in.py, a stand-in SMM server for the libsmm-asset tests
+#
+# Serves just enough of the SMM API for the tests on a free port of 127.0.0.1,
+# the port is printed on the first line of stdout.  The tests set up the
+# server's state through the /test/ pages.
+
+import http.server
+import json
+import socket
+import socketserver
+import sys
+import threading
+import time
+import urllib.parse
+
+LOGIN_PAGE = b"""<html><body><form method="post">
+<input type="hidden" name="csrfmiddlewaretoken" value="stand-in-token">
+</form></body></html>"""
+
+
+class State:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.sequence = 0
+        # asset_id: (sequence, position)
+        self.peers = {}
+        # asset_id: sequence
+        self.removed = {}
+        self.assets = [
+            {"id": 1, "type_id": 1, "name": "Rescue 1", "type_name": "Helicopter"},
+            {"id": 2, "type_id": 2, "name": "Alpha 2", "type_name": "Fixed Wing"},
+        ]
+        # asset_id: command, as sent in reply to a report
+        self.commands = {}
+        # asset_id: [position]
+        self.positions = {}
+        # How many of the next position reports to refuse
+        self.fail_reports = 0
+        # How many of the next position reports to store but answer with an error
+        self.lose_reports = 0
+        # search_id: Search
+        self.searches = {}
+        # Answer batches of reports with 404, as servers without the endpoint do
+        self.batch_unsupported = False
+        # How many HEAD requests have been answered
+        self.probes = 0
+
+    def move_peer(self, position):
+        with self.lock:
+            self.sequence += 1
+            self.peers[position["asset_id"]] = (self.sequence, position)
+            self.removed.pop(position["asset_id"], None)
+
+    def remove_peer(self, asset_id):
+        with self.lock:
+            if self.peers.pop(asset_id, None) is not None:
+                self.sequence += 1
+                self.removed[asset_id] = self.sequence
+
+    def feed(self, since):
+        with self.lock:
+            full = since == 0 or since > self.sequence
+            return {
+                "sequence": self.sequence,
+                "full": full,
+                "positions": [p for s, p in self.peers.values() if full or s > since],
+                "removed": [] if full else [a for a, s in self.removed.items() if s > since],
+            }
+
+
+    def report(self, asset_id, position):
+        """Stores at most one position per asset and seq, as the server does"""
+        with self.lock:
+            if self.fail_reports > 0:
+                self.fail_reports -= 1
+                return None, False
+            positions = self.positions.setdefault(asset_id, [])
+            if not any(p.get("seq") == position.get("seq") for p in positions):
+                positions.append(position)
+            if self.lose_reports > 0:
+                self.lose_reports -= 1
+                return None, False
+            return self.commands.get(asset_id), True
+
+    def stored(self, asset_id, since):
+        with self.lock:
+            return [int(p["seq"]) for p in self.positions.get(asset_id, []) if int(p.get("seq", 0)) >= since]
+
+
+class Search:
+    """A search made of one line, with the changes made since each version"""
+
+    def __init__(self, coordinates):
+        self.version = 1
+        self.coordinates = coordinates
+        self.broken = False
+        # (version, change) for each change, change took the line to version
+        self.history = []
+
+    def change(self, start, remove, coordinates):
+        self.coordinates[start : start + remove] = coordinates
+        self.version += 1
+        self.history.append((self.version, {"start": start, "remove": remove, "coordinates": coordinates}))
+
+    def corrupt(self):
+        """Send a change that can't apply, and no body to start again from"""
+        self.version += 1
+        self.history.append((self.version, {"start": len(self.coordinates) + 1, "remove": 0, "coordinates": []}))
+        self.broken = True
+
+    def geojson(self):
+        if self.broken:
+            return None
+        return {
+            "type": "FeatureCollection",
+            "features": [
+                {
+                    "type": "Feature",
+                    "properties": {"version": self.version},
+                    "geometry": {"type": "LineString", "coordinates": self.coordinates},
+                }
+            ],
+        }
+
+    def delta(self, since):
+        if since != self.version and not any(v == since + 1 for v, c in self.history):
+            return None
+        return {"version": self.version, "changes": [c for v, c in self.history if v > since]}
+
+
+state = State()
+
+
+def parse_number(text):
+    """Keep integers as integers, servers send coordinates either way"""
+    return float(text) if "." in text else int(text)
+
+
+def parse_coordinates(text):
+    """lon,lat;lon,lat;..."""
+    return [[parse_number(n) for n in point.split(",")] for point in text.split(";") if point]
+
+
+def search_summary(search_id, distance):
+    return {"object_url": "/search/%d/json/" % search_id, "distance": distance, "length": 1000, "sweep_width": 200}
+
+
+def query_int(query, key, default=0):
+    return int(query.get(key, [default])[0])
+
+
+def query_float(query, key, default=0.0):
+    return float(query.get(key, [default])[0])
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def setup(self):
+        super().setup()
+        self.connection.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+    def log_message(self, format, *args):
+        pass
+
+    def reply(self, code, body=b"", content_type="text/html", headers=()):
+        self.send_response(code)
+        for name, value in headers:
+            self.send_header(name, value)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def reply_json(self, value):
+        self.reply(200, json.dumps(value).encode(), "application/json")
+
+    def ping(self, query):
+        """Answers after delay_ms, so a test can tell whether requests overlap"""
+        time.sleep(query_int(query, "delay_ms") / 1000)
+        self.reply_json({})
+
+    def do_GET(self):
+        url = urllib.parse.urlparse(self.path)
+        query = urllib.parse.parse_qs(url.query)
+        path = url.path
+
+        if path == "/accounts/login/":
+            self.reply(200, LOGIN_PAGE, headers=[("Set-Cookie", "csrftoken=stand-in-token; Path=/")])
+        elif path == "/assets/mine/json/":
+            self.reply_json({"assets": state.assets})
+        elif path.startswith("/data/assets/") and path.endswith("/position/add/"):
+            command, ok = state.report(int(path.split("/")[3]), {k: v[0] for k, v in query.items()})
+            if not ok:
+                self.reply(500, b"Server error")
+            elif command:
+                self.reply_json(command)
+            else:
+                self.reply(200, b"Continue")
+        elif path.startswith("/data/assets/") and path.endswith("/position/ack/"):
+            self.reply_json({"stored": state.stored(int(path.split("/")[3]), query_int(query, "since"))})
+        elif path == "/search/find/closest/":
+            self.reply_json(search_summary(99, 5000))
+        elif path.startswith("/search/") and path.endswith("/json/"):
+            with state.lock:
+                search = state.searches.get(int(path.split("/")[2]))
+                geojson = search.geojson() if search else None
+            if geojson:
+                self.reply_json(geojson)
+            else:
+                self.reply(404, b"Not found")
+        elif path.startswith("/search/") and path.endswith("/delta/"):
+            with state.lock:
+                search = state.searches.get(int(path.split("/")[2]))
+                delta = search.delta(query_int(query, "since")) if search else None
+            if delta:
+                self.reply_json(delta)
+            else:
+                self.reply(404, b"Not found")
+        elif path.startswith("/search/") and (path.endswith("/begin/") or path.endswith("/finished/")):
+            with state.lock:
+                known = int(path.split("/")[2]) in state.searches
+            if known:
+                self.reply_json({})
+            else:
+                self.reply(404, b"Not found")
+        elif path == "/data/assets/positions/feed/":
+            self.reply_json(state.feed(query_int(query, "since")))
+        elif path == "/test/ping/":
+            self.ping(query)
+        elif path == "/test/command/":
+            command = {k: v[0] for k, v in query.items() if k != "asset_id"}
+            for key in ("latitude", "longitude"):
+                if key in command:
+                    command[key] = float(command[key])
+            if "search" in command:
+                command["search"] = search_summary(int(command["search"]), 100)
+            with state.lock:
+                state.commands[query_int(query, "asset_id")] = command
+            self.reply_json({})
+        elif path == "/test/search/":
+            with state.lock:
+                state.searches[query_int(query, "id")] = Search(parse_coordinates(query["coordinates"][0]))
+            self.reply_json({})
+        elif path == "/test/search/change/":
+            with state.lock:
+                state.searches[query_int(query, "id")].change(
+                    query_int(query, "start"), query_int(query, "remove"), parse_coordinates(query.get("coordinates", [""])[0])
+                )
+            self.reply_json({})
+        elif path == "/test/search/corrupt/":
+            with state.lock:
+                state.searches[query_int(query, "id")].corrupt()
+            self.reply_json({})
+        elif path == "/test/probes/":
+            # Answer 409 unless count HEAD requests have been seen
+            with state.lock:
+                probes = state.probes
+            self.reply(200 if probes == query_int(query, "count") else 409, str(probes).encode())
+        elif path == "/test/fail/":
+            with state.lock:
+                state.fail_reports = query_int(query, "reports")
+            self.reply_json({})
+        elif path == "/test/assets/":
+            with state.lock:
+                state.assets = [
+                    {"id": i, "type_id": 1, "name": "Asset %d" % i, "type_name": "Helicopter"}
+                    for i in range(1, query_int(query, "count") + 1)
+                ]
+            self.reply_json({})
+        elif path == "/test/batch/":
+            with state.lock:
+                state.batch_unsupported = query_int(query, "unsupported") != 0
+            self.reply_json({})
+        elif path == "/test/lose/":
+            with state.lock:
+                state.lose_reports = query_int(query, "reports")
+            self.reply_json({})
+        elif path == "/test/positions/":
+            with state.lock:
+                positions = list(state.positions.get(query_int(query, "asset_id"), []))
+            # With count, answer 409 unless that is how many are stored
+            if "count" in query and len(positions) != query_int(query, "count"):
+                self.reply(409, json.dumps(positions).encode(), "application/json")
+            else:
+                self.reply_json(positions)
+        elif path == "/test/peer/":
+            state.move_peer(
+                {
+                    "asset_id": query_int(query, "asset_id"),
+                    "lat": query_float(query, "lat"),
+                    "lon": query_float(query, "lon"),
+                    "alt": query_int(query, "alt"),
+                    "bearing": query_int(query, "bearing"),
+                    "fix": query_int(query, "fix", 3),
+                    "timestamp": query_float(query, "timestamp"),
+                }
+            )
+            self.reply_json({})
+        elif path == "/test/peer/remove/":
+            state.remove_peer(query_int(query, "asset_id"))
+            self.reply_json({})
+        else:
+            self.reply(404, b"Not found")
+
+    def report_batch(self, body):
+        """positions=asset,time,lat,lon,alt,bearing,fix,seq;... answered with an entry per fix taken"""
+        entries = []
+        for row in body.get("positions", [""])[0].split(";"):
+            if not row:
+                continue
+            asset_id, time_ms, lat, lon, alt, bearing, fix, seq = row.split(",")
+            position = {"lat": lat, "lon": lon, "alt": alt, "bearing": bearing, "fix": fix, "time": time_ms, "seq": seq}
+            command, ok = state.report(int(asset_id), position)
+            if ok:
+                entries.append(dict(command or {}, asset=int(asset_id), seq=int(seq)))
+        self.reply_json({"positions": entries})
+
+    def report_bulk(self, asset_id, body):
+        """positions=time,lat,lon,alt,bearing,fix,seq;... all stored, though the reply may still be lost"""
+        ok = True
+        for row in body.get("positions", [""])[0].split(";"):
+            if not row:
+                continue
+            time_ms, lat, lon, alt, bearing, fix, seq = row.split(",")
+            position = {"lat": lat, "lon": lon, "alt": alt, "bearing": bearing, "fix": fix, "time": time_ms, "seq": seq}
+            ok = state.report(asset_id, position)[1] and ok
+        if ok:
+            self.reply_json({})
+        else:
+            self.reply(500, b"Server error")
+
+    def do_HEAD(self):
+        """Keep warm probes only ask for the headers, of a page too big to want"""
+        with state.lock:
+            state.probes += 1
+        self.send_response(200)
+        self.send_header("Content-Type", "text/html")
+        self.send_header("Content-Length", str(1 << 20))
+        self.end_headers()
+
+    def do_POST(self):
+        url = urllib.parse.urlparse(self.path)
+        length = int(self.headers.get("Content-Length", 0))
+        body = urllib.parse.parse_qs(self.rfile.read(length).decode())
+
+        if url.path == "/accounts/login/":
+            if body.get("csrfmiddlewaretoken") and body.get("username") and body.get("password"):
+                self.reply(302, headers=[("Location", "/"), ("Set-Cookie", "sessionid=stand-in-session; Path=/")])
+            else:
+                self.reply(200, LOGIN_PAGE)
+        elif url.path == "/data/assets/commands/":
+            assets = [int(a) for a in body.get("assets", [""])[0].split(",") if a]
+            with state.lock:
+                commands = [dict(state.commands[a], asset=a) for a in assets if a in state.commands]
+            self.reply_json({"commands": commands})
+        elif url.path.startswith("/data/assets/") and url.path.endswith("/position/add/bulk/"):
+            self.report_bulk(int(url.path.split("/")[3]), body)
+        elif url.path == "/data/assets/positions/add/":
+            if state.batch_unsupported:
+                self.reply(404, b"Not found")
+            else:
+                self.report_batch(body)
+        elif url.path == "/test/ping/":
+            self.ping(urllib.parse.parse_qs(url.query))
+        else:
+            self.reply(404, b"Not found")
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+    def handle_error(self, request, client_address):
+        # Clients hang up mid reply when the network changes under them
+        if not isinstance(sys.exc_info()[1], ConnectionError):
+            super().handle_error(request, client_address)
+
+
+def main():
+    server = Server(("127.0.0.1", 0), Handler)
+    print("port", server.server_address[1], flush=True)
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    sys.exit(main())
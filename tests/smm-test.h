@@ -0,0 +1,131 @@
+#pragma once
+
+/**
+ * smm-test.h, Helpers shared by the tests and benchmarks
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+
+/* make check skips a test that exits with this */
+#define SMM_TEST_SKIP 77
+
+#define SMM_TEST_CHECK(cond) do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			exit (1); \
+		} \
+	} \
+	while (0)
+
+/* Seconds on the monotonic clock, for timing benchmarks */
+static inline double
+smm_test_seconds (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+#if defined(PYTHON) && defined(STAND_IN)
+
+/**
+ * Start smm-stand-in.py and store its base url in url
+ * Exits with SMM_TEST_SKIP when there is no python to run it
+ *
+ * @return the pid of the server, for smm_test_stand_in_stop
+ */
+static inline pid_t
+smm_test_stand_in_start (char *url, size_t size)
+{
+	int fds[2];
+	int port = 0;
+
+	if (strcmp (PYTHON, ":") == 0 || pipe (fds) != 0)
+	{
+		exit (SMM_TEST_SKIP);
+	}
+	pid_t pid = fork ();
+	if (pid == 0)
+	{
+		dup2 (fds[1], STDOUT_FILENO);
+		close (fds[0]);
+		close (fds[1]);
+		execl (PYTHON, PYTHON, STAND_IN, (char *) NULL);
+		_exit (127);
+	}
+	close (fds[1]);
+	FILE *out = fdopen (fds[0], "r");
+	if (pid < 0 || out == NULL || fscanf (out, "port %d", &port) != 1)
+	{
+		exit (SMM_TEST_SKIP);
+	}
+	fclose (out);
+	snprintf (url, size, "http://127.0.0.1:%d", port);
+	return pid;
+}
+
+static inline void
+smm_test_stand_in_stop (pid_t pid)
+{
+	kill (pid, SIGTERM);
+	waitpid (pid, NULL, 0);
+}
+
+static inline size_t
+smm_test_discard (char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	(void) ptr;
+	(void) userdata;
+	return size * nmemb;
+}
+
+/* Fetch a page of the stand-in server directly, to set up its state */
+static inline void
+smm_test_stand_in_get (const char *url, const char *path)
+{
+	char *full = NULL;
+	long httpcode = 0;
+
+	SMM_TEST_CHECK (asprintf (&full, "%s%s", url, path) >= 0);
+	CURL *curl = curl_easy_init ();
+	SMM_TEST_CHECK (curl != NULL);
+	curl_easy_setopt (curl, CURLOPT_URL, full);
+	curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, smm_test_discard);
+	SMM_TEST_CHECK (curl_easy_perform (curl) == CURLE_OK);
+	curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &httpcode);
+	SMM_TEST_CHECK (httpcode == 200);
+	curl_easy_cleanup (curl);
+	free (full);
+}
+
+#endif
@@ -0,0 +1,96 @@
+/**
+ * test-commands.c, Check command callbacks and asset lifetimes against the stand-in server
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-test.h"
+
+struct notified
+{
+	size_t calls;
+	smm_asset asset;
+	smm_asset_command command;
+};
+
+static void
+command_changed (void *data, smm_asset asset, smm_asset_command command)
+{
+	struct notified *notified = data;
+	notified->calls++;
+	notified->asset = asset;
+	notified->command = command;
+}
+
+static smm_asset
+find_asset (smm_assets assets, size_t assets_count, const char *name)
+{
+	for (size_t i = 0; i < assets_count; i++)
+	{
+		if (strcmp (smm_asset_name (assets[i]), name) == 0)
+		{
+			return assets[i];
+		}
+	}
+	return NULL;
+}
+
+int
+main (void)
+{
+	char url[64];
+	struct notified notified = { 0, NULL, SMM_COMMAND_NONE };
+	smm_assets assets = NULL;
+	size_t assets_count = 0;
+	double lat = 0.0;
+	double lon = 0.0;
+
+	alarm (30);
+
+	pid_t server = smm_test_stand_in_start (url, sizeof (url));
+	smm_connection conn = smm_asset_connect (url, "user", "pass");
+	SMM_TEST_CHECK (smm_asset_connection_get_state (conn) == SMM_CONNECTION_CONNECTED);
+	SMM_TEST_CHECK (smm_asset_get_assets (conn, &assets, &assets_count));
+	SMM_TEST_CHECK (assets_count == 2);
+	smm_asset rescue = find_asset (assets, assets_count, "Rescue 1");
+	smm_asset alpha = find_asset (assets, assets_count, "Alpha 2");
+	SMM_TEST_CHECK (rescue != NULL && alpha != NULL);
+	smm_connection_set_command_callback (conn, command_changed, &notified);
+
+	/* Only the asset the server has a command for is updated */
+	smm_test_stand_in_get (url, "/test/command/?asset_id=1&action=GOTO&latitude=-43.5&longitude=172.6");
+	SMM_TEST_CHECK (smm_connection_sync_commands (conn));
+	SMM_TEST_CHECK (notified.calls == 1 && notified.asset == rescue && notified.command == SMM_COMMAND_GOTO);
+	SMM_TEST_CHECK (smm_asset_last_goto_pos (rescue, &lat, &lon) && lat == -43.5 && lon == 172.6);
+	SMM_TEST_CHECK (smm_asset_last_command (alpha) == SMM_COMMAND_NONE);
+
+	/* A position report tells the same callback */
+	SMM_TEST_CHECK (smm_asset_report_position (alpha, -43.6, 172.7, 300, 90, 3));
+	SMM_TEST_CHECK (notified.calls == 2 && notified.asset == alpha && notified.command == SMM_COMMAND_CONTINUE);
+	smm_test_stand_in_get (url, "/test/command/?asset_id=2&action=RTL");
+	SMM_TEST_CHECK (smm_asset_report_position (alpha, -43.6, 172.7, 300, 90, 3));
+	SMM_TEST_CHECK (notified.calls == 3 && notified.command == SMM_COMMAND_RTL);
+
+	/* Assets outlive the connection */
+	smm_connection_close (conn);
+	smm_asset_free_assets (assets, assets_count);
+	smm_test_stand_in_stop (server);
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+/**
+ * test-gps.c, Check NMEA sentences are assembled into fixes
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-test.h"
+
+#include <math.h>
+
+#define DAY_MS 86400000ULL
+
+static void
+feed (smm_gps_source source, const char *data)
+{
+	SMM_TEST_CHECK (smm_gps_source_feed (source, data, strlen (data)));
+}
+
+static bool
+near (double a, double b)
+{
+	return fabs (a - b) < 1e-6;
+}
+
+/* Sentences with a bad checksum or too short to be one are dropped */
+static void
+test_checksum (void)
+{
+	smm_fix fix;
+	smm_gps_source source = smm_gps_source_create (NULL, 0);
+	SMM_TEST_CHECK (source != NULL);
+
+	feed (source, "$GPGGA,123519.00,4330.000,S,17236.000,E,1,08,0.9,545.4,M,46.9,M,,*00\r\n");
+	feed (source, "$GPRMC,123519.00,A,4330.000,S,17236.000,E,022.4,084.4,230394,003.1,W*5F\r\n");
+	feed (source, "$GP*\r\n");
+	feed (source, "$GPGGA,123520.00,4330.000,S,17236.000,E,1,08,0.9,545.4,M,46.9,M,,*7\r\n");
+	SMM_TEST_CHECK (!smm_gps_source_last_fix (source, &fix));
+
+	smm_gps_source_close (source);
+}
+
+/* GGA and RMC with the same time make one fix, however the bytes arrive */
+static void
+test_epoch (void)
+{
+	const char *data = "$GPGGA,123519.00,4330.000,S,17236.000,E,1,08,0.9,545.4,M,46.9,M,,*73\r\n"
+		"$GPRMC,123519.00,A,4330.000,S,17236.000,E,022.4,084.4,230394,003.1,W*5E\r\n";
+	smm_fix fix;
+	smm_gps_source source = smm_gps_source_create (NULL, 0);
+	SMM_TEST_CHECK (source != NULL);
+
+	for (size_t i = 0; data[i]; i++)
+	{
+		SMM_TEST_CHECK (smm_gps_source_feed (source, &data[i], 1));
+	}
+	SMM_TEST_CHECK (smm_gps_source_last_fix (source, &fix));
+	SMM_TEST_CHECK (fix.time_ms == 764426119000ULL);
+	SMM_TEST_CHECK (near (fix.lat, -43.5) && near (fix.lon, 172.6));
+	SMM_TEST_CHECK (fix.altitude == 545 && fix.bearing == 84 && fix.fix == 3);
+	SMM_TEST_CHECK (fabs (fix.speed - 22.4 * 0.514444) < 1e-3);
+
+	smm_gps_source_close (source);
+}
+
+/* Epochs without RMC carry the last date forward, across midnight too */
+static void
+test_midnight (void)
+{
+	smm_fix fix;
+	smm_gps_source source = smm_gps_source_create (NULL, 0);
+	SMM_TEST_CHECK (source != NULL);
+
+	feed (source, "$GNGGA,235959.50,4330.000,S,17236.000,E,1,08,0.9,100.0,M,46.9,M,,*65\r\n");
+	feed (source, "$GNRMC,235959.50,A,4330.000,S,17236.000,E,000.0,000.0,311219,,*38\r\n");
+	SMM_TEST_CHECK (smm_gps_source_last_fix (source, &fix));
+	SMM_TEST_CHECK (fix.time_ms == 1577836799500ULL);
+
+	/* A GGA only epoch is complete once the next one starts */
+	feed (source, "$GNGGA,000000.50,4331.000,S,17236.000,E,1,08,0.9,100.0,M,46.9,M,,*65\r\n");
+	feed (source, "$GNGGA,000001.50,4332.000,S,17236.000,E,1,08,0.9,100.0,M,46.9,M,,*67\r\n");
+	SMM_TEST_CHECK (smm_gps_source_last_fix (source, &fix));
+	SMM_TEST_CHECK (fix.time_ms == 1577836800500ULL && near (fix.lat, -43.5 - 1.0 / 60));
+
+	/* Without a valid status and quality there is no new fix */
+	feed (source, "$GPRMC,120000.00,V,4330.000,S,17236.000,E,000.0,000.0,230394,,*30\r\n");
+	feed (source, "$GPGGA,120000.00,4330.000,S,17236.000,E,0,00,,,M,,M,,*68\r\n");
+	SMM_TEST_CHECK (smm_gps_source_last_fix (source, &fix));
+	SMM_TEST_CHECK (fix.time_ms == 1577836801500ULL && near (fix.lat, -43.5 - 2.0 / 60));
+
+	smm_gps_source_close (source);
+}
+
+/* Until the receiver sends a date the host's is used */
+static void
+test_host_date (void)
+{
+	smm_fix fix;
+	smm_gps_source source = smm_gps_source_create (NULL, 0);
+	SMM_TEST_CHECK (source != NULL);
+
+	feed (source, "$GPGGA,123519.00,4330.000,S,17236.000,E,1,08,0.9,545.4,M,46.9,M,,*73\r\n");
+	feed (source, "$GPRMC,123519.00,A,4330.000,S,17236.000,E,022.4,084.4,,003.1,W*51\r\n");
+	SMM_TEST_CHECK (smm_gps_source_last_fix (source, &fix));
+
+	uint64_t now_ms = (uint64_t) time (NULL) * 1000;
+	uint64_t distance = fix.time_ms > now_ms ? fix.time_ms - now_ms : now_ms - fix.time_ms;
+	SMM_TEST_CHECK (fix.time_ms % DAY_MS == 45319000 && distance <= DAY_MS / 2 + 1000);
+
+	smm_gps_source_close (source);
+}
+
+int
+main (void)
+{
+	test_checksum ();
+	test_epoch ();
+	test_midnight ();
+	test_host_date ();
+
+	return 0;
+}
@@ -0,0 +1,125 @@
+/**
+ * test-peers.c, Check the peer feed and its callbacks against the stand-in server
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-test.h"
+
+struct changes
+{
+	smm_peer_feed feed;
+	size_t updated;
+	size_t removed;
+	size_t found;
+};
+
+/* Reads the feed from inside the callback, which used to deadlock */
+static void
+feed_changed (void *data, const smm_peer * peer, bool removed)
+{
+	struct changes *changes = data;
+	smm_peer found;
+
+	if (removed)
+	{
+		changes->removed++;
+		SMM_TEST_CHECK (!smm_peer_feed_find (changes->feed, peer->asset_id, &found));
+	}
+	else
+	{
+		changes->updated++;
+		if (smm_peer_feed_find (changes->feed, peer->asset_id, &found) && found.lat == peer->lat)
+		{
+			changes->found++;
+		}
+	}
+}
+
+int
+main (void)
+{
+	char url[64];
+	struct changes changes = { NULL, 0, 0, 0 };
+	smm_peer peer;
+
+	/* A deadlock fails the test instead of hanging it */
+	alarm (30);
+
+	pid_t server = smm_test_stand_in_start (url, sizeof (url));
+	smm_test_stand_in_get (url, "/test/peer/?asset_id=1&lat=-43.5&lon=172.6&timestamp=100");
+	smm_test_stand_in_get (url, "/test/peer/?asset_id=2&lat=-43.6&lon=172.7&timestamp=100");
+	smm_test_stand_in_get (url, "/test/peer/?asset_id=3&lat=-43.7&lon=172.8&timestamp=100");
+
+	smm_connection conn = smm_asset_connect (url, "user", "pass");
+	SMM_TEST_CHECK (conn != NULL);
+	SMM_TEST_CHECK (smm_asset_connection_get_state (conn) == SMM_CONNECTION_CONNECTED);
+
+	changes.feed = smm_connection_peer_feed (conn);
+	SMM_TEST_CHECK (changes.feed != NULL);
+	smm_peer_feed_set_callback (changes.feed, feed_changed, &changes);
+
+	SMM_TEST_CHECK (smm_peer_feed_sync (changes.feed));
+	SMM_TEST_CHECK (smm_peer_feed_count (changes.feed) == 3);
+	SMM_TEST_CHECK (changes.updated == 3 && changes.found == 3 && changes.removed == 0);
+
+	/* One moves, one leaves, only those two are sent */
+	smm_test_stand_in_get (url, "/test/peer/?asset_id=2&lat=-43.61&lon=172.7&timestamp=110");
+	smm_test_stand_in_get (url, "/test/peer/remove/?asset_id=3");
+	SMM_TEST_CHECK (smm_peer_feed_sync (changes.feed));
+	SMM_TEST_CHECK (smm_peer_feed_count (changes.feed) == 2);
+	SMM_TEST_CHECK (changes.updated == 4 && changes.found == 4 && changes.removed == 1);
+
+	SMM_TEST_CHECK (smm_peer_feed_find (changes.feed, 2, &peer));
+	SMM_TEST_CHECK (peer.lat == -43.61 && peer.time_ms == 110000);
+	SMM_TEST_CHECK (peer.velocity_north < 0.0f);
+
+	/* A row older than the one we have is ignored, and the peer is kept */
+	smm_test_stand_in_get (url, "/test/peer/?asset_id=2&lat=-43.9&lon=172.7&timestamp=105");
+	SMM_TEST_CHECK (smm_peer_feed_sync (changes.feed));
+	SMM_TEST_CHECK (smm_peer_feed_count (changes.feed) == 2 && changes.updated == 4);
+	SMM_TEST_CHECK (smm_peer_feed_find (changes.feed, 2, &peer));
+	SMM_TEST_CHECK (peer.lat == -43.61 && peer.time_ms == 110000);
+
+	/* The index loads the feed, and the application's callback keeps getting changes */
+	smm_proximity proximity = smm_proximity_create (-43.5, 1000.0);
+	SMM_TEST_CHECK (proximity != NULL);
+	smm_proximity_attach (proximity, changes.feed);
+	SMM_TEST_CHECK (changes.updated == 4);
+	smm_test_stand_in_get (url, "/test/peer/?asset_id=4&lat=-43.5&lon=172.601&timestamp=120");
+	SMM_TEST_CHECK (smm_peer_feed_sync (changes.feed));
+	SMM_TEST_CHECK (changes.updated == 5 && changes.found == 5);
+
+	smm_fix own = { .lat = -43.5, .lon = 172.6 };
+	smm_proximity_hit hits[4];
+	SMM_TEST_CHECK (smm_proximity_query (proximity, &own, 500.0, hits, 4) == 2);
+	SMM_TEST_CHECK (hits[0].asset_id == 1 && hits[1].asset_id == 4);
+
+	/* Detaching puts the application's callback back */
+	smm_proximity_destroy (proximity);
+	smm_test_stand_in_get (url, "/test/peer/remove/?asset_id=4");
+	SMM_TEST_CHECK (smm_peer_feed_sync (changes.feed));
+	SMM_TEST_CHECK (changes.removed == 2);
+
+	smm_peer_feed_destroy (changes.feed);
+	smm_connection_close (conn);
+	smm_test_stand_in_stop (server);
+
+	return 0;
+}
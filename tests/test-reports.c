@@ -0,0 +1,158 @@
+/**
+ * test-reports.c, Check position reports against the stand-in server
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+#include "smm-test.h"
+
+/* The stand-in offers hints 100 m away, and a closest search 5 km away */
+#define HINT_DISTANCE 100
+#define CLOSEST_DISTANCE 5000
+
+static void
+test_search_hint (const char *url, smm_asset asset)
+{
+	/* A hint in the reply is used without asking the server */
+	smm_test_stand_in_get (url, "/test/command/?asset_id=1&action=RON&search=5");
+	SMM_TEST_CHECK (smm_asset_report_position (asset, -43.5, 172.6, 300, 90, 3));
+	smm_search search = smm_asset_get_search (asset, -43.5, 172.6);
+	SMM_TEST_CHECK (search != NULL && smm_search_distance (search) == HINT_DISTANCE);
+	smm_search_destroy (search);
+
+	/* A failed report still drops the hint it replaces */
+	SMM_TEST_CHECK (smm_asset_report_position (asset, -43.5, 172.6, 300, 90, 3));
+	smm_test_stand_in_get (url, "/test/fail/?reports=1");
+	SMM_TEST_CHECK (!smm_asset_report_position (asset, -43.5, 172.6, 300, 90, 3));
+	search = smm_asset_get_search (asset, -43.5, 172.6);
+	SMM_TEST_CHECK (search != NULL && smm_search_distance (search) == CLOSEST_DISTANCE);
+	smm_search_destroy (search);
+}
+
+/* A report whose reply was lost isn't stored twice, and a restart never reuses a seq */
+static void
+test_seq (const char *url, smm_connection conn, smm_asset asset)
+{
+	char state[] = "/tmp/test-reports-XXXXXX";
+	smm_assets restored = NULL;
+	size_t restored_count = 0;
+	uint64_t acked = 0;
+	uint64_t restored_acked = 0;
+
+	/* Numbered from a clock that has since been set back a long way */
+	asset->report_seq += 1000000000000ULL;
+
+	smm_test_stand_in_get (url, "/test/lose/?reports=1");
+	SMM_TEST_CHECK (!smm_asset_report_position (asset, -43.5, 172.6, 300, 90, 3));
+	SMM_TEST_CHECK (smm_asset_pending_reports (asset, NULL, NULL) == 1);
+	SMM_TEST_CHECK (smm_asset_replay_reports (asset));
+	SMM_TEST_CHECK (smm_asset_pending_reports (asset, &acked, NULL) == 0);
+	smm_test_stand_in_get (url, "/test/positions/?asset_id=2&count=1");
+
+	int fd = mkstemp (state);
+	SMM_TEST_CHECK (fd >= 0);
+	close (fd);
+	SMM_TEST_CHECK (smm_connection_save_state (conn, state));
+	smm_connection restored_conn = smm_asset_connect (url, "user", "pass");
+	SMM_TEST_CHECK (smm_connection_restore_state (restored_conn, state, &restored, &restored_count));
+	SMM_TEST_CHECK (restored_count == 2 && restored[1]->asset_id == 2);
+	SMM_TEST_CHECK (smm_asset_report_position (restored[1], -43.5, 172.6, 300, 90, 3));
+	smm_asset_pending_reports (restored[1], &restored_acked, NULL);
+	SMM_TEST_CHECK (restored_acked > acked);
+	smm_test_stand_in_get (url, "/test/positions/?asset_id=2&count=2");
+
+	smm_asset_free_assets (restored, restored_count);
+	smm_connection_close (restored_conn);
+	unlink (state);
+}
+
+/* A chunk resent after its reply was lost isn't stored twice */
+static void
+test_backfill (const char *url, smm_asset asset)
+{
+	SMM_TEST_CHECK (smm_asset_track_enable (asset, true));
+	SMM_TEST_CHECK (smm_asset_report_position (asset, -43.5, 172.6, 300, 90, 3));
+	SMM_TEST_CHECK (smm_asset_report_position (asset, -43.51, 172.6, 300, 90, 3));
+	SMM_TEST_CHECK (smm_asset_report_position (asset, -43.51, 172.61, 300, 90, 3));
+	smm_backfill backfill = smm_asset_backfill_create (asset, 0, UINT64_MAX, 0.0, 0.0);
+	SMM_TEST_CHECK (backfill != NULL && smm_backfill_remaining (backfill) == 3);
+
+	smm_test_stand_in_get (url, "/test/lose/?reports=1");
+	SMM_TEST_CHECK (!smm_backfill_send (backfill, 0));
+	SMM_TEST_CHECK (smm_backfill_send (backfill, 0));
+	SMM_TEST_CHECK (smm_backfill_remaining (backfill) == 0);
+	smm_test_stand_in_get (url, "/test/positions/?asset_id=1&count=6");
+
+	smm_backfill_destroy (backfill);
+	SMM_TEST_CHECK (smm_asset_track_enable (asset, false));
+}
+
+/* Two fixes for the same asset with the first refused, only their seqs tell the replies apart */
+static void
+test_batch (const char *url, smm_assets assets)
+{
+	struct smm_asset_s *batch[3] = { assets[0], assets[0], assets[1] };
+	smm_fix fixes[3] = {
+		{ .time_ms = 1000, .lat = -43.5, .lon = 172.6, .fix = 3 },
+		{ .time_ms = 2000, .lat = -43.51, .lon = 172.6, .fix = 3 },
+		{ .time_ms = 2000, .lat = -43.6, .lon = 172.7, .fix = 3 },
+	};
+	bool reported[3];
+
+	smm_test_stand_in_get (url, "/test/command/?asset_id=2&action=RTL");
+	smm_test_stand_in_get (url, "/test/fail/?reports=1");
+	SMM_TEST_CHECK (!smm_assets_report_positions (batch, fixes, 3, reported));
+	SMM_TEST_CHECK (!reported[0] && reported[1] && reported[2]);
+	SMM_TEST_CHECK (smm_asset_last_command (assets[1]) == SMM_COMMAND_RTL);
+
+	/* Without the endpoint every fix still goes, one at a time */
+	smm_test_stand_in_get (url, "/test/batch/?unsupported=1");
+	smm_test_stand_in_get (url, "/test/command/?asset_id=2&action=CIR");
+	SMM_TEST_CHECK (smm_assets_report_positions (batch, fixes, 3, reported));
+	SMM_TEST_CHECK (reported[0] && reported[1] && reported[2]);
+	SMM_TEST_CHECK (smm_asset_last_command (assets[1]) == SMM_COMMAND_CIRCLE);
+}
+
+int
+main (void)
+{
+	char url[64];
+	smm_assets assets = NULL;
+	size_t assets_count = 0;
+
+	alarm (30);
+
+	pid_t server = smm_test_stand_in_start (url, sizeof (url));
+	smm_connection conn = smm_asset_connect (url, "user", "pass");
+	SMM_TEST_CHECK (smm_asset_connection_get_state (conn) == SMM_CONNECTION_CONNECTED);
+	SMM_TEST_CHECK (smm_asset_get_assets (conn, &assets, &assets_count));
+	SMM_TEST_CHECK (assets_count == 2);
+
+	test_backfill (url, assets[0]);
+	test_search_hint (url, assets[0]);
+	test_seq (url, conn, assets[1]);
+	test_batch (url, assets);
+
+	smm_asset_free_assets (assets, assets_count);
+	smm_connection_close (conn);
+	smm_test_stand_in_stop (server);
+
+	return 0;
+}
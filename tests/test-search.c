@@ -0,0 +1,225 @@
+/**
+ * test-search.c, Check search geometry updates against the stand-in server
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+#include "smm-test.h"
+
+#include <pthread.h>
+
+struct changed
+{
+	size_t calls;
+	size_t first_leg;
+	size_t old_legs;
+	size_t new_legs;
+};
+
+static void
+search_changed (void *data, smm_search search, size_t first_leg, size_t old_legs, size_t new_legs)
+{
+	struct changed *changed = data;
+	(void) search;
+	changed->calls++;
+	changed->first_leg = first_leg;
+	changed->old_legs = old_legs;
+	changed->new_legs = new_legs;
+}
+
+/* Get search 7 through a hint, as the server would offer it */
+static smm_search
+get_search (const char *url, smm_asset asset)
+{
+	smm_test_stand_in_get (url, "/test/command/?asset_id=1&action=RON&search=7");
+	SMM_TEST_CHECK (smm_asset_report_position (asset, -43.5, 172.6, 300, 90, 3));
+	smm_search search = smm_asset_get_search (asset, -43.5, 172.6);
+	SMM_TEST_CHECK (search != NULL);
+	return search;
+}
+
+static void
+test_delta (const char *url, smm_asset asset)
+{
+	struct smm_waypoint_s *waypoints = NULL;
+	size_t waypoints_count = 0;
+	struct changed changed = { 0, 0, 0, 0 };
+
+	smm_test_stand_in_get (url, "/test/search/?id=7&coordinates=172.5,-43.5;172.6,-43.5;172.6,-43.6;172.5,-43.6");
+	smm_search search = get_search (url, asset);
+	smm_search_set_change_callback (search, search_changed, &changed);
+	SMM_TEST_CHECK (smm_search_get_waypoint_array (search, &waypoints, &waypoints_count));
+	SMM_TEST_CHECK (waypoints_count == 4 && smm_search_version (search) == 1);
+	smm_waypoint_array_free (waypoints);
+
+	/* Whole degrees arrive as JSON integers */
+	smm_test_stand_in_get (url, "/test/search/change/?id=7&start=1&remove=2&coordinates=173,-44");
+	SMM_TEST_CHECK (smm_search_update (search));
+	SMM_TEST_CHECK (smm_search_version (search) == 2);
+	SMM_TEST_CHECK (changed.calls == 1 && changed.first_leg == 0 && changed.old_legs == 3 && changed.new_legs == 2);
+	SMM_TEST_CHECK (smm_search_get_waypoint_array (search, &waypoints, &waypoints_count));
+	SMM_TEST_CHECK (waypoints_count == 3);
+	SMM_TEST_CHECK (waypoints[1].lat == -44.0 && waypoints[1].lon == 173.0);
+	SMM_TEST_CHECK (waypoints[2].lat == -43.6 && waypoints[2].lon == 172.5);
+	smm_waypoint_array_free (waypoints);
+
+	/* The features were indexed in the old body, they come from a new one at the new precision */
+	struct smm_waypoint_s point;
+	SMM_TEST_CHECK (smm_search_set_precision (search, SMM_PRECISION_FIXED));
+	SMM_TEST_CHECK (smm_search_features (search) == 1);
+	SMM_TEST_CHECK (smm_search_feature_point (search, 0, 0, 1, &point));
+	SMM_TEST_CHECK (point.lat == -44.0 && point.lon == 173.0);
+	SMM_TEST_CHECK (!smm_search_feature_point (search, 0, 0, 3, &point));
+
+	/* Fetching a body for the features keeps the patched waypoints, the change still arrives as a delta */
+	smm_test_stand_in_get (url, "/test/search/change/?id=7&start=3&remove=0&coordinates=172.4,-43.6");
+	SMM_TEST_CHECK (smm_search_update (search));
+	SMM_TEST_CHECK (changed.calls == 2);
+	smm_test_stand_in_get (url, "/test/search/change/?id=7&start=4&remove=0&coordinates=172.4,-43.5");
+	SMM_TEST_CHECK (smm_search_features (search) == 1);
+	SMM_TEST_CHECK (smm_search_get_waypoint_array (search, &waypoints, &waypoints_count));
+	SMM_TEST_CHECK (waypoints_count == 4 && smm_search_version (search) == 3);
+	smm_waypoint_array_free (waypoints);
+	SMM_TEST_CHECK (smm_search_update (search));
+	SMM_TEST_CHECK (changed.calls == 3 && changed.first_leg == 3 && changed.old_legs == 0 && changed.new_legs == 1);
+	SMM_TEST_CHECK (smm_search_version (search) == 4);
+
+	/* Nothing new is nothing to do */
+	SMM_TEST_CHECK (smm_search_update (search));
+	SMM_TEST_CHECK (changed.calls == 3);
+
+	/* A change that can't apply, with no body to reload, leaves the waypoints as they were */
+	smm_test_stand_in_get (url, "/test/search/change/?id=7&start=0&remove=1&coordinates=172.3,-43.4");
+	smm_test_stand_in_get (url, "/test/search/corrupt/?id=7");
+	SMM_TEST_CHECK (!smm_search_update (search));
+	SMM_TEST_CHECK (changed.calls == 3 && smm_search_version (search) == 4);
+	SMM_TEST_CHECK (smm_search_get_waypoint_array (search, &waypoints, &waypoints_count));
+	SMM_TEST_CHECK (waypoints_count == 5 && waypoints[0].lat == -43.5 && waypoints[0].lon == 172.5);
+	smm_waypoint_array_free (waypoints);
+
+	smm_search_destroy (search);
+}
+
+struct reader
+{
+	smm_search search;
+	pthread_barrier_t step;
+};
+
+/* Hold a snapshot across an update, then let it go */
+static void *
+reader_run (void *data)
+{
+	struct reader *reader = data;
+	smm_geometry_reader geometry_reader = smm_search_reader_register (reader->search);
+	SMM_TEST_CHECK (geometry_reader != NULL);
+	const smm_geometry *held = smm_search_geometry (reader->search);
+	SMM_TEST_CHECK (held != NULL && held->version == 1 && held->waypoints_count == 4);
+	pthread_barrier_wait (&reader->step);
+
+	/* The update has published a new snapshot */
+	pthread_barrier_wait (&reader->step);
+	SMM_TEST_CHECK (smm_search_geometry (reader->search) != held);
+	SMM_TEST_CHECK (held->version == 1 && held->waypoints_count == 4);
+	SMM_TEST_CHECK (held->waypoints[1].lat == -43.5 && held->waypoints[1].lon == 172.6);
+	smm_geometry_reader_quiescent (geometry_reader);
+	pthread_barrier_wait (&reader->step);
+
+	/* The old snapshot has been reclaimed */
+	pthread_barrier_wait (&reader->step);
+	smm_geometry_reader_unregister (geometry_reader);
+	return NULL;
+}
+
+/* A replaced snapshot isn't freed until every reader has been quiescent */
+static void
+test_readers (const char *url, smm_asset asset)
+{
+	struct smm_waypoint_s *waypoints = NULL;
+	size_t waypoints_count = 0;
+	struct reader reader;
+	pthread_t thread;
+
+	smm_test_stand_in_get (url, "/test/search/?id=7&coordinates=172.5,-43.5;172.6,-43.5;172.6,-43.6;172.5,-43.6");
+	reader.search = get_search (url, asset);
+	SMM_TEST_CHECK (smm_search_get_waypoint_array (reader.search, &waypoints, &waypoints_count));
+	smm_waypoint_array_free (waypoints);
+	SMM_TEST_CHECK (pthread_barrier_init (&reader.step, NULL, 2) == 0);
+	SMM_TEST_CHECK (pthread_create (&thread, NULL, reader_run, &reader) == 0);
+	pthread_barrier_wait (&reader.step);
+
+	smm_test_stand_in_get (url, "/test/search/change/?id=7&start=1&remove=2&coordinates=173,-44");
+	SMM_TEST_CHECK (smm_search_update (reader.search));
+	SMM_TEST_CHECK (smm_search_geometry (reader.search)->version == 2);
+	SMM_TEST_CHECK (reader.search->retired != NULL);
+	smm_search_reclaim (reader.search);
+	SMM_TEST_CHECK (reader.search->retired != NULL);
+	pthread_barrier_wait (&reader.step);
+
+	pthread_barrier_wait (&reader.step);
+	smm_search_reclaim (reader.search);
+	SMM_TEST_CHECK (reader.search->retired == NULL);
+	pthread_barrier_wait (&reader.step);
+
+	SMM_TEST_CHECK (pthread_join (thread, NULL) == 0);
+	pthread_barrier_destroy (&reader.step);
+	smm_search_destroy (reader.search);
+}
+
+/* An accepted search may outlive its asset */
+static void
+test_accepted (const char *url, smm_connection conn)
+{
+	smm_assets assets = NULL;
+	size_t assets_count = 0;
+
+	SMM_TEST_CHECK (smm_asset_get_assets (conn, &assets, &assets_count));
+	smm_search search = get_search (url, assets[0]);
+	SMM_TEST_CHECK (smm_search_accept (search));
+	SMM_TEST_CHECK (smm_search_accepted (search));
+	smm_asset_free_assets (assets, assets_count);
+	smm_search_destroy (search);
+}
+
+int
+main (void)
+{
+	char url[64];
+	smm_assets assets = NULL;
+	size_t assets_count = 0;
+
+	alarm (30);
+
+	pid_t server = smm_test_stand_in_start (url, sizeof (url));
+	smm_connection conn = smm_asset_connect (url, "user", "pass");
+	SMM_TEST_CHECK (smm_asset_connection_get_state (conn) == SMM_CONNECTION_CONNECTED);
+	SMM_TEST_CHECK (smm_asset_get_assets (conn, &assets, &assets_count));
+	SMM_TEST_CHECK (assets_count == 2);
+
+	test_delta (url, assets[0]);
+	test_readers (url, assets[0]);
+	test_accepted (url, conn);
+
+	smm_asset_free_assets (assets, assets_count);
+	smm_connection_close (conn);
+	smm_test_stand_in_stop (server);
+
+	return 0;
+}
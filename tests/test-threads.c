@@ -0,0 +1,156 @@
+/**
+ * test-threads.c, Run requests from several threads at once against the stand-in server
+ *
+ * Copyright 2019 Canterbury Air Patrol Incorporated
+ *
+ * This file is part of libsmm-asset
+ *
+ * libsmm-asset is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "smm-asset.h"
+#include "smm-asset-internal.h"
+#include "smm-test.h"
+
+#include <pthread.h>
+
+#define THREADS 8
+#define REQUESTS 100
+
+/* The stand-in holds every request this long, only overlapping requests finish in time */
+#define PING "/test/ping/?delay_ms=10"
+#define SERIAL_SECONDS (THREADS * REQUESTS * 0.010)
+
+struct worker
+{
+	smm_connection conn;
+	pthread_t thread;
+	size_t index;
+	bool churn;
+	size_t ok;
+};
+
+/* GETs, POSTs, compact and raced requests, all through the same pools */
+static void *
+worker_run (void *data)
+{
+	struct worker *worker = data;
+
+	for (size_t i = 0; i < REQUESTS; i++)
+	{
+		struct buffer_s buf = { NULL, 0 };
+		unsigned int flags = i % 3 == 0 ? SMM_REQUEST_RACE : (i % 3 == 1 ? SMM_REQUEST_COMPACT : 0);
+		const char *post_data = i % 4 == 0 ? "ping=1" : NULL;
+		struct smm_curl_res_s *res = smm_connection_curl_request (worker->conn, PING, post_data, to_buffer, &buf, flags);
+		if (res && res->success && res->httpcode == 200 && buf.bytes == 2)
+		{
+			worker->ok++;
+		}
+		smm_curl_res_free (res);
+		free (buf.data);
+
+		if (worker->churn && i % 10 == worker->index)
+		{
+			/* Drop every pool while the other threads are mid request */
+			__atomic_add_fetch (&worker->conn->network_generation, 1, __ATOMIC_RELEASE);
+			smm_connection_keep_warm (worker->conn, i % 20 == worker->index ? 60000 : 0);
+			smm_connection_watch_network (worker->conn, i % 20 == worker->index);
+		}
+	}
+	return NULL;
+}
+
+static size_t
+run_workers (smm_connection conn, bool churn)
+{
+	struct worker workers[THREADS];
+	size_t ok = 0;
+
+	for (size_t i = 0; i < THREADS; i++)
+	{
+		workers[i] = (struct worker) { conn, 0, i, churn, 0 };
+		SMM_TEST_CHECK (pthread_create (&workers[i].thread, NULL, worker_run, &workers[i]) == 0);
+	}
+	for (size_t i = 0; i < THREADS; i++)
+	{
+		pthread_join (workers[i].thread, NULL);
+		ok += workers[i].ok;
+	}
+	return ok;
+}
+
+/* Every request made so far is counted, and a short buffer gets what fits */
+static void
+test_metrics (smm_connection conn)
+{
+	char buf[8192];
+	char small[16];
+
+	size_t len = smm_connection_metrics_render (conn, buf, sizeof (buf));
+	SMM_TEST_CHECK (len < sizeof (buf) && strlen (buf) == len);
+	const char *requests = strstr (buf, "\nsmm_requests_total ");
+	SMM_TEST_CHECK (requests != NULL && strtoull (requests + strlen ("\nsmm_requests_total "), NULL, 10) >= 2 * THREADS * REQUESTS);
+	SMM_TEST_CHECK (strstr (buf, "smm_request_duration_seconds_bucket{le=\"+Inf\"}") != NULL);
+	SMM_TEST_CHECK (len >= strlen ("# EOF\n") && strcmp (buf + len - strlen ("# EOF\n"), "# EOF\n") == 0);
+
+	SMM_TEST_CHECK (smm_connection_metrics_render (conn, small, sizeof (small)) == len);
+	SMM_TEST_CHECK (strlen (small) == sizeof (small) - 1 && strncmp (small, buf, sizeof (small) - 1) == 0);
+
+	/* Only one listener per connection */
+	SMM_TEST_CHECK (smm_connection_metrics_listen (conn, "127.0.0.1", 0));
+	SMM_TEST_CHECK (!smm_connection_metrics_listen (conn, "127.0.0.1", 0));
+}
+
+int
+main (void)
+{
+	char url[64];
+
+	alarm (60);
+
+	pid_t server = smm_test_stand_in_start (url, sizeof (url));
+
+	smm_connection conn = smm_asset_connect (url, "user", "pass");
+	SMM_TEST_CHECK (conn != NULL);
+	SMM_TEST_CHECK (smm_asset_connection_get_state (conn) == SMM_CONNECTION_CONNECTED);
+	smm_connection_set_low_bandwidth (conn, true, 5);
+	SMM_TEST_CHECK (smm_connection_add_link (conn, "127.0.0.1") == 0);
+	SMM_TEST_CHECK (smm_connection_add_link (conn, "127.0.0.1") == 1);
+
+	/* Every request gets through, in much less time than one after another would take */
+	double start = smm_test_seconds ();
+	SMM_TEST_CHECK (run_workers (conn, false) == THREADS * REQUESTS);
+	double elapsed = smm_test_seconds () - start;
+	printf ("%d requests from %d threads in %.2f s\n", THREADS * REQUESTS, THREADS, elapsed);
+	SMM_TEST_CHECK (elapsed < SERIAL_SECONDS / 2);
+
+	/* Requests cut off by a network change may fail, the rest must not */
+	size_t ok = run_workers (conn, true);
+	printf ("%zu of %d requests survived network changes\n", ok, THREADS * REQUESTS);
+	SMM_TEST_CHECK (ok > 0);
+
+	test_metrics (conn);
+
+	smm_connection_keep_warm (conn, 0);
+	smm_connection_watch_network (conn, false);
+
+	/* A probe only asks for the headers of the page */
+	smm_connection_rewarm (conn);
+	smm_test_stand_in_get (url, "/test/probes/?count=1");
+
+	smm_connection_close (conn);
+	smm_test_stand_in_stop (server);
+
+	return 0;
+}